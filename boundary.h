@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <stdint.h>
+
+#include "float_types.h"
+#include "sequence.h"
+
+// Stratified generators, which build values at the edges of a format directly instead of drawing
+// uniform bits and filtering or hoping to hit them. Each index falls in one stratum, a combination
+// like exponent and significand pattern, and only fills in what the stratum leaves open with random
+// bits. Strata are visited in a scattered order, a full cycle of them every strata values, so any
+// take(n * strata) covers each one n times and shorter sequences still spread over all of them.
+
+// A prime, so it's coprime with any number of strata and stepping by it visits each of them
+constexpr uint64_t stratum_stride = 2654435761;
+
+inline uint64_t stratum_of(uint64_t index, uint64_t strata) {
+    return index % strata * stratum_stride % strata;
+}
+
+// Values of T at every biased exponent, with every class of significand: zero, smallest, largest,
+// halfway and around it, a single random bit and random. At the largest exponent those are
+// infinities and NaNs with the smallest, largest and default payloads of both kinds. Exponent 0 also
+// gets a stratum for each bit of the fraction with only that bit set, so there are denormals of
+// every normalization shift. tword's explicit integer bit is also cleared in half of
+// the strata, which makes pseudo-denormals, unnormals, pseudo-infinities and pseudo-NaNs.
+template<class T>
+struct Boundary {
+    using value_type = T;
+
+    static constexpr int patterns = 8;
+    static constexpr int integer_bits = T::interger_bit_mask ? 2 : 1;
+    static constexpr int fraction_width = T::significand_width - (T::interger_bit_mask ? 1 : 0);
+    static constexpr uint64_t pattern_strata = uint64_t(T::exponent_max + 1) * integer_bits * patterns;
+    static constexpr uint64_t strata = pattern_strata + integer_bits * fraction_width;
+
+    CounterRng rng;
+    uint64_t rng_seed;
+
+    T operator()(uint64_t index, uint64_t &lane) const {
+        constexpr uint64_t fraction_max = (1ull << fraction_width) - 1;
+        constexpr uint64_t half = 1ull << (fraction_width - 1);
+
+        uint64_t random = rng(index, lane++);
+        uint64_t stratum = stratum_of(index, strata);
+
+        T value;
+        value.sign = random >> 63;
+
+        // The denormal shifts, after the patterns
+        if (stratum >= pattern_strata) {
+            stratum -= pattern_strata;
+            bool integer_bit = stratum / fraction_width % integer_bits == 0;
+            value.exponent = 0;
+            value.significand = (1ull << (stratum % fraction_width)) | (integer_bit ? T::interger_bit_mask : 0);
+            return value;
+        }
+
+        int pattern = stratum % patterns;
+        bool integer_bit = stratum / patterns % integer_bits == 0;
+        int exponent = stratum / patterns / integer_bits;
+
+        uint64_t fraction;
+        switch (pattern) {
+        case 0: fraction = 0; break;
+        case 1: fraction = 1; break;
+        case 2: fraction = fraction_max; break;
+        case 3: fraction = half; break; // the default quiet NaN
+        case 4: fraction = half | 1; break;
+        case 5: fraction = half - 1; break; // the signaling NaN with the largest payload
+        case 6: fraction = 1ull << (random % fraction_width); break;
+        default: fraction = random & fraction_max; break;
+        }
+
+        value.exponent = exponent;
+        value.significand = fraction | (integer_bit ? T::interger_bit_mask : 0);
+        return value;
+    }
+
+    uint64_t seed() const { return rng_seed; }
+
+    Boundary reseeded(uint64_t seed) const { return {CounterRng(seed), seed}; }
+};
+
+// twords that round to T, at every exponent T rounds them to differently: from below half its
+// smallest denormal, through each denormal shift and the normal range, to overflow. Exponents are
+// T's biased ones, like in soft_x87's compress. The bits rounded off are exactly zero, just above
+// zero, halfway and one either side of it, all ones or random, under random kept bits of either
+// parity, or under all ones kept bits so rounding up carries into the exponent. Where a denormal
+// rounds off all 64 bits of the significand, halfway is the integer bit.
+template<class T>
+struct RoundingPoints {
+    using value_type = tword;
+
+    static_assert(!T::interger_bit_mask, "Only for formats narrower than tword");
+
+    static constexpr int min_exponent = -T::significand_width - 2;
+    static constexpr int max_exponent = T::exponent_max + 1;
+    static constexpr int patterns = 9;
+    static constexpr uint64_t strata = uint64_t(max_exponent - min_exponent + 1) * patterns;
+
+    CounterRng rng;
+    uint64_t rng_seed;
+
+    tword operator()(uint64_t index, uint64_t &lane) const {
+        uint64_t random = rng(index, lane++);
+        uint64_t kept = rng(index, lane++);
+        uint64_t stratum = stratum_of(index, strata);
+        int pattern = stratum % patterns;
+        int exponent = min_exponent + int(stratum / patterns);
+
+        // The bits below T's significand, and one more for each step the exponent is below 1
+        int shift = std::min(64, 63 - T::significand_width + std::max(0, 1 - exponent));
+        uint64_t tail_mask = shift == 64 ? ~0ull : (1ull << shift) - 1;
+        uint64_t half = 1ull << (shift - 1);
+
+        uint64_t tail;
+        switch (pattern) {
+        case 0: tail = 0; break;
+        case 1: tail = 1; break;
+        case 2: tail = half - 1; break;
+        case 3: tail = half; break;
+        case 4: tail = half + 1; break;
+        case 5: tail = tail_mask; break;
+        case 6: kept = ~0ull; tail = half; break;
+        case 7: kept = ~0ull; tail = tail_mask; break;
+        default: tail = random & tail_mask; break;
+        }
+
+        tword value;
+        value.sign = random >> 63;
+        value.exponent = exponent - T::exponent_bias + tword::exponent_bias;
+        value.significand = (kept & ~tail_mask) | tail | tword::interger_bit_mask;
+        return value;
+    }
+
+    uint64_t seed() const { return rng_seed; }
+
+    RoundingPoints reseeded(uint64_t seed) const { return {CounterRng(seed), seed}; }
+};
+
+template<class T>
+Boundary<T> boundary(uint64_t seed = 0) {
+    return Boundary<T>{CounterRng(seed), seed};
+}
+
+template<class T>
+RoundingPoints<T> rounding_points(uint64_t seed = 0) {
+    return RoundingPoints<T>{CounterRng(seed), seed};
+}
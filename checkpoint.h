@@ -0,0 +1,49 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Progress through long running sweeps, saved to disk so an interrupted run
+// can be resumed where it stopped. The file is one "name next_index" pair per line.
+class Checkpoint {
+public:
+    explicit Checkpoint(std::string path) : path(path) {
+        FILE *f = fopen(path.c_str(), "r");
+        if (!f)
+            return;
+
+        char name[256];
+        unsigned long long next;
+        while (fscanf(f, "%255s %llu", name, &next) == 2)
+            progress[name] = next;
+        fclose(f);
+    }
+
+    uint64_t get(const std::string &name) const {
+        auto it = progress.find(name);
+        return it == progress.end() ? 0 : it->second;
+    }
+
+    // Records that everything before next is done.
+    // Written to a temporary file and renamed, so a kill never leaves a torn checkpoint.
+    bool set(const std::string &name, uint64_t next) {
+        progress[name] = next;
+
+        std::string temp = path + ".tmp";
+        FILE *f = fopen(temp.c_str(), "w");
+        if (!f)
+            return false;
+        for (auto &[n, index] : progress)
+            fprintf(f, "%s %llu\n", n.c_str(), (unsigned long long)index);
+        bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+        ok = fclose(f) == 0 && ok;
+        return ok && rename(temp.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    std::string path;
+    std::map<std::string, uint64_t> progress;
+};
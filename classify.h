@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <stdint.h>
+
+#include <fmt/format.h>
+
+#include "float_types.h"
+#include "mismatch_log.h"
+#include "ops.h"
+
+// Sorts mismatches into buckets that roughly correspond to root causes, so a broken build
+// that gets millions of cases wrong prints a handful of examples per cause and a ranked summary,
+// instead of millions of lines. There's a fixed number of possible buckets, so memory stays bounded.
+
+enum class InputClass : uint8_t {
+    integer,
+    zero,
+    normal,
+    denormal,
+    pseudo_denormal, // 80bit only, zero exponent with the integer bit set
+    unnormal,        // 80bit only, integer bit clear with a non-zero exponent
+    infinity,
+    nan,
+    pseudo_nan,      // 80bit only, max exponent with the integer bit clear
+};
+
+// The bits dropped when rounding to a narrower type, compared to half an ulp
+enum class RoundingBits : uint8_t {
+    none, // not a narrowing conversion
+    exact,
+    below_half,
+    half_even,
+    half_odd,
+    above_half,
+};
+
+// Where the input's exponent lands in the range of the result type
+enum class ExponentBand : uint8_t {
+    none,
+    underflow,
+    denormal,
+    normal,
+    overflow,
+};
+
+inline const char *class_name(InputClass c) {
+    switch (c) {
+    case InputClass::integer:         return "integer";
+    case InputClass::zero:            return "zero";
+    case InputClass::normal:          return "normal";
+    case InputClass::denormal:        return "denormal";
+    case InputClass::pseudo_denormal: return "pseudo-denormal";
+    case InputClass::unnormal:        return "unnormal";
+    case InputClass::infinity:        return "infinity";
+    case InputClass::nan:             return "nan";
+    case InputClass::pseudo_nan:      return "pseudo-nan";
+    }
+    return "unknown";
+}
+
+inline const char *rounding_name(RoundingBits r) {
+    switch (r) {
+    case RoundingBits::none:       return "-";
+    case RoundingBits::exact:      return "exact";
+    case RoundingBits::below_half: return "<0.5";
+    case RoundingBits::half_even:  return "0.5 even";
+    case RoundingBits::half_odd:   return "0.5 odd";
+    case RoundingBits::above_half: return ">0.5";
+    }
+    return "unknown";
+}
+
+inline const char *band_name(ExponentBand b) {
+    switch (b) {
+    case ExponentBand::none:      return "-";
+    case ExponentBand::underflow: return "underflow";
+    case ExponentBand::denormal:  return "denormal";
+    case ExponentBand::normal:    return "normal";
+    case ExponentBand::overflow:  return "overflow";
+    }
+    return "unknown";
+}
+
+struct BucketKey {
+    OpCode op;
+    TypeCode in_type;
+    TypeCode out_type;
+    InputClass input_class;
+    RoundingBits rounding;
+    ExponentBand band;
+
+    friend bool operator<(const BucketKey &lhs, const BucketKey &rhs) {
+        return std::tie(lhs.op, lhs.in_type, lhs.out_type, lhs.input_class, lhs.rounding, lhs.band)
+             < std::tie(rhs.op, rhs.in_type, rhs.out_type, rhs.input_class, rhs.rounding, rhs.band);
+    }
+};
+
+template<class T>
+InputClass input_class(T val) {
+    if constexpr (std::is_integral<T>::value) {
+        return InputClass::integer;
+    } else {
+        bool integer_bit = !T::interger_bit_mask || (val.significand & T::interger_bit_mask);
+        uint64_t fraction = val.significand & ~T::interger_bit_mask;
+
+        if (val.exponent == T::exponent_max) {
+            if (!integer_bit)
+                return InputClass::pseudo_nan;
+            return fraction ? InputClass::nan : InputClass::infinity;
+        }
+        if (val.exponent == 0) {
+            if (val.significand == 0)
+                return InputClass::zero;
+            return T::interger_bit_mask && integer_bit ? InputClass::pseudo_denormal : InputClass::denormal;
+        }
+        return integer_bit ? InputClass::normal : InputClass::unnormal;
+    }
+}
+
+// Arithmetic goes by the more unusual of its two operands
+template<class B>
+InputClass input_class(Operands<B> in) {
+    return std::max(input_class(in.a), input_class(in.b));
+}
+
+template<class In, class Out>
+BucketKey classify(OpCode op, In in) {
+    BucketKey key = { op, type_code<In>(), type_code<Out>(), input_class(in), RoundingBits::none, ExponentBand::none };
+
+    if constexpr (!std::is_integral<In>::value && !is_operands<In>::value) {
+        if (op != OpCode::convert)
+            return key;
+        if (key.input_class == InputClass::zero || key.input_class == InputClass::infinity
+                || key.input_class == InputClass::nan || key.input_class == InputClass::pseudo_nan)
+            return key;
+
+        // Exponent the value would have in Out, same as the conversion computes it
+        int exponent = int(in.exponent) - In::exponent_bias + Out::exponent_bias;
+        if (exponent >= Out::exponent_max)
+            key.band = ExponentBand::overflow;
+        else if (exponent < -Out::significand_width)
+            key.band = ExponentBand::underflow;
+        else if (exponent <= 0)
+            key.band = ExponentBand::denormal;
+        else
+            key.band = ExponentBand::normal;
+
+        // Narrowing conversions, classify the bits that get rounded off
+        if constexpr (In::significand_width > Out::significand_width) {
+            if (key.band == ExponentBand::normal || key.band == ExponentBand::denormal) {
+                int shift = (In::significand_width - (In::interger_bit_mask ? 1 : 0)) - Out::significand_width;
+                uint64_t significand = in.significand;
+                if (key.band == ExponentBand::denormal) {
+                    significand |= In::interger_bit_mask;
+                    shift += 1 - exponent;
+                }
+
+                uint64_t half = 1ull << (shift - 1);
+                uint64_t dropped = shift >= 64 ? significand : significand & ((half << 1) - 1);
+                bool odd = shift < 64 && ((significand >> shift) & 1);
+
+                if (dropped == 0)
+                    key.rounding = RoundingBits::exact;
+                else if (dropped < half)
+                    key.rounding = RoundingBits::below_half;
+                else if (dropped > half)
+                    key.rounding = RoundingBits::above_half;
+                else
+                    key.rounding = odd ? RoundingBits::half_odd : RoundingBits::half_even;
+            }
+        }
+    }
+    return key;
+}
+
+inline BucketKey classify(const MismatchRecord &record) {
+    BucketKey key = { record.op, record.in_type, record.out_type, InputClass::integer, RoundingBits::none, ExponentBand::none };
+    with_values(record, [&] (auto in, auto a, auto) {
+        key = classify<decltype(in), decltype(a)>(record.op, in);
+    });
+    return key;
+}
+
+// Counts mismatches per bucket, and keeps the first few of each as examples to print
+class MismatchBuckets {
+public:
+    static constexpr size_t exemplars_per_bucket = 4;
+
+    struct Bucket {
+        uint64_t count = 0;
+        std::vector<MismatchRecord> exemplars;
+    };
+
+    // Returns the number of mismatches seen in key's bucket, including this one
+    uint64_t add(const BucketKey &key, const MismatchRecord &record) {
+        Bucket &bucket = buckets[key];
+        if (bucket.exemplars.size() < exemplars_per_bucket)
+            bucket.exemplars.push_back(record);
+        total++;
+        return ++bucket.count;
+    }
+
+    uint64_t size() const { return total; }
+
+    // Prints every bucket, most common first
+    void summary(FILE *out) const {
+        if (total == 0)
+            return;
+
+        std::vector<std::pair<BucketKey, const Bucket*>> ranked;
+        for (auto &[key, bucket] : buckets)
+            ranked.emplace_back(key, &bucket);
+        std::stable_sort(ranked.begin(), ranked.end(), [] (auto &lhs, auto &rhs) {
+            return lhs.second->count > rhs.second->count;
+        });
+
+        fmt::print(out, "{} mismatches in {} buckets:\n", total, ranked.size());
+        fmt::print(out, "{:>10} {:<8} {:<13} {:<15} {:<9} {:<9} {}\n",
+                   "count", "op", "types", "class", "rounding", "band", "example");
+        for (auto &[key, bucket] : ranked) {
+            fmt::print(out, "{:>10} {:<8} {:<13} {:<15} {:<9} {:<9} {}\n", bucket->count, op_name(key.op),
+                       fmt::format("{}->{}", type_name(key.in_type), type_name(key.out_type)),
+                       class_name(key.input_class), rounding_name(key.rounding), band_name(key.band),
+                       describe(bucket->exemplars.front()));
+            // The rest of the kept examples go under the first
+            for (size_t i = 1; i < bucket->exemplars.size(); i++)
+                fmt::print(out, "{:70}{}\n", "", describe(bucket->exemplars[i]));
+        }
+    }
+
+private:
+    std::map<BucketKey, Bucket> buckets;
+    uint64_t total = 0;
+};
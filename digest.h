@@ -0,0 +1,257 @@
+#pragma once
+
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fmt/format.h>
+
+#include "golden.h"
+
+// Digests reduce one fpu's results to 128 bits per shard, so two runs can be compared without
+// both fpus being on the same machine at the same time, or without keeping either's results.
+// Every shard's digest is the digest of its blocks' digests, and those are kept too, so a shard
+// that differs between runs can be narrowed down to the blocks that differ. A run that checks
+// digests also keeps the results of the first blocks that differ, and saves them with its own
+// digests, so checking those in the other run names every value that differs.
+//
+// A digest file is a text file: a "x87digest version shard_size block_size" line, then for every
+// compare a "section op in out cw seed begin end fpu phase" line, followed by a line for each of its
+// shards with the shard's digest and then its blocks', in hex. A shard's line can be followed by
+// "values block result..." lines with the results of its blocks that were kept, each as the hex of
+// its bytes in memory order. Sections are keyed like golden files' sections.
+
+// A rolling hash of values in order. Two 64 bit lanes with their own multipliers, each with the
+// lane's state mixed back in, so neither reordering nor a change in either lane goes unnoticed.
+struct Digest {
+    uint64_t lo = 0x6a09e667f3bcc908;
+    uint64_t hi = 0xbb67ae8584caa73b;
+
+    void add(const void *data, size_t size) {
+        const uint8_t *bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; i += 8) {
+            uint64_t word = 0;
+            memcpy(&word, bytes + i, std::min<size_t>(8, size - i));
+            lo = (lo ^ word) * 0x9e3779b97f4a7c15;
+            hi = (hi ^ word ^ (lo >> 32)) * 0xc2b2ae3d27d4eb4f;
+            lo ^= lo >> 29;
+            hi ^= hi >> 31;
+        }
+    }
+
+    template<class T>
+    void add(const T &value) { add(&value, sizeof(T)); }
+
+    friend bool operator==(const Digest &a, const Digest &b) { return a.lo == b.lo && a.hi == b.hi; }
+    friend bool operator!=(const Digest &a, const Digest &b) { return !(a == b); }
+
+    std::string to_string() const { return fmt::format("{:016x}{:016x}", hi, lo); }
+};
+
+// The results of one block of a shard
+struct BlockValues {
+    uint32_t block;
+    uint32_t value_size;
+    std::vector<uint8_t> bits; // value_size bytes of each result, in order
+
+    size_t count() const { return value_size ? bits.size() / value_size : 0; }
+    const uint8_t *value(size_t index) const { return bits.data() + index * value_size; }
+};
+
+struct ShardDigest {
+    Digest whole; // of the blocks' digests
+    std::vector<Digest> blocks;
+    std::vector<BlockValues> values; // of the blocks that were kept, in order
+
+    const BlockValues *values_of(size_t block) const {
+        for (const BlockValues &v : values) {
+            if (v.block == block)
+                return &v;
+        }
+        return nullptr;
+    }
+};
+
+struct DigestSection {
+    GoldenSection key; // chunk_table and chunk_count are unused
+    std::string fpu;   // name of the fpu the digests are of
+    std::vector<ShardDigest> shards;
+};
+
+class DigestWriter {
+public:
+    DigestWriter(const std::string &path, uint32_t shard_size, uint32_t block_size) : path(path) {
+        file = fopen(path.c_str(), "w");
+        if (file)
+            fmt::print(file, "x87digest {} {} {}\n", current_version, shard_size, block_size);
+    }
+
+    ~DigestWriter() { close(); }
+
+    DigestWriter(const DigestWriter&) = delete;
+    DigestWriter& operator=(const DigestWriter&) = delete;
+
+    bool ok() const { return file && !ferror(file); }
+    const std::string &name() const { return path; }
+
+    void add(const DigestSection &section) {
+        if (!file)
+            return;
+        const GoldenSection &k = section.key;
+        fmt::print(file, "section {} {} {} {:#06x} {} {} {} {} {}\n", int(k.op), int(k.in_type), int(k.out_type),
+                   k.control_word, k.seed, k.begin, k.end, section.fpu, k.phase);
+        for (const ShardDigest &shard : section.shards) {
+            fmt::print(file, "{}", shard.whole.to_string());
+            for (const Digest &block : shard.blocks)
+                fmt::print(file, " {}", block.to_string());
+            fmt::print(file, "\n");
+
+            for (const BlockValues &v : shard.values) {
+                fmt::memory_buffer line;
+                fmt::format_to(std::back_inserter(line), "values {}", v.block);
+                for (size_t i = 0; i < v.bits.size(); i++) {
+                    if (i % v.value_size == 0)
+                        line.push_back(' ');
+                    fmt::format_to(std::back_inserter(line), "{:02x}", v.bits[i]);
+                }
+                line.push_back('\n');
+                fwrite(line.data(), 1, line.size(), file);
+            }
+        }
+    }
+
+    // Returns false if anything failed to write
+    bool close() {
+        if (!file)
+            return false;
+        bool written = !ferror(file);
+        written = fclose(file) == 0 && written;
+        file = nullptr;
+        return written;
+    }
+
+    static constexpr int current_version = 3;
+
+private:
+    std::string path;
+    FILE *file = nullptr;
+};
+
+// Reads a whole digest file, they're about 30 KB per million values
+class DigestReader {
+public:
+    explicit DigestReader(const std::string &path) : path(path) {
+        FILE *f = fopen(path.c_str(), "r");
+        if (!f) {
+            problem = fmt::format("can't open {}: {}", path, strerror(errno));
+            return;
+        }
+        problem = parse(f);
+        fclose(f);
+    }
+
+    // Empty if the file is usable
+    const std::string &error() const { return problem; }
+    const std::string &name() const { return path; }
+
+    uint32_t shard_size() const { return shards; }
+    uint32_t block_size() const { return blocks; }
+    size_t section_count() const { return sections.size(); }
+    const DigestSection &section(size_t index) const { return sections[index]; }
+
+private:
+    std::string parse(FILE *f) {
+        std::string not_digests = fmt::format("{} is not a digest file, or from an incompatible version", path);
+        int version;
+        if (fscanf(f, "x87digest %d %u %u\n", &version, &shards, &blocks) != 3 || version != DigestWriter::current_version)
+            return not_digests;
+
+        // Shard lines grow with the blocks per shard, so lines are read whole
+        char *line = nullptr;
+        size_t capacity = 0;
+        std::string problem;
+        for (int number = 2; problem.empty() && getline(&line, &capacity, f) > 0; number++) {
+            unsigned op, in, out, cw;
+            unsigned long long seed, begin, end;
+            char fpu[32];
+            int phase = 0;
+            ShardDigest shard;
+
+            if (sscanf(line, "section %u %u %u %x %llu %llu %llu %31s %n", &op, &in, &out, &cw, &seed, &begin, &end,
+                       fpu, &phase) == 8 && phase) {
+                DigestSection section;
+                section.key = {};
+                section.key.op = OpCode(op);
+                section.key.in_type = TypeCode(in);
+                section.key.out_type = TypeCode(out);
+                section.key.control_word = cw;
+                section.key.seed = seed;
+                section.key.begin = begin;
+                section.key.end = end;
+                section.fpu = fpu;
+                snprintf(section.key.phase, sizeof(section.key.phase), "%.*s", int(strcspn(line + phase, "\n")),
+                         line + phase);
+                sections.push_back(std::move(section));
+            } else if (!sections.empty() && parse_shard(line, shard)) {
+                sections.back().shards.push_back(std::move(shard));
+            } else if (!sections.empty() && !sections.back().shards.empty() && strncmp(line, "values ", 7) == 0) {
+                BlockValues values;
+                if (parse_values(line, values))
+                    sections.back().shards.back().values.push_back(std::move(values));
+                else
+                    problem = fmt::format("{}:{}: {}", path, number, not_digests);
+            } else {
+                problem = fmt::format("{}:{}: {}", path, number, not_digests);
+            }
+        }
+        free(line);
+        return problem;
+    }
+
+    // A shard's digest, then its blocks', separated by spaces
+    static bool parse_shard(const char *line, ShardDigest &shard) {
+        unsigned long long hi, lo;
+        int length = 0;
+        if (sscanf(line, "%16llx%16llx%n", &hi, &lo, &length) != 2 || length != 32)
+            return false;
+        shard.whole = { lo, hi };
+        for (line += length; *line == ' '; line += length) {
+            if (sscanf(line, " %16llx%16llx%n", &hi, &lo, &length) != 2 || length != 33)
+                return false;
+            shard.blocks.push_back({ lo, hi });
+        }
+        return *line == '\n' || *line == 0;
+    }
+
+    // "values", the block, then each result's bytes in hex, all the same size
+    static bool parse_values(const char *line, BlockValues &values) {
+        int length = 0;
+        if (sscanf(line, "values %u%n", &values.block, &length) != 1)
+            return false;
+        values.value_size = 0;
+        for (line += length; *line == ' '; line += length) {
+            length = 1 + strspn(line + 1, "0123456789abcdef");
+            size_t size = (length - 1) / 2;
+            if (size == 0 || (length - 1) % 2 || (values.value_size && size != values.value_size))
+                return false;
+            values.value_size = size;
+            for (size_t i = 0; i < size; i++) {
+                char byte[3] = { line[1 + 2 * i], line[2 + 2 * i], 0 };
+                values.bits.push_back(uint8_t(strtoul(byte, nullptr, 16)));
+            }
+        }
+        return values.value_size && (*line == '\n' || *line == 0);
+    }
+
+    std::string path;
+    std::string problem;
+    uint32_t shards = 0;
+    uint32_t blocks = 0;
+    std::vector<DigestSection> sections;
+};
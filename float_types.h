@@ -1,7 +1,9 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
 #include <string>
+#include <type_traits>
 #include <fmt/format.h>
 
 template<size_t sig_size, size_t exp_size, bool has_int_bit = false, bool has_sign_bit = true>
@@ -88,4 +90,22 @@ using dword = soft_float<23, 8>;
 
 static_assert(sizeof(tword) == 10, "tword wrong size");
 static_assert(sizeof(qword) == 8,  "qword wrong size");
-static_assert(sizeof(dword) == 4,  "dword wrong size");
\ No newline at end of file
+static_assert(sizeof(dword) == 4,  "dword wrong size");
+
+// The two operands of an arithmetic instruction, a ends up in ST(0) and b is the memory operand,
+// or the other register for twords
+template<class B>
+struct Operands {
+    tword a;
+    B b;
+
+    std::string to_string() {
+        return a.to_string() + " " + b.to_string();
+    }
+};
+
+template<class T>
+struct is_operands : std::false_type {};
+
+template<class B>
+struct is_operands<Operands<B>> : std::true_type {};
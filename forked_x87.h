@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include "float_types.h"
+#include "mismatch_log.h"
+#include "ops.h"
+#include "ring.h"
+#include "x87.h"
+
+// Runs an fpu in a forked worker process, so an instruction that traps or crashes takes down the
+// worker instead of the whole run. This is what makes unmasked exceptions on hard_x87 testable.
+//
+// Batches of inputs go to the worker through a lock-free ring in shared memory, and the results
+// come back through a second one. start sends a batch and finish waits for its results, so the
+// caller can run the other fpu in the meantime.
+//
+// A worker that dies is replaced, and the new one restarts at the batch it died on, running it one
+// value at a time and waiting for pending exceptions after each. Its death then pins down the input
+// responsible, which finish returns as a Trap with a zero result, and another worker carries on
+// with the rest of the batch. Ops are rebuilt in the worker from their codes, like x87replay does,
+// so only the ops in ops.h can run, and only through execute_start and execute_finish.
+template<class Fpu>
+class forked_x87 {
+public:
+    static constexpr size_t batch_capacity = 1 << 10;
+
+    forked_x87() {
+        void *memory = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            fmt::print(stderr, "can't map memory for a worker process: {}\n", strerror(errno));
+            abort();
+        }
+        shared = new (memory) Shared();
+        spawn();
+    }
+
+    ~forked_x87() {
+        kill(worker, SIGKILL);
+        waitpid(worker, nullptr, 0);
+        shared->~Shared();
+        munmap(shared, sizeof(Shared));
+    }
+
+    forked_x87(const forked_x87&) = delete;
+    forked_x87& operator=(const forked_x87&) = delete;
+
+    // Sent along with every batch
+    void fldcw(uint16_t cw) { control_word = cw; }
+    uint16_t fstcw() const { return control_word; }
+
+    // How many times a worker died and was replaced
+    uint64_t deaths() const { return died; }
+
+    // Sends the first batch_capacity values to the worker. Two batches can be in flight at once.
+    template<class Op, class In, class Out>
+    void start(const Op &, const In *in, Out *, size_t count) {
+        static_assert(sizeof(In) <= max_input_size && sizeof(Out) <= max_output_size, "Value too large to send");
+
+        Batch *batch = wait_for([this] { return shared->batches.wait_producer_slot(poll_interval); });
+        batch->op = Op::code;
+        batch->in_type = type_code<In>();
+        batch->out_type = type_code<Out>();
+        batch->control_word = control_word;
+        batch->sequence = started++;
+        batch->count = std::min(count, batch_capacity);
+        batch->first = 0;
+        batch->careful = false;
+        memcpy(batch->inputs, in, batch->count * sizeof(In));
+
+        trapped.emplace_back();
+        shared->batches.publish();
+    }
+
+    // Waits for the results of the oldest batch in flight, and runs any values start didn't send.
+    // Returns the inputs that killed a worker, in order.
+    template<class Op, class In, class Out>
+    std::vector<Trap> finish(const Op &op, const In *in, Out *out, size_t count) {
+        size_t sent = std::min(count, batch_capacity);
+        Results *results = wait_for([this] { return shared->results.wait_consumer_slot(poll_interval); });
+        memcpy(out, results->outputs, sent * sizeof(Out));
+        shared->results.release();
+
+        std::vector<Trap> traps = std::move(trapped.front());
+        trapped.pop_front();
+        finished++;
+        for (const Trap &trap : traps)
+            out[trap.index] = Out();
+
+        for (size_t done = sent; done < count; done += batch_capacity) {
+            size_t n = std::min(count - done, batch_capacity);
+            start(op, in + done, out + done, n);
+            for (Trap &trap : finish(op, in + done, out + done, n)) {
+                trap.index += done;
+                traps.push_back(std::move(trap));
+            }
+        }
+        return traps;
+    }
+
+private:
+    static constexpr size_t max_input_size = sizeof(Operands<tword>);
+    static constexpr size_t max_output_size = sizeof(tword);
+    static constexpr std::chrono::milliseconds poll_interval{1};
+
+    struct Batch {
+        OpCode op;
+        TypeCode in_type;
+        TypeCode out_type;
+        uint16_t control_word;
+        uint32_t sequence;
+        uint32_t count;
+        uint32_t first;   // the values before it are done, set when a worker died on the one before it
+        bool careful;     // one value at a time, set when a worker died on this batch
+        alignas(16) uint8_t inputs[batch_capacity * max_input_size];
+    };
+
+    struct Results {
+        alignas(16) uint8_t outputs[batch_capacity * max_output_size];
+    };
+
+    struct Shared {
+        SpscRing<Batch, 2> batches;
+        SpscRing<Results, 2> results;
+        std::atomic<uint32_t> progress{0}; // the value a careful worker is running
+    };
+
+    void spawn() {
+        pid_t parent = getpid();
+        worker = fork();
+        if (worker < 0) {
+            fmt::print(stderr, "can't fork a worker process: {}\n", strerror(errno));
+            abort();
+        }
+        if (worker == 0) {
+            // Dies with the thread that forked it, the parent may have died before this was set
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (getppid() != parent)
+                _exit(0);
+
+            // Not pinned to the forking thread's core like the runner's threads, so it can run alongside them
+            cpu_set_t cpus;
+            if (sched_getaffinity(parent, sizeof(cpus), &cpus) == 0)
+                sched_setaffinity(0, sizeof(cpus), &cpus);
+            worker_loop();
+        }
+    }
+
+    [[noreturn]] void worker_loop() {
+        Fpu fpu;
+
+        // A worker that died after publishing its last results, but before releasing the batch
+        if (shared->results.total_published() != shared->batches.total_released())
+            shared->batches.release();
+
+        while (true) {
+            Batch *batch = shared->batches.wait_consumer_slot(std::chrono::seconds(1));
+            if (!batch)
+                continue;
+
+            // A worker that died mid-batch left its slot reserved, with the results before first in it
+            Results *results = shared->results.wait_producer_slot(std::chrono::hours(1));
+            if (!results)
+                continue;
+
+            run(fpu, *batch, *results);
+            shared->results.publish();
+            shared->batches.release();
+        }
+    }
+
+    void run(Fpu &fpu, const Batch &batch, Results &results) {
+        with_type<int16_t, int32_t, int64_t, dword, qword, tword, Operands<dword>, Operands<qword>,
+                  Operands<tword>>(batch.in_type, [&] (auto in) {
+            using In = decltype(in);
+            with_type<dword, qword, tword>(batch.out_type, [&] (auto out) {
+                using Out = decltype(out);
+                with_op<In, Out>(batch.op, [&] (auto op) {
+                    const In *inputs = reinterpret_cast<const In*>(batch.inputs);
+                    Out *outputs = reinterpret_cast<Out*>(results.outputs);
+
+                    // Flags left over from the last batch would trap as soon as they're unmasked
+                    fpu.fclex();
+                    fpu.fldcw(batch.control_word);
+                    if (!batch.careful) {
+                        execute(fpu, op, inputs, outputs, batch.count);
+                        fpu.fwait();
+                        return;
+                    }
+                    for (uint32_t i = batch.first; i < batch.count; i++) {
+                        shared->progress.store(i, std::memory_order_relaxed);
+                        outputs[i] = op(fpu, inputs[i]);
+                        fpu.fwait();
+                    }
+                });
+            });
+        });
+    }
+
+    // Polls get, replacing the worker whenever it died
+    template<class Get>
+    auto wait_for(Get get) {
+        while (true) {
+            if (auto *slot = get())
+                return slot;
+
+            int status;
+            if (waitpid(worker, &status, WNOHANG) == worker)
+                replace(status);
+        }
+    }
+
+    // Only this process touches the rings until the new worker starts
+    void replace(int status) {
+        died++;
+        Batch *batch = shared->batches.consumer_slot();
+        bool published = shared->results.total_published() != shared->batches.total_released();
+
+        if (batch && !published) {
+            if (batch->careful) {
+                uint32_t index = shared->progress.load(std::memory_order_relaxed);
+                trapped[batch->sequence - finished].push_back({ index, describe_status(status) });
+                batch->first = index + 1;
+            } else {
+                batch->careful = true;
+            }
+        }
+        spawn();
+    }
+
+    static std::string describe_status(int status) {
+        if (WIFSIGNALED(status))
+            return fmt::format("killed by {}", strsignal(WTERMSIG(status)));
+        return fmt::format("exited with {}", WEXITSTATUS(status));
+    }
+
+    Shared *shared;
+    pid_t worker;
+    uint16_t control_word = default_control_word;
+    uint64_t died = 0;
+
+    uint32_t started = 0;  // batches sent
+    uint32_t finished = 0; // batches collected
+    std::deque<std::vector<Trap>> trapped; // inputs that killed a worker, of each batch in flight
+};
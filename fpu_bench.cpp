@@ -0,0 +1,89 @@
+// Microbenchmark comparing calls through the virtual x87 interface against calling
+// soft_x87 and hard_x87 directly, as the templated test drivers do.
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "float_types.h"
+#include "ops.h"
+#include "real_x87.h"
+#include "sequence.h"
+#include "soft_x87.h"
+
+constexpr size_t length = 4'000'000;
+constexpr int repeats = 5;
+
+// Adds a second operand to each value before storing it
+template<class T>
+struct AddDword {
+    dword addend;
+
+    template<class Fpu>
+    tword operator()(Fpu &fpu, T val) const {
+        fpu.fld(val);
+        fpu.fadd(addend);
+        return fpu.template fstp<tword>();
+    }
+};
+
+// Runs op on every input one value at a time, returning ns per value
+template<class Fpu, class Op, class In, class Out>
+double run(Fpu &fpu, const Op &op, const std::vector<In> &in, std::vector<Out> &out) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < in.size(); i++)
+        out[i] = op(fpu, in[i]);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / in.size();
+}
+
+// Picks the implementation at runtime, like code using the virtual interface would
+std::unique_ptr<x87> make_virtual(const char *name) {
+    if (fmt::string_view(name) == "soft")
+        return std::make_unique<x87_adapter<soft_x87>>();
+    return std::make_unique<x87_adapter<hard_x87>>();
+}
+
+template<class Fpu, class Sequence, class Op>
+void compare(const char *fpu_name, const char *name, const Sequence &values, Op op) {
+    using In = typename Sequence::value_type;
+    using Out = decltype(op(std::declval<Fpu&>(), std::declval<In>()));
+
+    std::vector<In> in(values.begin(), values.end());
+    std::vector<Out> virtual_out(in.size());
+    std::vector<Out> direct_out(in.size());
+
+    auto virtual_fpu = make_virtual(fpu_name);
+    Fpu direct_fpu;
+
+    // Best of several alternating runs, to keep warmup and noise out of the ratio
+    double virtual_ns = 1e9;
+    double direct_ns = 1e9;
+    for (int i = 0; i < repeats; i++) {
+        virtual_ns = std::min(virtual_ns, run(*virtual_fpu, op, in, virtual_out));
+        direct_ns = std::min(direct_ns, run(direct_fpu, op, in, direct_out));
+    }
+
+    fmt::print("{:<4} {:<20} {:>8.2f} ns {:>8.2f} ns {:>7.2f}x{}\n", fpu_name, name, virtual_ns, direct_ns,
+               virtual_ns / direct_ns, virtual_out == direct_out ? "" : " (results differ!)");
+}
+
+template<class Fpu>
+void cases(const char *fpu_name) {
+    compare<Fpu>(fpu_name, "fld dword", uniform<dword>() | take(length), Load<dword>());
+    compare<Fpu>(fpu_name, "fld qword", uniform<qword>() | take(length), Load<qword>());
+    compare<Fpu>(fpu_name, "fild int32", uniform<int32_t>() | take(length), Load<int32_t>());
+    compare<Fpu>(fpu_name, "fstp dword", uniform<tword>() | take(length), Store<dword>());
+    compare<Fpu>(fpu_name, "fstp qword", uniform<tword>() | take(length), Store<qword>());
+    compare<Fpu>(fpu_name, "fadd dword", uniform<dword>() | take(length), AddDword<dword>{dword(0, 127, 0)});
+}
+
+int main() {
+    fmt::print("{:<4} {:<20} {:>11} {:>11} {:>8}\n", "fpu", "case", "virtual", "direct", "speedup");
+
+    cases<soft_x87>("soft");
+    cases<hard_x87>("hard");
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <fmt/format.h>
+
+#include "float_types.h"
+#include "sequence.h"
+#include "trace.h"
+#include "x87.h"
+
+// Random short x87 programs, for finding bugs that depend on the state of the stack.
+//
+// Programs are sequences of trace instructions, a few of which overflow or underflow the stack. Each
+// one runs on both fpus after an finit, and every store, the status word after every instruction, and
+// the final tag word and stack are compared. Program i of a seed is always the same program, so a
+// failure can be reproduced from its seed and index.
+
+using Program = std::vector<TraceInstruction>;
+
+// A random operand. Most are normal with exponents close to 1.0, so additions of them interact
+// and cancel, the rest are zeros, denormals, infinities, NaNs and completely random bits.
+template<class T>
+T fuzz_operand(uint64_t r1, uint64_t r2) {
+    if constexpr (std::is_integral<T>::value) {
+        // Random magnitudes, so small integers are as common as large ones
+        constexpr int bits = sizeof(T) * 8;
+        return T(int64_t(r1) >> (64 - bits + r2 % bits));
+    } else {
+        unsigned sign = r2 & 1;
+        uint64_t fraction = r1 & (~0ull >> (64 - T::significand_width)) & ~T::interger_bit_mask;
+        switch ((r2 >> 1) % 16) {
+        case 0:  return T(sign, 0, 0);
+        case 1:  return T(sign, 0, fraction | 1);
+        case 2:  return T(sign, T::exponent_max, T::interger_bit_mask);
+        case 3:  return T(sign, T::exponent_max, T::interger_bit_mask | fraction | 1);
+        case 4:  return random_value<T>(CounterRng(r1), r2);
+        default: return T(sign, T::exponent_bias - 8 + (r2 >> 8) % 16, T::interger_bit_mask | fraction);
+        }
+    }
+}
+
+// The register form of each arithmetic instruction, the other forms follow it in TraceOp
+constexpr std::array<TraceOp, 6> arithmetic = {
+    TraceOp::fadd_st, TraceOp::fsub_st, TraceOp::fsubr_st, TraceOp::fmul_st, TraceOp::fdiv_st, TraceOp::fdivr_st,
+};
+static_assert(int(TraceOp::fadd_m64) == int(TraceOp::fadd_st) + 3 && int(TraceOp::fdivr_m64) == int(TraceOp::fdivr_st) + 3,
+              "Arithmetic forms out of order");
+
+// Fills program with random program number index of rng, up to max_length instructions long.
+// Each program works towards a random stack depth, so all 8 registers get used. One instruction in
+// 64 ignores the depth, so stack faults get tested too.
+inline void random_program(const CounterRng &rng, uint64_t index, size_t max_length, Program &program) {
+    uint64_t lane = 0;
+    auto next = [&] { return rng(index, lane++); };
+
+    program.clear();
+    size_t length = 1 + next() % max_length;
+    int target = 1 + next() % 8;
+    int depth = 0;
+
+    while (program.size() < length) {
+        uint64_t r = next();
+        uint64_t r1 = next();
+        uint64_t r2 = next();
+
+        bool fault = r % 64 == 0;
+        r >>= 6;
+        bool push = fault ? r % 2 == 0 : depth == 0 || (depth < 8 && (depth < target ? r % 4 != 0 : r % 4 == 0));
+        int reach = fault ? 8 : depth; // the registers instructions read
+        r >>= 8;
+        TraceInstruction ins;
+        if (push) {
+            switch (r % 7) {
+            case 0:  ins = TraceInstruction::make(TraceOp::fld_m32, fuzz_operand<dword>(r1, r2)); break;
+            case 1:  ins = TraceInstruction::make(TraceOp::fld_m64, fuzz_operand<qword>(r1, r2)); break;
+            case 2:  ins = TraceInstruction::make(TraceOp::fld_m80, fuzz_operand<tword>(r1, r2)); break;
+            case 3:  ins = TraceInstruction::make(TraceOp::fild_m16, fuzz_operand<int16_t>(r1, r2)); break;
+            case 4:  ins = TraceInstruction::make(TraceOp::fild_m32, fuzz_operand<int32_t>(r1, r2)); break;
+            case 5:  ins = TraceInstruction::make(TraceOp::fild_m64, fuzz_operand<int64_t>(r1, r2)); break;
+            default: ins = reach ? TraceInstruction::make(TraceOp::fld_st, r1 % reach)
+                                 : TraceInstruction::make(TraceOp::fld_m64, fuzz_operand<qword>(r1, r2)); break;
+            }
+        } else {
+            // The arithmetic comes in groups of four: the register form, the popping form, m32 and m64
+            TraceOp group = arithmetic[r / 9 % arithmetic.size()];
+            switch (r % 9) {
+            case 0:
+            case 1:  ins = TraceInstruction::make(group, r1 % reach); break;
+            case 2:  ins = TraceInstruction::make(TraceOp(int(group) + 1), r1 % reach); break;
+            case 3:  ins = TraceInstruction::make(TraceOp(int(group) + 2), fuzz_operand<dword>(r1, r2)); break;
+            case 4:  ins = TraceInstruction::make(TraceOp(int(group) + 3), fuzz_operand<qword>(r1, r2)); break;
+            case 5:  ins = TraceInstruction::make(TraceOp::fsqrt); break;
+            case 6:  ins = TraceInstruction::make(TraceOp::fstp_m32); break;
+            case 7:  ins = TraceInstruction::make(TraceOp::fstp_m64); break;
+            default: ins = TraceInstruction::make(TraceOp::fstp_m80); break;
+            }
+        }
+        program.push_back(ins);
+        depth = std::clamp(depth + trace_stack_effect(ins.op), 0, 8);
+    }
+}
+
+// Runs program on both fpus from a fresh finit, and compares every store, the status word after every
+// instruction, and the final tag word and the registers it doesn't tag empty. With a listing, every
+// instruction is written to it, with the results that differ.
+template<class FpuA, class FpuB>
+bool programs_agree(FpuA &a, FpuB &b, const Program &program, fmt::memory_buffer *listing = nullptr) {
+    a.finit();
+    b.finit();
+
+    bool agree = true;
+    for (const TraceInstruction &ins : program) {
+        uint8_t stored_a[10], stored_b[10];
+        execute(a, ins, stored_a);
+        execute(b, ins, stored_b);
+        uint16_t status_a = a.fstsw() & defined_status;
+        uint16_t status_b = b.fstsw() & defined_status;
+
+        size_t size = trace_result_size(ins.op);
+        bool differ = size && memcmp(stored_a, stored_b, size) != 0;
+        agree &= !differ && status_a == status_b;
+
+        if (listing) {
+            fmt::format_to(std::back_inserter(*listing), "    {}", describe(ins));
+            if (differ)
+                fmt::format_to(std::back_inserter(*listing), ": stored {} and {}", describe_stored(ins.op, stored_a),
+                               describe_stored(ins.op, stored_b));
+            if (status_a != status_b)
+                fmt::format_to(std::back_inserter(*listing), ": status {:#06x} and {:#06x}", status_a, status_b);
+            fmt::format_to(std::back_inserter(*listing), "\n");
+        }
+    }
+
+    Environment env_a = a.fnstenv();
+    Environment env_b = b.fnstenv();
+    if (env_a.tag != env_b.tag) {
+        agree = false;
+        if (listing)
+            fmt::format_to(std::back_inserter(*listing), "    tag word {:#06x} and {:#06x}\n", env_a.tag, env_b.tag);
+    }
+
+    int top = (env_a.status & Status::top) >> Status::top_shift;
+    std::array<tword, 8> regs_a = a.registers();
+    std::array<tword, 8> regs_b = b.registers();
+    for (int i = 0; i < 8; i++) {
+        if (tag_of(env_a.tag, (top + i) & 7) == Tag::empty)
+            continue;
+        if (regs_a[i] != regs_b[i]) {
+            agree = false;
+            if (listing)
+                fmt::format_to(std::back_inserter(*listing), "    ST({}) {} and {}\n", i, describe(regs_a[i]),
+                               describe(regs_b[i]));
+        }
+    }
+    return agree;
+}
+
+// The instructions of program without their operands, and with all loads from memory alike.
+// Failures with the same shape are most likely the same bug.
+inline std::string program_shape(const Program &program) {
+    std::string shape;
+    for (const TraceInstruction &ins : program) {
+        if (trace_uses_st(ins.op))
+            shape += fmt::format("{}({})", trace_op_name(ins.op), ins.st);
+        else if (trace_stack_effect(ins.op) > 0)
+            shape += "load";
+        else if (trace_operand_size(ins.op))
+            shape += std::string(trace_op_name(ins.op), strcspn(trace_op_name(ins.op), " ")) + " m";
+        else
+            shape += trace_op_name(ins.op);
+        shape += "; ";
+    }
+    return shape;
+}
+
+// Bytes of a memory operand that only hold fraction or integer bits, which the shrinker clears
+constexpr size_t shrinkable_operand_bytes(TraceOp op) {
+    if (op == TraceOp::fild_m16 || op == TraceOp::fild_m32 || op == TraceOp::fild_m64)
+        return trace_operand_size(op);
+    switch (trace_operand_size(op)) {
+    case 4:  return 2;
+    case 8:  return 6;
+    case 10: return 7;
+    default: return 0;
+    }
+}
+
+// Shrinks a failing program to a minimal one that still fails. Removes chunks of instructions at
+// every offset, halving the chunk size down to single instructions, then lowers register indexes and clears the
+// low bytes of operands, and repeats until nothing changes. fails(program) reruns a candidate.
+template<class Fails>
+Program shrink_program(Program program, Fails fails) {
+    auto try_candidate = [&] (Program &candidate) {
+        if (!fails(candidate))
+            return false;
+        program = candidate;
+        return true;
+    };
+
+    bool progress = true;
+    while (progress) {
+        progress = false;
+
+        for (size_t chunk = std::max<size_t>(program.size() / 2, 1); ; chunk /= 2) {
+            for (size_t i = 0; i + chunk <= program.size(); ) {
+                Program candidate = program;
+                candidate.erase(candidate.begin() + i, candidate.begin() + i + chunk);
+                if (try_candidate(candidate))
+                    progress = true;
+                else
+                    i++;
+            }
+            if (chunk == 1)
+                break;
+        }
+
+        for (size_t i = 0; i < program.size(); i++) {
+            for (uint8_t st = 0; st < program[i].st; st++) {
+                Program candidate = program;
+                candidate[i].st = st;
+                if (try_candidate(candidate)) {
+                    progress = true;
+                    break;
+                }
+            }
+            for (size_t byte = 0; byte < shrinkable_operand_bytes(program[i].op); byte++) {
+                if (program[i].operand[byte] == 0)
+                    continue;
+                Program candidate = program;
+                candidate[i].operand[byte] = 0;
+                progress |= try_candidate(candidate);
+            }
+        }
+    }
+    return program;
+}
@@ -0,0 +1,366 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include "ops.h"
+
+// Golden files hold the reference fpu's results of a whole run, recorded once, so later runs can
+// check soft_x87 against them without the real fpu. That's for machines where the x87 is slow or
+// can't be trusted, like some VMs.
+//
+// Every compare the runner makes gets a section, with the shards of its values as chunks. A chunk
+// holds its results as their difference to soft_x87's, which are almost always the same, so what's
+// stored is mostly runs of zero bytes and packs to a few bytes per shard. A replay runs soft_x87
+// anyway, and rebuilds the results from its own as it goes. Each chunk also keeps a hash of its
+// inputs, so a replay notices when the inputs changed under it.
+//
+// The file is a GoldenHeader, then the chunks of each section followed by its chunk table and
+// GoldenSection, then a table of where every GoldenSection is and a GoldenTrailer. It's written in
+// one pass and read with mmap.
+
+struct GoldenHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t shard_size;
+
+    static constexpr char expected_magic[8] = { 'X', '8', '7', 'G', 'O', 'L', 'D', '\0' };
+    static constexpr uint32_t current_version = 2;
+};
+
+// What a compare ran, a replay refuses to use the section for anything else
+struct GoldenSection {
+    OpCode op;
+    TypeCode in_type;
+    TypeCode out_type;
+    uint16_t control_word;
+    uint16_t reserved;
+    uint64_t seed;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t chunk_table; // file offset of its GoldenChunks
+    uint64_t chunk_count;
+    char phase[64];       // for messages
+
+    bool same_run(const GoldenSection &other) const {
+        return op == other.op && in_type == other.in_type && out_type == other.out_type
+            && control_word == other.control_word && seed == other.seed && begin == other.begin && end == other.end;
+    }
+
+    std::string describe() const {
+        return fmt::format("\"{}\" {} {}->{} cw {:#06x} seed {} values {} to {}", phase, op_name(op), type_name(in_type),
+                           type_name(out_type), control_word, seed, begin, end);
+    }
+};
+
+struct GoldenChunk {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t input_hash;
+};
+
+struct GoldenTrailer {
+    uint64_t section_table; // file offset of the sections' offsets
+    uint64_t section_count;
+    char magic[8];
+};
+
+static_assert(std::is_trivially_copyable<GoldenSection>::value, "Sections are written as raw bytes");
+
+// A quick hash of size bytes, 8 at a time
+inline uint64_t hash_bytes(const void *data, size_t size, uint64_t hash = 0) {
+    const uint8_t *bytes = static_cast<const uint8_t*>(data);
+    auto mix = [&] (uint64_t word) {
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15;
+        hash ^= hash >> 29;
+    };
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        mix(word);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes + i, size - i);
+    mix(tail ^ size);
+    return hash;
+}
+
+// Appends n to out as a LEB128 varint
+inline void put_varint(std::vector<uint8_t> &out, uint64_t n) {
+    for (; n >= 0x80; n >>= 7)
+        out.push_back(uint8_t(n) | 0x80);
+    out.push_back(uint8_t(n));
+}
+
+// Packs count values as their difference to reference values they mostly match: both XORed byte by
+// byte, as runs of a varint count of zero bytes, a varint count of literal bytes and the literals.
+template<class T>
+std::vector<uint8_t> pack_deltas(const T *values, const T *reference, size_t count) {
+    const uint8_t *a = reinterpret_cast<const uint8_t*>(values);
+    const uint8_t *b = reinterpret_cast<const uint8_t*>(reference);
+    auto delta = [&] (size_t i) { return uint8_t(a[i] ^ b[i]); };
+    size_t size = count * sizeof(T);
+
+    std::vector<uint8_t> packed;
+    for (size_t i = 0; i < size;) {
+        size_t zeros = 0;
+        while (i + zeros < size && delta(i + zeros) == 0)
+            zeros++;
+        i += zeros;
+
+        // Literals up to the next two zeros, a single zero is cheaper as a literal than as a run
+        size_t literals = 0;
+        while (i + literals < size
+               && (delta(i + literals) != 0 || (i + literals + 1 < size && delta(i + literals + 1) != 0)))
+            literals++;
+
+        put_varint(packed, zeros);
+        put_varint(packed, literals);
+        for (size_t j = 0; j < literals; j++)
+            packed.push_back(delta(i + j));
+        i += literals;
+    }
+    return packed;
+}
+
+// Undoes pack_deltas a batch of values at a time, given the same reference values in order
+class DeltaUnpacker {
+public:
+    DeltaUnpacker(const uint8_t *packed, size_t size) : next(packed), end(packed + size) {}
+
+    // Rebuilds the next count values from their reference values. Returns false if the data doesn't
+    // unpack to them.
+    template<class T>
+    bool unpack(const T *reference, T *values, size_t count) {
+        memcpy(static_cast<void*>(values), reference, count * sizeof(T));
+        uint8_t *bytes = reinterpret_cast<uint8_t*>(values);
+        size_t size = count * sizeof(T);
+
+        for (size_t i = 0; i < size;) {
+            if (zeros == 0 && literals == 0 && !next_run())
+                return false;
+            size_t n = std::min<uint64_t>(zeros, size - i);
+            zeros -= n;
+            i += n;
+            for (; literals && i < size; literals--, i++)
+                bytes[i] ^= *next++;
+        }
+        return true;
+    }
+
+    // Whether all of the data was unpacked
+    bool finished() const { return next == end && zeros == 0 && literals == 0; }
+
+private:
+    bool next_run() {
+        return read_varint(zeros) && read_varint(literals) && zeros + literals > 0
+            && literals <= uint64_t(end - next);
+    }
+
+    bool read_varint(uint64_t &n) {
+        n = 0;
+        for (int shift = 0; shift < 64 && next != end; shift += 7) {
+            uint8_t byte = *next++;
+            n |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    const uint8_t *next;
+    const uint8_t *end;
+    uint64_t zeros = 0;    // left in the current run
+    uint64_t literals = 0;
+};
+
+class GoldenWriter {
+public:
+    GoldenWriter(const std::string &path, uint32_t shard_size) : path(path) {
+        file = fopen(path.c_str(), "wb");
+        if (!file)
+            return;
+
+        GoldenHeader header = {};
+        memcpy(header.magic, GoldenHeader::expected_magic, sizeof(header.magic));
+        header.version = GoldenHeader::current_version;
+        header.shard_size = shard_size;
+        write(&header, sizeof(header));
+    }
+
+    ~GoldenWriter() { close(); }
+
+    GoldenWriter(const GoldenWriter&) = delete;
+    GoldenWriter& operator=(const GoldenWriter&) = delete;
+
+    bool ok() const { return file && !failed; }
+    const std::string &name() const { return path; }
+
+    // Writes the section table and trailer, the file can't be read without them. Returns false if
+    // anything failed to write.
+    bool close() {
+        if (!file)
+            return false;
+
+        GoldenTrailer trailer = {};
+        trailer.section_count = sections.size();
+        memcpy(trailer.magic, GoldenHeader::expected_magic, sizeof(trailer.magic));
+        align();
+        trailer.section_table = offset;
+        write(sections.data(), sections.size() * sizeof(uint64_t));
+        write(&trailer, sizeof(trailer));
+        bool closed = fclose(file) == 0;
+        file = nullptr;
+        return closed && !failed;
+    }
+
+    // The chunks added until end_section are the shards of section, in order
+    void begin_section(const GoldenSection &section) {
+        current = section;
+        chunks.clear();
+    }
+
+    void add_chunk(uint64_t input_hash, const std::vector<uint8_t> &packed) {
+        chunks.push_back({ offset, packed.size(), input_hash });
+        write(packed.data(), packed.size());
+    }
+
+    void end_section() {
+        align();
+        current.chunk_table = offset;
+        current.chunk_count = chunks.size();
+        write(chunks.data(), chunks.size() * sizeof(GoldenChunk));
+        sections.push_back(offset);
+        write(&current, sizeof(current));
+    }
+
+private:
+    // Tables go at multiples of 8, so the reader can use them in place
+    void align() {
+        static const uint8_t zeros[8] = {};
+        write(zeros, (8 - offset % 8) % 8);
+    }
+
+    void write(const void *data, size_t size) {
+        if (size && fwrite(data, size, 1, file) != 1)
+            failed = true;
+        offset += size;
+    }
+
+    std::string path;
+    FILE *file = nullptr;
+    bool failed = false;
+    uint64_t offset = 0;
+
+    GoldenSection current = {};
+    std::vector<GoldenChunk> chunks;
+    std::vector<uint64_t> sections;
+};
+
+class GoldenReader {
+public:
+    explicit GoldenReader(const std::string &path) : path(path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            problem = fmt::format("can't open {}: {}", path, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+
+        size = st.st_size;
+        void *mapped = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            problem = fmt::format("can't map {}", path);
+            return;
+        }
+        data = static_cast<const uint8_t*>(mapped);
+        problem = validate();
+    }
+
+    ~GoldenReader() {
+        if (data)
+            munmap(const_cast<uint8_t*>(data), size);
+    }
+
+    GoldenReader(const GoldenReader&) = delete;
+    GoldenReader& operator=(const GoldenReader&) = delete;
+
+    // Empty if the file is usable
+    const std::string &error() const { return problem; }
+    const std::string &name() const { return path; }
+
+    uint32_t shard_size() const { return header()->shard_size; }
+    size_t section_count() const { return trailer()->section_count; }
+
+    const GoldenSection &section(size_t index) const {
+        const uint64_t *offsets = reinterpret_cast<const uint64_t*>(data + trailer()->section_table);
+        return *reinterpret_cast<const GoldenSection*>(data + offsets[index]);
+    }
+
+    // Null if the section has no such chunk
+    const GoldenChunk *chunk(const GoldenSection &section, size_t index) const {
+        if (index >= section.chunk_count)
+            return nullptr;
+        return reinterpret_cast<const GoldenChunk*>(data + section.chunk_table) + index;
+    }
+
+    const uint8_t *chunk_data(const GoldenChunk &chunk) const { return data + chunk.offset; }
+
+private:
+    const GoldenHeader *header() const { return reinterpret_cast<const GoldenHeader*>(data); }
+    const GoldenTrailer *trailer() const { return reinterpret_cast<const GoldenTrailer*>(data + size) - 1; }
+
+    // Checks that every table and chunk is inside the file, so the rest can trust the offsets
+    std::string validate() const {
+        std::string not_golden = fmt::format("{} is not a golden file, or from an incompatible version", path);
+        if (size < sizeof(GoldenHeader) + sizeof(GoldenTrailer)
+                || memcmp(header()->magic, GoldenHeader::expected_magic, sizeof(header()->magic)) != 0
+                || header()->version != GoldenHeader::current_version
+                || memcmp(trailer()->magic, GoldenHeader::expected_magic, sizeof(trailer()->magic)) != 0)
+            return not_golden;
+
+        auto inside = [&] (uint64_t offset, uint64_t count, uint64_t element) {
+            return offset <= size && count <= (size - offset) / element;
+        };
+        if (!inside(trailer()->section_table, trailer()->section_count, sizeof(uint64_t)))
+            return not_golden;
+
+        const uint64_t *offsets = reinterpret_cast<const uint64_t*>(data + trailer()->section_table);
+        for (size_t i = 0; i < section_count(); i++) {
+            if (!inside(offsets[i], 1, sizeof(GoldenSection)))
+                return not_golden;
+            const GoldenSection &s = section(i);
+            if (!inside(s.chunk_table, s.chunk_count, sizeof(GoldenChunk)))
+                return not_golden;
+            for (size_t j = 0; j < s.chunk_count; j++) {
+                if (!inside(chunk(s, j)->offset, chunk(s, j)->size, 1))
+                    return not_golden;
+            }
+        }
+        return {};
+    }
+
+    std::string path;
+    std::string problem;
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+};
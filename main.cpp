@@ -1,45 +1,41 @@
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <chrono>
+#include <memory>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <cstring>
+#include <vector>
 
 #include <fmt/format.h>
 
+#include "boundary.h"
 #include "float_types.h"
+#include "forked_x87.h"
 #include "real_x87.h"
 #include "soft_x87.h"
 #include "sequence.h"
-
+#include "ops.h"
+#include "runner.h"
+#include "checkpoint.h"
+#include "plan.h"
+#include "mismatch_log.h"
 
 // We run these tests twice, for 32 and 64bit floats
-template<typename T>
-void conversion_tests_inner(x87 &fpu_a, x87 &fpu_b) {
-    auto load_both = [&] (T val) {
-        fpu_a.fld(val);
-        fpu_b.fld(val);
-
-        tword a = fpu_a.fstp_t();
-        tword b = fpu_b.fstp_t();
-        if(a != b) {
-            fmt::print("{} resulted in {} and {}\n", val.to_string(), a.to_string(), b.to_string());
-        }
-    };
+template<typename T, class TestRunner>
+void conversion_tests_inner(TestRunner &runner) {
+    Load<T> load;
 
-    // 4 million happy floats
-    // Note: zero is not a happy float.
-    FilteredSequence<T, 4'000'000> happy_floats([] (T f) {
-        return f.exponent != T::exponent_max && f.exponent != 0;
-    });
+    // Every exponent, with zero, tiny, huge, halfway and random significands, so denormals, infinities
+    // and NaNs of every payload class too
+    auto boundary_floats = boundary<T>() | take(Boundary<T>::strata * 16);
 
-    fmt::print("loading {}bit \"happy\" floats...\n", T::bits);
-    // Happy path for 32bit/64bit to 80bit floats
-    for (auto val : happy_floats) {
-        load_both(val);
-    }
+    runner.phase(fmt::format("loading {}bit floats of every exponent and class", T::bits));
+    runner.compare(boundary_floats, load);
 
-    TransformedSequence<T, 4'000'000> denormal_floats([] (T f) {
+    auto denormal_floats = uniform<T>() | transform([] (T f) {
         // apply the implicit interger bit
         uint64_t significand = f.significand | (1ULL << T::significand_width);
 
@@ -51,91 +47,94 @@ void conversion_tests_inner(x87 &fpu_a, x87 &fpu_b) {
          // Then zero out the exponent
         f.exponent = 0;
         return f;
-    });
+    }) | take(4'000'000);
 
-    fmt::print("loading {}bit denormal floats...\n", T::bits);
+    runner.phase(fmt::format("loading {}bit denormal floats", T::bits));
     // // Denormal floats to 80bit
-    for (auto val : denormal_floats) {
-        load_both(val);
-    }
+    runner.compare(denormal_floats, load);
 
 
 
     // infinities/NaNs/zeros to 80bit
     {
-        fmt::print("loading {}bit infinities...\n", T::bits);
+        runner.phase(fmt::format("loading {}bit infinities", T::bits));
         T val;
 
         // positive infinity
         val.sign = 0;
         val.exponent = (1 << T::exponent_width) - 1;
         val.significand = 0;
-        load_both(val);
+        std::vector<T> infinities = { val };
 
         // negative infinity
         val.sign = 1;
-        load_both(val);
+        infinities.push_back(val);
+        runner.compare(infinities, load);
 
-        fmt::print("loading {}bit zeros...\n", T::bits);
+        runner.phase(fmt::format("loading {}bit zeros", T::bits));
 
         // negative zero
         val.exponent = 0;
-        load_both(val);
+        std::vector<T> zeros = { val };
 
         // positive zero
         val.sign = 0;
-        load_both(val);
+        zeros.push_back(val);
+        runner.compare(zeros, load);
 
-        fmt::print("loading {}bit NaNs...\n", T::bits);
-        TransformedSequence<T, 1'000'000> NaNs([] (T f) {
+        runner.phase(fmt::format("loading {}bit NaNs", T::bits));
+        auto NaNs = uniform<T>() | transform([] (T f) {
             f.exponent = T::exponent_max; // force exponent to zero
             return f;
-        });
+        }) | take(1'000'000);
 
-        for (auto val : NaNs) {
-            load_both(val);
-        }
+        runner.compare(NaNs, load);
     }
 
-    auto store_both = [&] (tword val) {
-        fpu_a.fld(val);
-        fpu_b.fld(val);
+    Store<T> store;
 
-        T a = fpu_a.fstp<T>();
-        T b = fpu_b.fstp<T>();
-        if(a != b) {
-            fmt::print("{} resulted in {} and {}\n", val.to_string(), a.to_string(), b.to_string());
-        }
-    };
+    runner.phase(fmt::format("storing floats around every rounding point of {}bit", T::bits));
 
-    fmt::print("storing \"happy\" floats to {}bit...\n", T::bits);
+    // Flags like underflow change right at rounding points, so every value's status word is compared here
+    size_t status_stride = runner.status_stride();
+    if (status_stride)
+        runner.set_status_stride(1);
     {
-        FilteredSequence<tword, 10'000'000> happy_long_floats([] (tword f) {
-            bool is_denormal = (f.significand & tword::interger_bit_mask) == 0; // already denormal
-            bool fits_in_T   = ((f.exponent - tword::exponent_bias) + T::exponent_bias) >= 0; // will become denormal
-            bool is_real     = f.exponent != tword::exponent_max; // not infinity or nand
-            return is_real && !is_denormal && fits_in_T;
-        });
+        // Every exponent from underflow to overflow, with the bits rounded off at and around halfway
+        auto rounding_floats = rounding_points<T>() | take(RoundingPoints<T>::strata * 64);
+        runner.compare(rounding_floats, store);
+    }
 
-        // happy path for 80bit to 32bit/64bit conversions (includes rounding)
-        for (auto val : happy_long_floats) {
-        store_both(val);
-        }
+    // Values that were once rounded wrong
+    runner.compare(std::vector<tword> {
+        tword(1, 0x3f69, 0xcc53702c050d3513),
+        tword(0, 0x3bff, 0x8e65bd8630709000),
+        tword(0, 0x3f80, 0xffffff1fd1ad2bdd),
+        tword(0, 0x3f80, 0xffffff8000000000),
+        tword(0, 0x3f80, 0xfffffe8000000000),
+        tword(0, 0x3c00, 0x801ceee9d3ec8800),
+        tword(0, 0x3c00, 0x801ceee9d3ec8801),
+        tword(0, 0x3c00, 0x801ceee9d3ec8c00),
+    }, store);
+
+    // Denormals that round up to the smallest normal. They only underflow if rounding them to T's full
+    // precision, one bit more than the denormal keeps, wouldn't carry too.
+    {
+        constexpr int dropped = 64 - T::significand_width; // bits a denormal of exponent 0 rounds off
+        uint16_t exponent = tword::exponent_bias - T::exponent_bias;
+        uint64_t halfway = ~0ull << dropped | 1ull << (dropped - 1);
+        runner.compare(std::vector<tword> {
+            tword(0, exponent, ~0ull),
+            tword(1, exponent, ~0ull),
+            tword(0, exponent, halfway),
+            tword(1, exponent, halfway),
+        }, store);
     }
+    runner.set_status_stride(status_stride);
 
-    // TODO: proper rounding test
-    store_both(tword(1, 0x3f69, 0xcc53702c050d3513));
-    store_both(tword(0, 0x3bff, 0x8e65bd8630709000));
-    store_both(tword(0, 0x3f80, 0xffffff1fd1ad2bdd));
-    store_both(tword(0, 0x3f80, 0xffffff8000000000));
-    store_both(tword(0, 0x3f80, 0xfffffe8000000000));
-    store_both(tword(0, 0x3c00, 0x801ceee9d3ec8800));
-    store_both(tword(0, 0x3c00, 0x801ceee9d3ec8801));
-    store_both(tword(0, 0x3c00, 0x801ceee9d3ec8c00));
-
-    fmt::print("storing floats requiring denormalization to {}bit...\n", T::bits);
+    runner.phase(fmt::format("storing floats requiring denormalization to {}bit", T::bits));
     {
-        TransformedSequence<tword, 10'000'000> denormalable_floats([] (tword f) {
+        auto denormalable_floats = uniform<tword>() | transform([] (tword f) {
             constexpr int min_exponent = -T::exponent_bias - T::significand_width;
             constexpr int max_exponent = -T::exponent_bias;
             constexpr int denormal_exponent_range = (max_exponent - min_exponent) + 1;
@@ -147,38 +146,35 @@ void conversion_tests_inner(x87 &fpu_a, x87 &fpu_b) {
             f.significand |= tword::interger_bit_mask;
 
             return f;
-        });
+        }) | take(1'000'000);
 
         // conversions which require denormalization
-        for (auto val : denormalable_floats) {
-            store_both(val);
-        }
+        runner.compare(denormalable_floats, store);
     }
 
     // infinities/NaNs/zeros conversions
     {
-        fmt::print("storing zeros to {}bit...\n", T::bits);
-        store_both(tword(0, 0, 0));
-        store_both(tword(1, 0, 0));
+        runner.phase(fmt::format("storing zeros to {}bit", T::bits));
+        runner.compare(std::vector<tword> { tword(0, 0, 0), tword(1, 0, 0) }, store);
 
-        fmt::print("storing infinities to {}bit...\n", T::bits);
-        store_both(tword(0, 0x7fff, 0x8000'0000'0000'0000));
-        store_both(tword(1, 0x7fff, 0x8000'0000'0000'0000));
+        runner.phase(fmt::format("storing infinities to {}bit", T::bits));
+        runner.compare(std::vector<tword> {
+            tword(0, 0x7fff, 0x8000'0000'0000'0000),
+            tword(1, 0x7fff, 0x8000'0000'0000'0000),
+        }, store);
 
-        fmt::print("storing NaNs to {}bit...\n", T::bits);
-        TransformedSequence<tword, 1'000'000> NaNs([] (tword f) {
+        runner.phase(fmt::format("storing NaNs to {}bit", T::bits));
+        auto NaNs = uniform<tword>() | transform([] (tword f) {
             f.exponent = tword::exponent_max; // force exponent to zero
             f.significand |= tword::interger_bit_mask;
             return f;
-        });
+        }) | take(1'000'000);
 
-        for (auto val : NaNs) {
-            store_both(val);
-        }
+        runner.compare(NaNs, store);
 
-        fmt::print("storing large floats to {}bit...\n", T::bits);
+        runner.phase(fmt::format("storing large floats to {}bit", T::bits));
         // large numbers
-        TransformedSequence<tword, 10'000'000> large_floats([] (tword f) {
+        auto large_floats = uniform<tword>() | transform([] (tword f) {
             constexpr int min_exponent = T::exponent_max - T::exponent_bias;
             constexpr int max_exponent = tword::exponent_max - tword::exponent_bias;
             constexpr int exponent_range = (max_exponent - min_exponent) + 1;
@@ -190,17 +186,16 @@ void conversion_tests_inner(x87 &fpu_a, x87 &fpu_b) {
             f.significand |= tword::interger_bit_mask;
 
             return f;
+        }) | take(1'000'000);
+        // Infinity, or the largest finite value when rounding toward zero
+        runner.compare(large_floats, store, [] (tword, T result) {
+            assert(result.exponent == T::exponent_max
+                || (result.exponent == T::exponent_max - 1 && result.significand == T::significand_max));
         });
-        for (auto val : large_floats) {
-            store_both(val);
-            fpu_b.fld(val);
-            T result = fpu_b.fstp<T>();
-            assert(result.exponent == T::exponent_max);
-        }
 
-        fmt::print("storing small floats to {}bit...\n", T::bits);
+        runner.phase(fmt::format("storing small floats to {}bit", T::bits));
         // small numbers
-        TransformedSequence<tword, 10'000'000> small_floats([] (tword f) {
+        auto small_floats = uniform<tword>() | transform([] (tword f) {
             constexpr int min_exponent = -tword::exponent_bias;
             constexpr int max_exponent = -T::exponent_bias - T::significand_width;
             constexpr int exponent_range = (max_exponent - min_exponent) + 1;
@@ -212,56 +207,33 @@ void conversion_tests_inner(x87 &fpu_a, x87 &fpu_b) {
             f.significand |= tword::interger_bit_mask;
 
             return f;
-        });
-        for (auto val : small_floats) {
-            store_both(val);
-            fpu_b.fld(val);
-            T result = fpu_b.fstp<T>();
+        }) | take(1'000'000);
+        runner.compare(small_floats, store, [] (tword, T result) {
             assert(result.exponent == 0);
-        }
+        });
     }
 
-    // weird unsupported 80bit float encodings
-        // peusdo denormals work
-        // others generate invalid operand exceptions
+    // Pseudo-denormals, unnormals, pseudo-infinities and pseudo-NaNs, and NaNs of every payload class.
+    // Pseudo-denormals are stored like denormals, the unsupported encodings are invalid.
+    runner.phase(fmt::format("storing 80bit floats of every exponent and class to {}bit", T::bits));
+    runner.compare(boundary<tword>() | take(Boundary<tword>::strata), store);
 }
 
-void conversion_tests(x87 &fpu_a, x87 &fpu_b) {
-    UniformSequence<tword, 4'000'000> random_twords; // 4 million 80bit floats
-
-    // Quick test to make sure loading and storing of 80bit floats works.
-    fmt::print("loading 80bit floats...\n");
-    for (tword f : random_twords) {
-        fpu_a.fld(f);
-        fpu_b.fld(f);
+template<class TestRunner>
+void conversion_tests(TestRunner &runner) {
+    // Every exponent and encoding class, the unsupported encodings included
+    runner.phase("loading 80bit floats of every exponent and class");
+    runner.compare(boundary<tword>() | take(Boundary<tword>::strata * 2), Load<tword>());
 
-        tword result_a = fpu_a.fstp_t();
-        tword result_b = fpu_b.fstp_t();
-        if(result_a != result_b) {
-            fmt::print("{} resulted in {} and {}\n", f.to_string(), result_a.to_string(), result_b.to_string());
-        }
-    }
-
-    conversion_tests_inner<dword>(fpu_a, fpu_b);
-    conversion_tests_inner<qword>(fpu_a, fpu_b);
+    conversion_tests_inner<dword>(runner);
+    conversion_tests_inner<qword>(runner);
 }
 
-template<typename T>
-void load_int_inner(x87 &fpu_a, x87 &fpu_b) {
-    fmt::print("loading {}bit intergers...\n", sizeof(T) * 8);
-
-
-
-    auto load_both = [&] (T val) {
-        fpu_a.fild(val);
-        fpu_b.fild(val);
+template<typename T, class TestRunner>
+void load_int_inner(TestRunner &runner) {
+    runner.phase(fmt::format("loading {}bit intergers", sizeof(T) * 8));
 
-        tword a = fpu_a.fstp_t();
-        tword b = fpu_b.fstp_t();
-        if(a != b) {
-            fmt::print("{:x} resulted in {} and {}\n", val, a.to_string(), b.to_string());
-        }
-    };
+    Load<T> load;
 
     std::vector<int64_t> notableInts = {
         0,
@@ -272,7 +244,7 @@ void load_int_inner(x87 &fpu_a, x87 &fpu_b) {
         -1,
         -2,
         -3,
-        -4
+        -4,
         INT16_MAX,
         INT16_MIN,
         INT32_MAX,
@@ -287,31 +259,572 @@ void load_int_inner(x87 &fpu_a, x87 &fpu_b) {
         INT64_MIN + 1,
     };
 
+    std::vector<T> notable;
     for (int64_t i : notableInts) {
-        load_both(static_cast<T>(i));
+        notable.push_back(static_cast<T>(i));
+    }
+    runner.compare(notable, load);
+
+    if constexpr (sizeof(T) == 2) {
+        // Only 65536 of them, so test them all
+        runner.compare(exhaustive<T>(), load);
+    } else {
+        auto random_ints = uniform<T>() | take(2'000'000);
+
+        runner.compare(random_ints, load);
+    }
+}
+
+template<class TestRunner>
+void load_int_tests(TestRunner &runner) {
+    load_int_inner<int16_t>(runner);
+    load_int_inner<int32_t>(runner);
+    load_int_inner<int64_t>(runner);
+}
+
+// A normal T with the given unbiased exponent, clamped to T's normal range, and f's significand
+template<typename T>
+T with_exponent(T f, int exponent) {
+    f.exponent = std::clamp(exponent + T::exponent_bias, 1, T::exponent_max - 1);
+    f.significand |= T::interger_bit_mask;
+    return f;
+}
+
+// Turns f into a value of one of the classes arithmetic treats specially, picked by choice
+template<typename T>
+T special_value(T f, unsigned choice) {
+    constexpr uint64_t integer_bit = T::interger_bit_mask;
+    constexpr uint64_t quiet_bit = integer_bit ? integer_bit >> 1 : 1ull << (T::significand_width - 1);
+
+    switch (choice % 8) {
+    case 0: // zero
+        f.exponent = 0;
+        f.significand = 0;
+        break;
+    case 1: // denormal
+        f.exponent = 0;
+        f.significand = (f.significand & ~integer_bit) | 1;
+        break;
+    case 2: // infinity
+        f.exponent = T::exponent_max;
+        f.significand = integer_bit;
+        break;
+    case 3: // quiet NaN
+        f.exponent = T::exponent_max;
+        f.significand |= integer_bit | quiet_bit;
+        break;
+    case 4: // signaling NaN
+        f.exponent = T::exponent_max;
+        f.significand = ((f.significand | integer_bit) & ~quiet_bit) | 1;
+        break;
+    case 5: // unnormal, pseudo-NaN or pseudo-infinity, just a normal for T without an integer bit
+        if (integer_bit)
+            f.significand &= ~integer_bit;
+        else
+            f = with_exponent(f, 0);
+        break;
+    case 6: // pseudo-denormal, or the largest and smallest normals
+        if (integer_bit)
+            f.exponent = 0;
+        else
+            f.exponent = f.exponent & 1 ? T::exponent_max - 1 : 1;
+        f.significand |= integer_bit;
+        break;
+    default:
+        f = with_exponent(f, int(f.exponent % 16) - 8);
+        break;
+    }
+    return f;
+}
+
+// Differential tests of one arithmetic instruction, with b from memory as a B, or from ST(1) for twords
+template<OpCode Code, typename B, class TestRunner>
+void arithmetic_tests_inner(TestRunner &runner) {
+    Arithmetic<Code, B> op;
+    constexpr bool scaling = Code == OpCode::mul || Code == OpCode::div || Code == OpCode::divr;
+    std::string name = std::is_same<B, tword>::value ? fmt::format("{}p st(1)", op_name(Code))
+                                                     : fmt::format("{} m{}", op_name(Code), B::bits);
+
+    // Exponents within 64 of each other and of 1.0, so additions overlap, carry and cancel, and every
+    // alignment from exact to entirely sticky gets hit. Products stay well inside the range.
+    runner.phase(fmt::format("{} of normal operands", name));
+    auto normal = uniform<Operands<B>>() | transform([] (Operands<B> in) {
+        in.a = with_exponent(in.a, int(in.a.exponent % 128) - 64);
+        in.b = with_exponent(in.b, int(in.b.exponent % 128) - 64);
+        return in;
+    }) | take(4'000'000);
+    runner.compare(normal, op);
+
+    // Results at the ends of the tword range, where they round to denormals, underflow and overflow
+    runner.phase(fmt::format("{} of operands near the limits", name));
+    auto limits = uniform<Operands<B>>() | transform([] (Operands<B> in) {
+        constexpr int min_exponent = 1 - tword::exponent_bias;
+        constexpr int max_exponent = tword::exponent_max - 1 - tword::exponent_bias;
+        bool overflow = in.a.exponent & 1;
+        int spread = in.a.exponent >> 1;
+
+        if (in.b.exponent % 4 == 0)
+            in.b = special_value(in.b, 1); // denormal
+        else
+            in.b = with_exponent(in.b, int(in.b.exponent % (2 * B::exponent_bias)) - B::exponent_bias);
+
+        if (scaling) {
+            // Pick a so that the product or quotient lands around the smallest or largest exponent
+            int b_exponent = std::max<int>(in.b.exponent, 1) - B::exponent_bias;
+            int target = overflow ? max_exponent - 2 + spread % 4 : min_exponent - 70 + spread % 80;
+            if (Code == OpCode::mul)
+                in.a = with_exponent(in.a, target - b_exponent);
+            else if (Code == OpCode::div)
+                in.a = with_exponent(in.a, target + b_exponent);
+            else
+                in.a = with_exponent(in.a, b_exponent - target);
+        } else if (overflow && std::is_same<B, tword>::value) {
+            // Sums of the largest values carry out of the range
+            in.a = with_exponent(in.a, max_exponent - spread % 2);
+            in.b = with_exponent(in.b, max_exponent - (spread >> 1) % 2);
+        } else {
+            // Denormal and tiny values, with tword bs just as tiny
+            in.a = spread % 4 == 0 ? special_value(in.a, 1) : with_exponent(in.a, min_exponent + spread % 70);
+            if (std::is_same<B, tword>::value)
+                in.b = (spread >> 2) % 4 == 0 ? special_value(in.b, 1) : with_exponent(in.b, min_exponent + (spread >> 2) % 70);
+        }
+        return in;
+    }) | take(2'000'000);
+    runner.compare(limits, op);
+
+    // Zeros, denormals, infinities, NaNs and unsupported encodings in every combination
+    runner.phase(fmt::format("{} of special operands", name));
+    auto special = uniform<Operands<B>>() | transform([] (Operands<B> in) {
+        unsigned choice = in.a.exponent;
+        in.a = special_value(in.a, choice);
+        in.b = special_value(in.b, choice >> 3);
+        return in;
+    }) | take(1'000'000);
+    runner.compare(special, op);
+
+    // Quotients that fit in 32 bits are exact, so the remainder is zero. Memory operands go through
+    // the same kernel once loaded, the st(1) form covers them.
+    if constexpr ((Code == OpCode::div || Code == OpCode::divr) && std::is_same<B, tword>::value) {
+        runner.phase(fmt::format("{} of exact quotients", name));
+        auto exact = uniform<Operands<B>>() | transform([] (Operands<B> in) {
+            uint64_t divisor = (in.b.significand >> 32) | 0x8000'0000;
+            uint64_t product = divisor * ((in.a.significand >> 32) | 1);
+            in.b.significand = divisor << 32;
+            in.a.significand = product << __builtin_clzll(product);
+            in.a = with_exponent(in.a, int(in.a.exponent % 128) - 64);
+            in.b = with_exponent(in.b, int(in.b.exponent % 128) - 64);
+            if (Code == OpCode::divr)
+                std::swap(in.a, in.b);
+            return in;
+        }) | take(1'000'000);
+        runner.compare(exact, op);
+    }
+}
+
+template<OpCode Code, class TestRunner>
+void arithmetic_tests_op(TestRunner &runner) {
+    arithmetic_tests_inner<Code, dword>(runner);
+    arithmetic_tests_inner<Code, qword>(runner);
+    arithmetic_tests_inner<Code, tword>(runner);
+}
+
+template<class TestRunner>
+void arithmetic_tests(TestRunner &runner) {
+    arithmetic_tests_op<OpCode::add>(runner);
+    arithmetic_tests_op<OpCode::sub>(runner);
+    arithmetic_tests_op<OpCode::subr>(runner);
+    arithmetic_tests_op<OpCode::mul>(runner);
+    arithmetic_tests_op<OpCode::div>(runner);
+    arithmetic_tests_op<OpCode::divr>(runner);
+}
+
+template<class TestRunner>
+void sqrt_tests(TestRunner &runner) {
+    Sqrt op;
+
+    // Every exponent of the range, both parities of it
+    runner.phase("fsqrt of normal operands");
+    auto normal = uniform<tword>() | transform([] (tword f) {
+        f.sign = 0;
+        return with_exponent(f, int(f.exponent) - tword::exponent_bias);
+    }) | take(4'000'000);
+    runner.compare(normal, op);
+
+    // Squares of 32 bit roots, scaled by even powers of two, have exact roots
+    runner.phase("fsqrt of perfect squares");
+    auto squares = uniform<tword>() | transform([] (tword f) {
+        uint64_t root = (f.significand >> 32) | 0x8000'0000;
+        uint64_t square = root * root;
+        int shift = __builtin_clzll(square);
+        int exponent = 2 * (int(f.exponent % 2048) - 1024) + 63 - shift;
+        f.sign = 0;
+        f.significand = square << shift;
+        return with_exponent(f, exponent);
+    }) | take(1'000'000);
+    runner.compare(squares, op);
+
+    // Denormals and pseudo-denormals of both signs, whose roots are normal
+    runner.phase("fsqrt of denormal operands");
+    auto denormal = uniform<tword>() | transform([] (tword f) {
+        unsigned choice = f.exponent;
+        f = special_value(f, choice & 1 ? 6 : 1);
+        if (!(choice & 1))
+            f.significand = (f.significand >> (choice >> 1) % 64) | 1;
+        return f;
+    }) | take(1'000'000);
+    runner.compare(denormal, op);
+
+    runner.phase("fsqrt of special operands");
+    auto special = uniform<tword>() | transform([] (tword f) {
+        return special_value(f, f.exponent);
+    }) | take(1'000'000);
+    runner.compare(special, op);
+}
+
+// Prints the first few differing results, and how many more there were
+template<typename In, typename Out>
+void report_mismatches(const std::vector<In> &in, const std::vector<Out> &a, const std::vector<Out> &b) {
+    constexpr size_t print_limit = 10;
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < in.size(); i++) {
+        if (a[i] != b[i] && mismatches++ < print_limit) {
+            fmt::print("{} resulted in {} and {}\n", describe(in[i]), describe(a[i]), describe(b[i]));
+        }
+    }
+    if (mismatches > print_limit)
+        fmt::print("{} more mismatches not printed\n", mismatches - print_limit);
+}
+
+// Cross checks the vectorized batch conversions against the scalar ones, for every instruction
+// set this cpu supports. The runner checks whichever one soft_x87 picks against hard_x87.
+template<typename T>
+void simd_tests_inner() {
+    auto floats = uniform<T>(1) | take(1'000'000);
+
+    auto long_floats = uniform<tword>(1) | transform([] (tword f) {
+        constexpr int min_exponent = tword::exponent_bias - T::exponent_bias - T::significand_width - 2;
+        constexpr int exponent_range = T::exponent_max + T::significand_width + 4;
+
+        // Keep an eighth completely random, move the rest to just around T's exponent range,
+        // so rounding, denormalization, overflow and underflow all get hit.
+        if (f.exponent % 8 != 0)
+            f.exponent = min_exponent + (f.exponent % exponent_range);
+        return f;
+    }) | take(1'000'000);
+
+    std::vector<T> in(floats.begin(), floats.end());
+    std::vector<tword> long_in(long_floats.begin(), long_floats.end());
+
+    std::vector<tword> expanded_scalar(in.size()), expanded(in.size());
+    std::vector<T> compressed_scalar(long_in.size()), compressed(long_in.size());
+    soft_x87::expand(in.data(), expanded_scalar.data(), in.size(), soft_x87::Simd::scalar);
+    soft_x87::compress(long_in.data(), compressed_scalar.data(), long_in.size(), soft_x87::Simd::scalar);
+
+    for (int level = int(soft_x87::Simd::scalar) + 1; level <= int(soft_x87::best_simd()); level++) {
+        auto simd = soft_x87::Simd(level);
+
+        fmt::print("checking {} {}bit to 80bit conversions...\n", soft_x87::simd_name(simd), T::bits);
+        soft_x87::expand(in.data(), expanded.data(), in.size(), simd);
+        report_mismatches(in, expanded_scalar, expanded);
+
+        fmt::print("checking {} 80bit to {}bit conversions...\n", soft_x87::simd_name(simd), T::bits);
+        soft_x87::compress(long_in.data(), compressed.data(), long_in.size(), simd);
+        report_mismatches(long_in, compressed_scalar, compressed);
     }
+}
+
+void simd_tests() {
+    simd_tests_inner<dword>();
+    simd_tests_inner<qword>();
+}
+
+// Walks every possible input of op, saving progress to the checkpoint after each chunk
+template<typename T, class TestRunner, typename Op>
+void exhaustive_sweep(TestRunner &runner, Checkpoint &checkpoint, const char *name, Op op) {
+    constexpr size_t chunk_size = 1 << 26;
 
-    UniformSequence<T, 2'000'000> random_ints;
+    auto values = exhaustive<T>();
+    size_t first = checkpoint.get(name);
 
-    for (T i : random_ints) {
-        load_both(i);
+    if (first >= values.size()) {
+        fmt::print("{} already swept\n", name);
+        return;
     }
+    runner.phase(fmt::format("sweeping {} from {:#x}", name, first));
 
+    auto start = std::chrono::steady_clock::now();
+    size_t resumed_at = first;
 
+    while (first < values.size()) {
+        size_t last = std::min(values.size(), first + chunk_size);
+        runner.compare_range(values, first, last, op, [] (auto, auto) {});
+        first = last;
+
+        if (!checkpoint.set(name, first))
+            fmt::print(stderr, "failed to write checkpoint\n");
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fmt::print("{}: {:#x}/{:#x} {:.1f}M values/sec\n", name, first, values.size(),
+                   (first - resumed_at) / elapsed.count() / 1e6);
+        fflush(stdout);
+    }
 }
 
-void load_int_tests(x87 &fpu_a, x87 &fpu_b) {
-    load_int_inner<int16_t>(fpu_a, fpu_b);
-    load_int_inner<int32_t>(fpu_a, fpu_b);
-    load_int_inner<int64_t>(fpu_a, fpu_b);
+template<class TestRunner>
+void exhaustive_tests(TestRunner &runner, Checkpoint &checkpoint) {
+    exhaustive_sweep<dword>(runner, checkpoint, "fld_dword", Load<dword>());
+    exhaustive_sweep<int32_t>(runner, checkpoint, "fild_int32", Load<int32_t>());
+}
+
+// The phases run under each control word
+template<class TestRunner>
+void control_word_tests(TestRunner &runner) {
+    conversion_tests(runner);
+    load_int_tests(runner);
+    arithmetic_tests(runner);
+    sqrt_tests(runner);
+}
+
+// Goes through the phases a run would, without running them, for the plan to budget or list them
+void survey_tests(TestPlan &plan, const std::vector<uint16_t> &control_words) {
+    PhaseSurvey survey(plan);
+    for (uint16_t cw : control_words) {
+        survey.set_control_word(cw);
+        control_word_tests(survey);
+    }
+}
+
+// Everything but parsing the options, with either kind of runner
+template<class TestRunner>
+void run_tests(TestRunner &runner, bool exhaustive, const char *checkpoint_path, TestPlan &plan,
+               const std::vector<uint16_t> &control_words, size_t pipeline_depth, size_t batch_size) {
+    runner.set_pipeline(pipeline_depth);
+    if (batch_size)
+        runner.set_batch_size(batch_size);
+
+    if (exhaustive) {
+        // Sweeps all 2^32 dword and int32 inputs. Rerun with the same checkpoint to resume.
+        Checkpoint checkpoint(checkpoint_path);
+        exhaustive_tests(runner, checkpoint);
+        runner.summary();
+        return;
+    }
+
+    if (plan.budgeted())
+        survey_tests(plan, control_words);
+    plan.start();
+    runner.set_plan(&plan);
+
+    if (plan.selected("simd conversions"))
+        simd_tests();
+
+    for (uint16_t cw : control_words) {
+        fmt::print("control word {:#06x}: rounding {}, {} bit precision\n", cw, rounding_name(rounding_control(cw)),
+                   precision_control(cw));
+        runner.set_control_word(cw);
+        control_word_tests(runner);
+    }
+    runner.summary();
+
+    if (!plan.save_history())
+        fmt::print(stderr, "failed to write {}\n", plan.history_name());
 }
 
-int main() {
-    auto soft = soft_x87();
-    auto hard = hard_x87();
+int main(int argc, char **argv) {
+    unsigned threads = 0; // one per core
+    bool exhaustive = false;
+    const char *checkpoint_path = "x87test.checkpoint";
+    const char *log_path = nullptr;
+    uint64_t print_limit = 10;
+    bool one_control_word = false;
+    uint16_t control_word = default_control_word;
+    bool forked = false;
+    size_t pipeline_depth = 0;
+    size_t batch_size = 0;
+    size_t status_stride = 64; // the status words are compared after every 64th input
+    const char *record_path = nullptr;
+    const char *golden_path = nullptr;
+    const char *digest_fpu = nullptr;
+    const char *save_digests_path = nullptr;
+    const char *check_digests_path = nullptr;
+    TestPlan plan;
+    bool list_phases = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2]) {
+            threads = atoi(argv[i] + 2);
+        } else if (strcmp(argv[i], "--exhaustive") == 0) {
+            exhaustive = true;
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint_path = argv[++i];
+        } else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            log_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-per-bucket") == 0 && i + 1 < argc) {
+            print_limit = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--control-word") == 0 && i + 1 < argc) {
+            one_control_word = true;
+            control_word = strtoul(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--fork") == 0) {
+            forked = true;
+        } else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc) {
+            pipeline_depth = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--batch-size") == 0 && i + 1 < argc) {
+            batch_size = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--status-every") == 0 && i + 1 < argc) {
+            status_stride = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--record-golden") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc) {
+            golden_path = argv[++i];
+        } else if (strcmp(argv[i], "--digests") == 0 && i + 1 < argc) {
+            digest_fpu = argv[++i];
+        } else if (strcmp(argv[i], "--save-digests") == 0 && i + 1 < argc) {
+            save_digests_path = argv[++i];
+        } else if (strcmp(argv[i], "--check-digests") == 0 && i + 1 < argc) {
+            check_digests_path = argv[++i];
+        } else if (strncmp(argv[i], "--", 2) == 0 && TestPlan::is_option(argv[i] + 2) && i + 1 < argc) {
+            std::string problem = plan.set(argv[i] + 2, argv[i + 1]);
+            i++;
+            if (!problem.empty()) {
+                fmt::print(stderr, "{}\n", problem);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--list-phases") == 0) {
+            list_phases = true;
+        } else {
+            fmt::print(stderr, "usage: {} [-j threads] [--log file] [--max-per-bucket n] [--control-word cw] [--fork] "
+                               "[--pipeline depth] [--batch-size n] [--status-every n] "
+                               "[--record-golden file | --golden file] "
+                               "[--digests soft|hard [--save-digests file] [--check-digests file]] "
+                               "[--plan file] [--phases patterns] [--skip patterns] [--scale x] [--cases [pattern=]n] "
+                               "[--seed [pattern=]n] [--budget time] [--history file] [--list-phases] "
+                               "[--exhaustive [--checkpoint file]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Mismatches are written to the binary log for x87replay, instead of printed
+    std::unique_ptr<MismatchLog> log;
+    if (log_path) {
+        log = std::make_unique<MismatchLog>(log_path);
+        if (!log->ok()) {
+            fmt::print(stderr, "failed to open {}\n", log_path);
+            return 1;
+        }
+    }
+
+    // hard_x87's results are recorded with --record-golden, and --golden compares against a recording
+    // instead of running it, which needs the same options otherwise
+    if (record_path && golden_path) {
+        fmt::print(stderr, "--record-golden and --golden can't be used together\n");
+        return 1;
+    }
+    std::unique_ptr<GoldenWriter> record;
+    if (record_path) {
+        record = std::make_unique<GoldenWriter>(record_path, Runner<soft_x87, hard_x87>::shard_size);
+        if (!record->ok()) {
+            fmt::print(stderr, "failed to open {}\n", record_path);
+            return 1;
+        }
+    }
+    std::unique_ptr<GoldenReader> golden;
+    if (golden_path) {
+        golden = std::make_unique<GoldenReader>(golden_path);
+        if (!golden->error().empty()) {
+            fmt::print(stderr, "{}\n", golden->error());
+            return 1;
+        }
+    }
+    const char *name_b = golden ? "golden" : "hard";
+
+    // With --digests only that fpu runs, and its results are reduced to digests per block and shard,
+    // which are saved for another run to check, or checked against another run's. A check saves the
+    // results of blocks that differ too, and checking those back in the other run names the values.
+    bool digests = digest_fpu || save_digests_path || check_digests_path;
+    if (digests && (!digest_fpu || (strcmp(digest_fpu, "soft") != 0 && strcmp(digest_fpu, "hard") != 0)
+                    || !(save_digests_path || check_digests_path))) {
+        fmt::print(stderr, "--digests needs soft or hard, and --save-digests or --check-digests\n");
+        return 1;
+    }
+    if (digests && (record || golden)) {
+        fmt::print(stderr, "--digests can't be used with golden files\n");
+        return 1;
+    }
+    std::unique_ptr<DigestWriter> save_digests;
+    if (save_digests_path) {
+        save_digests = std::make_unique<DigestWriter>(save_digests_path, Runner<soft_x87, hard_x87>::shard_size,
+                                                      Runner<soft_x87, hard_x87>::digest_block_size);
+        if (!save_digests->ok()) {
+            fmt::print(stderr, "failed to open {}\n", save_digests_path);
+            return 1;
+        }
+    }
+    std::unique_ptr<DigestReader> check_digests;
+    if (check_digests_path) {
+        check_digests = std::make_unique<DigestReader>(check_digests_path);
+        if (!check_digests->error().empty()) {
+            fmt::print(stderr, "{}\n", check_digests->error());
+            return 1;
+        }
+    }
+    bool digest_hard = digest_fpu && strcmp(digest_fpu, "hard") == 0;
+
+    // Every rounding mode at every precision, unless one control word was asked for. Phases
+    // repeat under each one and add up to a single row in the profile.
+    std::vector<uint16_t> control_words;
+    if (one_control_word) {
+        control_words.push_back(control_word);
+    } else {
+        for (Rounding rounding : { Rounding::nearest, Rounding::down, Rounding::up, Rounding::zero }) {
+            for (int precision : { 64, 53, 24 })
+                control_words.push_back(::control_word(rounding, precision));
+        }
+    }
+
+    // The phases the plan selects, with their usual cases, as names to select them by
+    if (list_phases) {
+        survey_tests(plan, control_words);
+        plan.list(stdout);
+        return 0;
+    }
 
-//    fmt::print("cw: {:x}\n", hard.fstcw());
-    //hard.fldcw(0x033f); // round to nearest; 64T::bits of precision; all exceptions masked.
+    // Digests that differ from the checked ones fail the run
+    bool digests_differ = false;
+
+    // With --fork hard_x87 runs in worker processes, so a control word that unmasks exceptions, or
+    // anything else that kills one, costs a worker instead of the run. A replay doesn't run it at all.
+    if (forked && !golden) {
+        Runner<soft_x87, forked_x87<hard_x87>> runner(threads, "soft", name_b);
+        runner.log_to(log.get());
+        runner.set_print_limit(print_limit);
+        runner.set_status_stride(status_stride);
+        runner.record_golden(record.get());
+        runner.replay_golden(golden.get());
+        runner.use_digests(save_digests.get(), check_digests.get(), digest_hard);
+        run_tests(runner, exhaustive, checkpoint_path, plan, control_words, pipeline_depth, batch_size);
+        digests_differ = runner.digests_differing();
+    } else {
+        Runner<soft_x87, hard_x87> runner(threads, "soft", name_b);
+        runner.log_to(log.get());
+        runner.set_print_limit(print_limit);
+        runner.set_status_stride(status_stride);
+        runner.record_golden(record.get());
+        runner.replay_golden(golden.get());
+        runner.use_digests(save_digests.get(), check_digests.get(), digest_hard);
+        run_tests(runner, exhaustive, checkpoint_path, plan, control_words, pipeline_depth, batch_size);
+        digests_differ = runner.digests_differing();
+    }
 
-    load_int_tests(soft, hard);
-}
\ No newline at end of file
+    if (record && !record->close()) {
+        fmt::print(stderr, "failed to write {}\n", record_path);
+        return 1;
+    }
+    if (save_digests && !save_digests->close()) {
+        fmt::print(stderr, "failed to write {}\n", save_digests_path);
+        return 1;
+    }
+    return digests_differ ? 1 : 0;
+}
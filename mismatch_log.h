@@ -0,0 +1,206 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fmt/format.h>
+
+#include "float_types.h"
+#include "ops.h"
+
+// Binary log of mismatching results, so huge numbers of mismatches don't stall
+// the run on formatting and stdout. The file is a MismatchLogHeader followed by fixed
+// size MismatchRecords in the order the cases were submitted, x87replay reads it.
+
+struct MismatchLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+
+    static constexpr char expected_magic[8] = { 'X', '8', '7', 'M', 'L', 'O', 'G', '\0' };
+    static constexpr uint32_t current_version = 1;
+};
+
+struct MismatchRecord {
+    OpCode op;
+    TypeCode in_type;
+    TypeCode out_type;
+    uint16_t control_word; // of both fpus, 0 in logs from before it was recorded, which ran with the default
+    uint16_t reserved;
+    uint64_t seed;      // seed of the sequence the input came from
+    uint64_t index;     // index of the input in that sequence
+    uint8_t input[32];  // raw bits of each value, zero padded
+    uint8_t result_a[16];
+    uint8_t result_b[16];
+
+    template<class Op, class In, class Out>
+    static MismatchRecord make(uint16_t control_word, uint64_t seed, uint64_t index, const In &in, const Out &a,
+                               const Out &b) {
+        static_assert(sizeof(In) <= sizeof(input) && sizeof(Out) <= sizeof(result_a), "Value too large to log");
+
+        MismatchRecord record = {};
+        record.op = Op::code;
+        record.in_type = type_code<In>();
+        record.out_type = type_code<Out>();
+        record.control_word = control_word;
+        record.seed = seed;
+        record.index = index;
+        memcpy(record.input, reinterpret_cast<const char*>(&in), sizeof(In));
+        memcpy(record.result_a, reinterpret_cast<const char*>(&a), sizeof(Out));
+        memcpy(record.result_b, reinterpret_cast<const char*>(&b), sizeof(Out));
+        return record;
+    }
+};
+
+static_assert(std::is_trivially_copyable<MismatchRecord>::value, "Records are written as raw bytes");
+
+// Turns the raw bits of a logged value back into a T
+template<class T>
+T decode_value(const uint8_t *bits) {
+    T value;
+    memcpy(reinterpret_cast<char*>(&value), bits, sizeof(T));
+    return value;
+}
+
+// Calls f with a value of the type that type stands for, returns false if it isn't one of Types
+template<class... Types, class F>
+bool with_type(TypeCode type, F f) {
+    return ((type == type_code<Types>() ? (f(Types()), true) : false) || ...);
+}
+
+// Calls f(input, result_a, result_b) with the record's values decoded to their real types.
+// Returns false if the record has types this build doesn't know.
+template<class F>
+bool with_values(const MismatchRecord &record, F f) {
+    bool known_out = false;
+    bool known_in = with_type<int16_t, int32_t, int64_t, dword, qword, tword, Operands<dword>, Operands<qword>,
+                              Operands<tword>>(record.in_type, [&] (auto in) {
+        using In = decltype(in);
+        known_out = with_type<dword, qword, tword>(record.out_type, [&] (auto out) {
+            using Out = decltype(out);
+            f(decode_value<In>(record.input), decode_value<Out>(record.result_a), decode_value<Out>(record.result_b));
+        });
+    });
+    return known_in && known_out;
+}
+
+// Formats a test input or result for mismatch reports
+template<typename T>
+std::string describe(T val) {
+    if constexpr (std::is_integral<T>::value)
+        return fmt::format("{:x}", val);
+    else
+        return val.to_string();
+}
+
+// Formats a logged mismatch the same way the runner prints one
+inline std::string describe(const MismatchRecord &record) {
+    std::string str = "unknown types";
+    with_values(record, [&] (auto in, auto a, auto b) {
+        str = fmt::format("{} resulted in {} and {}", describe(in), describe(a), describe(b));
+    });
+    return str;
+}
+
+// Records are queued in blocks and written out by a background thread.
+class MismatchLog {
+public:
+    // Blocks of records allowed to wait for the writer before append blocks
+    static constexpr size_t max_queued = 64;
+
+    explicit MismatchLog(const std::string &path) : path(path) {
+        file = fopen(path.c_str(), "wb");
+        if (!file)
+            return;
+
+        MismatchLogHeader header = {};
+        memcpy(header.magic, MismatchLogHeader::expected_magic, sizeof(header.magic));
+        header.version = MismatchLogHeader::current_version;
+        header.record_size = sizeof(MismatchRecord);
+        failed = fwrite(&header, sizeof(header), 1, file) != 1;
+
+        writer = std::thread([this] { writer_loop(); });
+    }
+
+    ~MismatchLog() {
+        if (!file)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutdown = true;
+        }
+        work_available.notify_one();
+        writer.join();
+        fclose(file);
+    }
+
+    MismatchLog(const MismatchLog&) = delete;
+    MismatchLog& operator=(const MismatchLog&) = delete;
+
+    bool ok() const { return file && !failed; }
+    const std::string &name() const { return path; }
+
+    void append(std::vector<MismatchRecord> records) {
+        if (!file || records.empty())
+            return;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        slot_available.wait(lock, [this] { return queue.size() < max_queued; });
+        queue.push_back(std::move(records));
+        lock.unlock();
+        work_available.notify_one();
+    }
+
+    // Waits until everything appended so far is written
+    void flush() {
+        if (!file)
+            return;
+        std::unique_lock<std::mutex> lock(mutex);
+        slot_available.wait(lock, [this] { return queue.empty() && !writing; });
+        fflush(file);
+    }
+
+private:
+    void writer_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work_available.wait(lock, [this] { return shutdown || !queue.empty(); });
+            if (queue.empty())
+                return;
+
+            std::vector<MismatchRecord> records = std::move(queue.front());
+            queue.pop_front();
+            writing = true;
+            lock.unlock();
+
+            if (fwrite(records.data(), sizeof(MismatchRecord), records.size(), file) != records.size())
+                failed = true;
+
+            lock.lock();
+            writing = false;
+            slot_available.notify_all();
+        }
+    }
+
+    std::string path;
+    FILE *file = nullptr;
+    std::atomic<bool> failed{false};
+
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::condition_variable slot_available;
+    std::deque<std::vector<MismatchRecord>> queue;
+    bool writing = false;
+    bool shutdown = false;
+};
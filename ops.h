@@ -0,0 +1,282 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "float_types.h"
+
+// Operations the runner executes on each fpu.
+//
+// An op is called as op(fpu, value) and returns the result to compare. It may also
+// provide op.batch(fpu, in, out, count) for fpus that have a faster batched
+// implementation, the runner uses it whenever it compiles.
+//
+// Each op has a code, and with the types of its input and result that identifies it in
+// mismatch logs, so logged cases can be replayed later.
+
+enum class OpCode : uint16_t {
+    unknown,
+    convert,
+    add,
+    sub,
+    subr,
+    mul,
+    div,
+    divr,
+    sqrt,
+};
+
+enum class TypeCode : uint8_t {
+    none,
+    int16,
+    int32,
+    int64,
+    dword,
+    qword,
+    tword,
+    st_m32, // Operands<dword>
+    st_m64, // Operands<qword>
+    st_st,  // Operands<tword>
+};
+
+template<class T>
+constexpr TypeCode type_code() {
+    if constexpr (std::is_same<T, int16_t>::value) return TypeCode::int16;
+    else if constexpr (std::is_same<T, int32_t>::value) return TypeCode::int32;
+    else if constexpr (std::is_same<T, int64_t>::value) return TypeCode::int64;
+    else if constexpr (std::is_same<T, dword>::value) return TypeCode::dword;
+    else if constexpr (std::is_same<T, qword>::value) return TypeCode::qword;
+    else if constexpr (std::is_same<T, tword>::value) return TypeCode::tword;
+    else if constexpr (std::is_same<T, Operands<dword>>::value) return TypeCode::st_m32;
+    else if constexpr (std::is_same<T, Operands<qword>>::value) return TypeCode::st_m64;
+    else if constexpr (std::is_same<T, Operands<tword>>::value) return TypeCode::st_st;
+    else return TypeCode::none;
+}
+
+inline const char *type_name(TypeCode type) {
+    switch (type) {
+    case TypeCode::none:  return "none";
+    case TypeCode::int16: return "int16";
+    case TypeCode::int32: return "int32";
+    case TypeCode::int64: return "int64";
+    case TypeCode::dword: return "dword";
+    case TypeCode::qword: return "qword";
+    case TypeCode::tword: return "tword";
+    case TypeCode::st_m32: return "st,m32";
+    case TypeCode::st_m64: return "st,m64";
+    case TypeCode::st_st:  return "st,st";
+    }
+    return "unknown";
+}
+
+inline const char *op_name(OpCode op) {
+    switch (op) {
+    case OpCode::unknown: return "unknown";
+    case OpCode::convert: return "convert";
+    case OpCode::add:     return "fadd";
+    case OpCode::sub:     return "fsub";
+    case OpCode::subr:    return "fsubr";
+    case OpCode::mul:     return "fmul";
+    case OpCode::div:     return "fdiv";
+    case OpCode::divr:    return "fdivr";
+    case OpCode::sqrt:    return "fsqrt";
+    }
+    return "unknown";
+}
+
+// Loads In with fld/fild and stores it back as Out with fstp
+template<class In, class Out>
+struct Convert {
+    static constexpr OpCode code = OpCode::convert;
+
+    template<class Fpu>
+    Out operator()(Fpu &fpu, In val) const {
+        if constexpr (std::is_integral<In>::value)
+            fpu.fild(val);
+        else
+            fpu.fld(val);
+        return fpu.template fstp<Out>();
+    }
+
+    template<class Fpu>
+    auto batch(Fpu &fpu, const In *in, Out *out, size_t count) const -> decltype(fpu.convert(in, out, count)) {
+        return fpu.convert(in, out, count);
+    }
+};
+
+template<class T>
+using Load = Convert<T, tword>;
+
+template<class T>
+using Store = Convert<tword, T>;
+
+// Loads a, runs the instruction with b as its memory operand and stores the result. For tword
+// pairs b is loaded second and the popping form runs on ST(1), the way compilers use the register
+// forms, so fsub computes a - b with fsubp st(1).
+template<OpCode Code, class B>
+struct Arithmetic {
+    static constexpr OpCode code = Code;
+
+    template<class Fpu>
+    tword operator()(Fpu &fpu, Operands<B> in) const {
+        fpu.fld(in.a);
+        if constexpr (std::is_same<B, tword>::value) {
+            fpu.fld(in.b);
+            if constexpr (Code == OpCode::add)  fpu.faddp(1);
+            if constexpr (Code == OpCode::sub)  fpu.fsubp(1);
+            if constexpr (Code == OpCode::subr) fpu.fsubrp(1);
+            if constexpr (Code == OpCode::mul)  fpu.fmulp(1);
+            if constexpr (Code == OpCode::div)  fpu.fdivp(1);
+            if constexpr (Code == OpCode::divr) fpu.fdivrp(1);
+        } else {
+            if constexpr (Code == OpCode::add)  fpu.fadd(in.b);
+            if constexpr (Code == OpCode::sub)  fpu.fsub(in.b);
+            if constexpr (Code == OpCode::subr) fpu.fsubr(in.b);
+            if constexpr (Code == OpCode::mul)  fpu.fmul(in.b);
+            if constexpr (Code == OpCode::div)  fpu.fdiv(in.b);
+            if constexpr (Code == OpCode::divr) fpu.fdivr(in.b);
+        }
+        return fpu.fstp_t();
+    }
+
+    // Fpus batch all the instructions or none, so checking for fadd's covers them all
+    template<class Fpu>
+    auto batch(Fpu &fpu, const Operands<B> *in, tword *out, size_t count) const
+            -> decltype(fpu.fadd(in, out, count)) {
+        if constexpr (Code == OpCode::add)  return fpu.fadd(in, out, count);
+        if constexpr (Code == OpCode::sub)  return fpu.fsub(in, out, count);
+        if constexpr (Code == OpCode::subr) return fpu.fsubr(in, out, count);
+        if constexpr (Code == OpCode::mul)  return fpu.fmul(in, out, count);
+        if constexpr (Code == OpCode::div)  return fpu.fdiv(in, out, count);
+        if constexpr (Code == OpCode::divr) return fpu.fdivr(in, out, count);
+    }
+};
+
+// Loads a tword, takes its square root with fsqrt and stores the result
+struct Sqrt {
+    static constexpr OpCode code = OpCode::sqrt;
+
+    template<class Fpu>
+    tword operator()(Fpu &fpu, tword in) const {
+        fpu.fld(in);
+        fpu.fsqrt();
+        return fpu.fstp_t();
+    }
+
+    template<class Fpu>
+    auto batch(Fpu &fpu, const tword *in, tword *out, size_t count) const -> decltype(fpu.fsqrt(in, out, count)) {
+        return fpu.fsqrt(in, out, count);
+    }
+};
+
+// Calls f with the op that code stands for with input In and result Out, returns false if there's none
+template<class In, class Out, class F>
+bool with_op(OpCode code, F f) {
+    if constexpr (is_operands<In>::value && std::is_same<Out, tword>::value) {
+        using B = decltype(In::b);
+        switch (code) {
+        case OpCode::add:  f(Arithmetic<OpCode::add, B>()); return true;
+        case OpCode::sub:  f(Arithmetic<OpCode::sub, B>()); return true;
+        case OpCode::subr: f(Arithmetic<OpCode::subr, B>()); return true;
+        case OpCode::mul:  f(Arithmetic<OpCode::mul, B>()); return true;
+        case OpCode::div:  f(Arithmetic<OpCode::div, B>()); return true;
+        case OpCode::divr: f(Arithmetic<OpCode::divr, B>()); return true;
+        default:           return false;
+        }
+    } else if constexpr (!is_operands<In>::value) {
+        if (code == OpCode::convert) {
+            f(Convert<In, Out>());
+            return true;
+        }
+        if constexpr (std::is_same<In, tword>::value && std::is_same<Out, tword>::value) {
+            if (code == OpCode::sqrt) {
+                f(Sqrt());
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+template<class Fpu, class Op, class In, class Out>
+auto execute(Fpu &fpu, const Op &op, const In *in, Out *out, size_t count, int)
+        -> decltype(op.batch(fpu, in, out, count), void()) {
+    op.batch(fpu, in, out, count);
+}
+
+template<class Fpu, class Op, class In, class Out>
+void execute(Fpu &fpu, const Op &op, const In *in, Out *out, size_t count, long) {
+    for (size_t i = 0; i < count; i++)
+        out[i] = op(fpu, in[i]);
+}
+
+// Runs op over count values, using the op's batched implementation for this fpu if it has one
+template<class Fpu, class Op, class In, class Out>
+void execute(Fpu &fpu, const Op &op, const In *in, Out *out, size_t count) {
+    execute(fpu, op, in, out, count, 0);
+}
+
+// An input an fpu trapped on instead of giving a result: its index in the batch, and how it trapped
+struct Trap {
+    uint32_t index;
+    std::string reason;
+};
+
+// Fpus that run batches somewhere else, like forked_x87, take one with fpu.start(op, in, out, count)
+// and hand back its results in fpu.finish(op, in, out, count), so the caller can do other work in
+// between. Every other fpu runs the whole batch in execute_finish. The inputs that trapped, in
+// order, are returned by finish, their results are meaningless. Only fpus run somewhere else can
+// survive a trap, so the others never return any.
+template<class Fpu, class Op, class In, class Out>
+auto execute_start(Fpu &fpu, const Op &op, const In *in, Out *out, size_t count, int)
+        -> decltype(fpu.start(op, in, out, count), void()) {
+    fpu.start(op, in, out, count);
+}
+
+template<class Fpu, class Op, class In, class Out>
+void execute_start(Fpu &, const Op &, const In *, Out *, size_t, long) {}
+
+template<class Fpu, class Op, class In, class Out>
+auto execute_finish(Fpu &fpu, const Op &op, const In *in, Out *out, size_t count, int)
+        -> decltype(fpu.finish(op, in, out, count)) {
+    return fpu.finish(op, in, out, count);
+}
+
+template<class Fpu, class Op, class In, class Out>
+std::vector<Trap> execute_finish(Fpu &fpu, const Op &op, const In *in, Out *out, size_t count, long) {
+    execute(fpu, op, in, out, count);
+    return {};
+}
+
+template<class Fpu, class Op, class In, class Out>
+void execute_start(Fpu &fpu, const Op &op, const In *in, Out *out, size_t count) {
+    execute_start(fpu, op, in, out, count, 0);
+}
+
+template<class Fpu, class Op, class In, class Out>
+std::vector<Trap> execute_finish(Fpu &fpu, const Op &op, const In *in, Out *out, size_t count) {
+    return execute_finish(fpu, op, in, out, count, 0);
+}
+
+// Runs op on one value from clear exception flags, and sets status to the status word it leaves.
+// Returns false for fpus whose status word can't be read here, like forked_x87.
+template<class Fpu, class Op, class In>
+auto status_after(Fpu &fpu, const Op &op, const In &in, uint16_t &status, int) -> decltype(fpu.fstsw(), bool()) {
+    fpu.fclex();
+    op(fpu, in);
+    status = fpu.fstsw();
+    return true;
+}
+
+template<class Fpu, class Op, class In>
+bool status_after(Fpu &, const Op &, const In &, uint16_t &, long) {
+    return false;
+}
+
+template<class Fpu, class Op, class In>
+bool status_after(Fpu &fpu, const Op &op, const In &in, uint16_t &status) {
+    return status_after(fpu, op, in, status, 0);
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#include "ops.h"
+#include "profile.h"
+#include "ring.h"
+
+// Runs batches through the generate, fpu a, fpu b and compare stages at the same time, each stage on
+// its own thread, instead of one after another.
+//
+// The thread calling run generates, and the other stages each have a thread, which owns the stage's
+// fpu. Batches are handed from stage to stage through lock-free single producer, single consumer
+// rings, and the comparer hands them back to the generator through a last one. The batches are
+// allocated once, when the pipeline is made, so the steady state allocates nothing. Depth is how
+// many batches there are, so how many can be in flight at once.
+template<class FpuA, class FpuB>
+class Pipeline {
+public:
+    static constexpr size_t max_depth = 64;
+
+    struct Stages;
+
+    // Its inputs and both fpus' results each get a cache line aligned array of up to max_value_size
+    // bytes per value
+    struct Batch {
+        static constexpr size_t max_value_size = 32;
+
+        enum Array { inputs, results_a, results_b };
+
+        size_t first = 0; // index of the first value in the sequence
+        size_t count = 0;
+        std::vector<Trap> traps; // inputs fpu b trapped on
+
+        template<class T>
+        T *values(Array array) {
+            static_assert(sizeof(T) <= max_value_size, "Value too large for a pipeline batch");
+            return reinterpret_cast<T*>(memory.get() + array * stride);
+        }
+
+        // Each array is rounded up to whole cache lines, so the next starts on one for any capacity
+        explicit Batch(size_t capacity)
+            : stride((capacity * max_value_size + 63) & ~size_t(63)),
+              memory(static_cast<uint8_t*>(::operator new[](3 * stride, std::align_val_t(64)))) {}
+
+    private:
+        friend class Pipeline;
+
+        struct Free {
+            void operator()(uint8_t *p) const { ::operator delete[](p, std::align_val_t(64)); }
+        };
+
+        size_t stride; // bytes from one array to the next
+        std::unique_ptr<uint8_t[], Free> memory;
+
+        Stages *stages = nullptr; // of the run it's part of
+        StageTimes *times = nullptr;
+    };
+
+    // What is done with the batches of one run. Each function is called on its own thread, with the
+    // batches in order.
+    struct Stages {
+        virtual void generate(Batch &batch) = 0;
+        virtual void run_a(FpuA &fpu, Batch &batch) = 0;
+        virtual void run_b(FpuB &fpu, Batch &batch) = 0;
+        virtual void compare(Batch &batch) = 0;
+
+    protected:
+        ~Stages() = default;
+    };
+
+    Pipeline(size_t depth, size_t batch_size) : batch_size(batch_size) {
+        depth = std::clamp<size_t>(depth, 1, max_depth);
+        for (size_t i = 0; i < depth; i++)
+            pool.push_back(std::make_unique<Batch>(batch_size));
+
+        threads.emplace_back([this] {
+            unpin();
+            FpuA fpu;
+            stage_loop(to_a, to_b, Stage::fpu_a, [&] (Batch &batch) { batch.stages->run_a(fpu, batch); });
+        });
+        threads.emplace_back([this] {
+            unpin();
+            FpuB fpu;
+            stage_loop(to_b, to_compare, Stage::fpu_b, [&] (Batch &batch) { batch.stages->run_b(fpu, batch); });
+        });
+        threads.emplace_back([this] {
+            unpin();
+            stage_loop(to_compare, returned, Stage::compare, [&] (Batch &batch) { batch.stages->compare(batch); });
+        });
+    }
+
+    // A null batch stops a stage thread. Nothing is in flight between runs, so they all get theirs at once.
+    ~Pipeline() {
+        push(to_a, nullptr);
+        push(to_b, nullptr);
+        push(to_compare, nullptr);
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    size_t depth() const { return pool.size(); }
+    size_t batch_capacity() const { return batch_size; }
+
+    // Runs the values in [first, last) through the stages a batch at a time, and returns once they're
+    // all compared. The time of each stage is added to times.
+    void run(size_t first, size_t last, Stages &stages, StageTimes &times) {
+        std::vector<Batch*> idle;
+        for (auto &batch : pool)
+            idle.push_back(batch.get());
+
+        size_t next = first;
+        while (next < last || idle.size() < pool.size()) {
+            if (next == last || idle.empty()) {
+                idle.push_back(pop(returned));
+                continue;
+            }
+
+            Batch *batch = idle.back();
+            idle.pop_back();
+            batch->first = next;
+            batch->count = std::min(batch_size, last - next);
+            batch->stages = &stages;
+            batch->times = &times;
+            next += batch->count;
+
+            auto start = std::chrono::steady_clock::now();
+            stages.generate(*batch);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            times[int(Stage::generate)].seconds += elapsed.count();
+            push(to_a, batch);
+        }
+    }
+
+private:
+    using Ring = SpscRing<Batch*, max_depth>;
+
+    static void push(Ring &ring, Batch *batch) {
+        Batch **slot;
+        while (!(slot = ring.wait_producer_slot(std::chrono::seconds(1)))) {}
+        *slot = batch;
+        ring.publish();
+    }
+
+    static Batch *pop(Ring &ring) {
+        Batch **slot;
+        while (!(slot = ring.wait_consumer_slot(std::chrono::seconds(1)))) {}
+        Batch *batch = *slot;
+        ring.release();
+        return batch;
+    }
+
+    // Threads start out on their creator's core, which the runner pins its workers to
+    static void unpin() {
+#ifdef __linux__
+        cpu_set_t cpus;
+        if (sched_getaffinity(getpid(), sizeof(cpus), &cpus) == 0)
+            sched_setaffinity(0, sizeof(cpus), &cpus);
+#endif
+    }
+
+    // Each stage adds to its own element of times, so the threads never write the same one
+    template<class F>
+    static void stage_loop(Ring &in, Ring &out, Stage stage, F f) {
+        while (Batch *batch = pop(in)) {
+            auto start = std::chrono::steady_clock::now();
+            f(*batch);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            (*batch->times)[int(stage)].seconds += elapsed.count();
+            push(out, batch);
+        }
+    }
+
+    size_t batch_size;
+    std::vector<std::unique_ptr<Batch>> pool;
+
+    Ring to_a;
+    Ring to_b;
+    Ring to_compare;
+    Ring returned;
+
+    std::vector<std::thread> threads;
+};
@@ -0,0 +1,406 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fmt/format.h>
+
+// What a test run covers, decided at runtime: which phases run, how many cases their random
+// sequences get, what seeds those come from, and optionally a wall clock budget for all of it.
+//
+// Options are given on the command line or in a plan file, one "option value" per line:
+//
+//     phases fadd,fsqrt      only phases whose name contains one of these
+//     skip denormal          but none whose name contains one of these
+//     scale 0.1              every random sequence gets a tenth of its usual cases
+//     cases 100000           or exactly this many, and cases fsqrt=100000 only for matching phases
+//     seed 7                 another seed for every random sequence, or seed fsqrt=7
+//     budget 30s             split 30 seconds (or 15m, 8h) between the phases
+//     history nightly.hist   per phase rates and mismatches from past runs, updated after this one
+//
+// With a budget the phases are surveyed first, then each one gets a share of the time left when it
+// starts: half of the budget is split evenly between the phases, the other half by how many
+// mismatches per second each one found in past runs, if any found some. Shares are turned into cases with the rates
+// of past runs, or of this run so far, so the run ends close to the budget even without history.
+class TestPlan {
+public:
+    // Whether name, without its dashes, is an option set takes
+    static bool is_option(const char *name) {
+        for (const char *option : { "phases", "skip", "scale", "cases", "seed", "budget", "history", "plan" }) {
+            if (strcmp(name, option) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // Applies one option. Returns what's wrong with it, empty if nothing.
+    std::string set(const std::string &option, const std::string &value) {
+        if (option == "phases" || option == "skip") {
+            auto &patterns = option == "phases" ? included : excluded;
+            for (size_t start = 0; start <= value.size();) {
+                size_t comma = std::min(value.find(',', start), value.size());
+                if (comma > start)
+                    patterns.push_back(value.substr(start, comma - start));
+                start = comma + 1;
+            }
+        } else if (option == "scale") {
+            if (!parse_number(value, scale_factor) || scale_factor < 0)
+                return fmt::format("bad scale {}", value);
+        } else if (option == "cases" || option == "seed") {
+            Rule rule;
+            size_t equals = value.rfind('=');
+            if (equals != std::string::npos)
+                rule.pattern = value.substr(0, equals);
+            std::string number = value.substr(equals == std::string::npos ? 0 : equals + 1);
+            char *end;
+            rule.value = strtoull(number.c_str(), &end, 0);
+            if (number.empty() || *end)
+                return fmt::format("bad {} {}", option, value);
+            (option == "cases" ? case_rules : seed_rules).push_back(rule);
+        } else if (option == "budget") {
+            if (!parse_duration(value, budget) || budget <= 0)
+                return fmt::format("bad budget {}, expected seconds or a number with s, m or h", value);
+        } else if (option == "history") {
+            history_path = value;
+            return load_history();
+        } else if (option == "plan") {
+            return load(value);
+        } else {
+            return fmt::format("unknown plan option {}", option);
+        }
+        return {};
+    }
+
+    // Applies the options in a plan file. Blank lines and everything after a # are ignored.
+    std::string load(const std::string &path) {
+        FILE *f = fopen(path.c_str(), "r");
+        if (!f)
+            return fmt::format("can't open plan {}: {}", path, strerror(errno));
+
+        std::string problem;
+        char line[1024];
+        for (int number = 1; problem.empty() && fgets(line, sizeof(line), f); number++) {
+            std::string text = line;
+            text = trim(text.substr(0, text.find('#')));
+            if (text.empty())
+                continue;
+
+            size_t space = text.find_first_of(" \t");
+            std::string option = text.substr(0, space);
+            std::string value = space == std::string::npos ? "" : trim(text.substr(space));
+            if (option == "plan" || !is_option(option.c_str()))
+                problem = fmt::format("unknown plan option {}", option);
+            else
+                problem = set(option, value);
+            if (!problem.empty())
+                problem = fmt::format("{}:{}: {}", path, number, problem);
+        }
+        fclose(f);
+        return problem;
+    }
+
+    bool selected(const std::string &phase) const {
+        auto matches = [&] (const std::string &pattern) { return phase.find(pattern) != std::string::npos; };
+        return (included.empty() || std::any_of(included.begin(), included.end(), matches))
+            && std::none_of(excluded.begin(), excluded.end(), matches);
+    }
+
+    bool budgeted() const { return budget > 0; }
+
+    // The survey, which goes through the phases before a budgeted run without running anything
+    void survey_phase(const std::string &name) {
+        surveying = selected(name);
+        if (surveying)
+            survey.push_back({ name });
+    }
+
+    void survey_cases(size_t cases) {
+        if (surveying)
+            survey.back().cases += cases;
+    }
+
+    // Every phase the survey went through once, with its usual cases summed over all its runs
+    void list(FILE *out) const {
+        std::vector<std::pair<std::string, uint64_t>> phases;
+        for (const Occurrence &o : survey) {
+            auto found = std::find_if(phases.begin(), phases.end(), [&] (auto &p) { return p.first == o.name; });
+            if (found == phases.end())
+                phases.push_back({ o.name, o.cases });
+            else
+                found->second += o.cases;
+        }
+        for (auto &[name, cases] : phases)
+            fmt::print(out, "{:<50} {:>10}\n", name, cases);
+    }
+
+    // Starts the budget's clock, and weighs the surveyed phases by their past yield
+    void start() {
+        started = std::chrono::steady_clock::now();
+        next = 0;
+
+        // Phases of only fixed values take no time worth budgeting
+        std::map<std::string, size_t> occurrences;
+        for (const Occurrence &o : survey) {
+            if (o.cases)
+                occurrences[o.name]++;
+        }
+
+        double total_yield = 0;
+        for (auto &[name, count] : occurrences)
+            total_yield += yield(name);
+
+        for (Occurrence &o : survey) {
+            if (!o.cases)
+                continue;
+            double weight = 1.0 / occurrences.size();
+            if (total_yield > 0)
+                weight += yield(o.name) / total_yield;
+            o.weight = weight / occurrences[o.name];
+        }
+    }
+
+    // Called by the runner as each phase starts. False if the phase isn't part of the plan.
+    bool begin_phase(const std::string &name) {
+        current = name;
+        budget_scale = -1;
+        if (!selected(name))
+            return false;
+        if (!budgeted())
+            return true;
+
+        // Phases run in the order they were surveyed in
+        while (next < survey.size() && survey[next].name != name)
+            next++;
+        if (next == survey.size())
+            return true;
+
+        double weights = 0;
+        for (size_t i = next; i < survey.size(); i++)
+            weights += survey[i].weight;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+        double seconds = std::max(0.0, budget - elapsed.count()) * survey[next].weight / weights;
+        if (survey[next].cases)
+            budget_scale = seconds * rate(name) / survey[next].cases;
+        next++;
+        return true;
+    }
+
+    // How many cases a random sequence of the current phase gets, instead of default_cases
+    size_t cases(size_t default_cases) const {
+        if (const Rule *rule = find_rule(case_rules))
+            return rule->value;
+        if (budget_scale >= 0)
+            return std::max<size_t>(std::min(default_cases, min_budget_cases), default_cases * budget_scale + 0.5);
+        return default_cases * scale_factor + 0.5;
+    }
+
+    // The seed a random sequence of the current phase comes from, instead of default_seed
+    uint64_t seed(uint64_t default_seed) const {
+        const Rule *rule = find_rule(seed_rules);
+        return rule ? rule->value : default_seed;
+    }
+
+    // Called by the runner after each compare of the current phase
+    void record(uint64_t cases, double seconds, uint64_t mismatches) {
+        PhaseStats &s = run_stats[current];
+        s.cases += cases;
+        s.seconds += seconds;
+        s.mismatches += mismatches;
+    }
+
+    // Writes the history back with this run's stats added. Older runs count half as much each
+    // time, so phases whose bugs were fixed stop getting the lion's share of the budget.
+    bool save_history() const {
+        if (history_path.empty())
+            return true;
+
+        std::map<std::string, PhaseStats> merged;
+        for (auto &[name, s] : history)
+            merged[name] = { s.cases / 2, s.seconds / 2, s.mismatches / 2 };
+        for (auto &[name, s] : run_stats) {
+            merged[name].cases += s.cases;
+            merged[name].seconds += s.seconds;
+            merged[name].mismatches += s.mismatches;
+        }
+
+        // Written to a temporary file and renamed, like checkpoints
+        std::string temp = history_path + ".tmp";
+        FILE *f = fopen(temp.c_str(), "w");
+        if (!f)
+            return false;
+        for (auto &[name, s] : merged)
+            fmt::print(f, "{:.0f} {:.6f} {:.3f} {}\n", s.cases, s.seconds, s.mismatches, name);
+        bool ok = fclose(f) == 0;
+        return ok && rename(temp.c_str(), history_path.c_str()) == 0;
+    }
+
+    const std::string &history_name() const { return history_path; }
+
+private:
+    static constexpr double initial_rate = 1e6; // cases per second, before anything was measured
+    static constexpr size_t min_budget_cases = 1000; // so a short budget still touches every sequence
+
+    struct Rule {
+        std::string pattern; // empty for all phases
+        uint64_t value = 0;
+    };
+
+    struct Occurrence {
+        std::string name;
+        uint64_t cases = 0; // usual cases of its random sequences
+        double weight = 0;  // its share of the budget
+    };
+
+    struct PhaseStats {
+        double cases = 0;
+        double seconds = 0;
+        double mismatches = 0;
+    };
+
+    // The last rule matching the current phase
+    const Rule *find_rule(const std::vector<Rule> &rules) const {
+        for (auto rule = rules.rbegin(); rule != rules.rend(); ++rule) {
+            if (current.find(rule->pattern) != std::string::npos)
+                return &*rule;
+        }
+        return nullptr;
+    }
+
+    // The history file is one "cases seconds mismatches name" line per phase
+    std::string load_history() {
+        history.clear();
+        FILE *f = fopen(history_path.c_str(), "r");
+        if (!f)
+            return {}; // there's no history before the first run
+
+        char line[1024];
+        while (fgets(line, sizeof(line), f)) {
+            PhaseStats s;
+            int name_start = 0;
+            if (sscanf(line, "%lf %lf %lf %n", &s.cases, &s.seconds, &s.mismatches, &name_start) == 3 && name_start)
+                history[trim(line + name_start)] = s;
+        }
+        fclose(f);
+        return {};
+    }
+
+    PhaseStats stats(const std::string &name) const {
+        PhaseStats s;
+        for (auto *source : { &history, &run_stats }) {
+            auto found = source->find(name);
+            if (found != source->end()) {
+                s.cases += found->second.cases;
+                s.seconds += found->second.seconds;
+                s.mismatches += found->second.mismatches;
+            }
+        }
+        return s;
+    }
+
+    // Mismatches per second of a phase in past runs
+    double yield(const std::string &name) const {
+        auto found = history.find(name);
+        return found == history.end() || found->second.seconds <= 0 ? 0
+             : found->second.mismatches / found->second.seconds;
+    }
+
+    // Cases per second of a phase, or of all phases if it never ran
+    double rate(const std::string &name) const {
+        PhaseStats s = stats(name);
+        if (s.seconds > 0 && s.cases > 0)
+            return s.cases / s.seconds;
+
+        double cases = 0, seconds = 0;
+        for (auto *source : { &history, &run_stats }) {
+            for (auto &[n, p] : *source) {
+                cases += p.cases;
+                seconds += p.seconds;
+            }
+        }
+        return seconds > 0 && cases > 0 ? cases / seconds : initial_rate;
+    }
+
+    static std::string trim(const std::string &s) {
+        size_t first = s.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos)
+            return {};
+        return s.substr(first, s.find_last_not_of(" \t\r\n") - first + 1);
+    }
+
+    static bool parse_number(const std::string &s, double &number) {
+        char *end;
+        number = strtod(s.c_str(), &end);
+        return !s.empty() && !*end;
+    }
+
+    static bool parse_duration(const std::string &s, double &seconds) {
+        char *end;
+        seconds = strtod(s.c_str(), &end);
+        if (s.empty() || end == s.c_str())
+            return false;
+        if (strcmp(end, "m") == 0)
+            seconds *= 60;
+        else if (strcmp(end, "h") == 0)
+            seconds *= 3600;
+        else if (*end && strcmp(end, "s") != 0)
+            return false;
+        return true;
+    }
+
+    std::vector<std::string> included;
+    std::vector<std::string> excluded;
+    double scale_factor = 1;
+    std::vector<Rule> case_rules;
+    std::vector<Rule> seed_rules;
+    double budget = 0; // seconds, 0 for none
+
+    std::string history_path;
+    std::map<std::string, PhaseStats> history;
+    std::map<std::string, PhaseStats> run_stats;
+
+    std::vector<Occurrence> survey;
+    bool surveying = false;
+    size_t next = 0; // the next occurrence to run
+    std::chrono::steady_clock::time_point started;
+
+    std::string current;     // phase
+    double budget_scale = -1; // of the current phase's usual cases, negative without a budget
+};
+
+// Stands in for a Runner to survey the phases of a run into plan, without running anything
+class PhaseSurvey {
+public:
+    explicit PhaseSurvey(TestPlan &plan) : plan(plan) {}
+
+    void set_control_word(uint16_t) {}
+    void set_status_stride(size_t) {}
+    size_t status_stride() const { return 0; }
+    void phase(std::string name) { plan.survey_phase(name); }
+
+    // Only random sequences count, the plan doesn't resize lists of values
+    template<class Range, class Op, class Check>
+    void compare(Range&& values, Op, Check) { add(values, 0); }
+
+    template<class Range, class Op>
+    void compare(Range&& values, Op) { add(values, 0); }
+
+private:
+    template<class Range>
+    auto add(const Range &range, int) -> decltype(range.with(size_t(), uint64_t()), void()) {
+        plan.survey_cases(range.size());
+    }
+
+    template<class Range>
+    void add(const Range &, long) {}
+
+    TestPlan &plan;
+};
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <fmt/format.h>
+
+// Where the time goes in a test run. Every phase records wall time and case count, and the
+// runner splits the workers' time into four stages: generating inputs, each fpu and comparing.
+//
+// On Linux the workers also count cycles, instructions and branch misses with perf_event_open.
+// Reading the counters is a syscall, so they are only sampled around the stages of the middle batch
+// of every shard, warm and full sized, and scaled up to the whole shard, which keeps the overhead to
+// a few percent.
+// Without counters (no permission, not Linux, in a VM without a pmu) only the times are shown.
+
+enum class Stage { generate, fpu_a, fpu_b, compare };
+constexpr int stage_count = 4;
+
+struct Counts {
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t branch_misses = 0;
+
+    Counts &operator+=(const Counts &rhs) {
+        cycles += rhs.cycles;
+        instructions += rhs.instructions;
+        branch_misses += rhs.branch_misses;
+        return *this;
+    }
+
+    Counts operator-(const Counts &rhs) const {
+        return { cycles - rhs.cycles, instructions - rhs.instructions, branch_misses - rhs.branch_misses };
+    }
+
+    Counts scaled(double factor) const {
+        return { uint64_t(cycles * factor), uint64_t(instructions * factor), uint64_t(branch_misses * factor) };
+    }
+};
+
+// Hardware counters for the thread that creates it
+class PerfCounters {
+public:
+    PerfCounters() {
+#ifdef __linux__
+        leader = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+        if (leader < 0)
+            return;
+        int instructions = open_counter(PERF_COUNT_HW_INSTRUCTIONS, leader);
+        int branch_misses = open_counter(PERF_COUNT_HW_BRANCH_MISSES, leader);
+        if (instructions < 0 || branch_misses < 0) {
+            close_all(instructions, branch_misses);
+            return;
+        }
+        followers[0] = instructions;
+        followers[1] = branch_misses;
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+        close_all(followers[0], followers[1]);
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available() const { return leader >= 0; }
+
+    Counts read() const {
+        Counts counts;
+#ifdef __linux__
+        // PERF_FORMAT_GROUP: the number of counters, then each value in the order they were opened
+        uint64_t values[4];
+        if (available() && ::read(leader, values, sizeof(values)) == sizeof(values) && values[0] == 3)
+            counts = { values[1], values[2], values[3] };
+#endif
+        return counts;
+    }
+
+private:
+#ifdef __linux__
+    static int open_counter(uint64_t config, int group) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+    }
+
+    void close_all(int instructions, int branch_misses) {
+        if (instructions >= 0)
+            close(instructions);
+        if (branch_misses >= 0)
+            close(branch_misses);
+        if (leader >= 0)
+            close(leader);
+        leader = -1;
+    }
+
+    int followers[2] = { -1, -1 };
+#endif
+    int leader = -1;
+};
+
+struct StageStats {
+    double seconds = 0;
+    Counts counts;
+
+    StageStats &operator+=(const StageStats &rhs) {
+        seconds += rhs.seconds;
+        counts += rhs.counts;
+        return *this;
+    }
+};
+
+using StageTimes = StageStats[stage_count];
+
+// Times consecutive stages of a batch. When sampling, counters are read at every lap too.
+class StageClock {
+public:
+    StageClock(const PerfCounters &counters, StageTimes &times, StageTimes &sampled)
+        : counters(counters), times(times), sampled(sampled) {}
+
+    void start(bool sample) {
+        sampling = sample && counters.available();
+        if (sampling)
+            last_counts = counters.read();
+        last_time = std::chrono::steady_clock::now();
+    }
+
+    void lap(Stage stage) {
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - last_time;
+        times[int(stage)].seconds += elapsed.count();
+
+        if (sampling) {
+            Counts counts = counters.read();
+            sampled[int(stage)].counts += counts - last_counts;
+            last_counts = counts;
+            now = std::chrono::steady_clock::now(); // don't charge the read to the next stage
+        }
+        last_time = now;
+    }
+
+private:
+    const PerfCounters &counters;
+    StageTimes &times;
+    StageTimes &sampled;
+    bool sampling = false;
+    Counts last_counts;
+    std::chrono::steady_clock::time_point last_time;
+};
+
+class Profile {
+public:
+    Profile(const char *name_a, const char *name_b) : stage_names{ "generate", name_a, name_b, "compare" } {}
+
+    // Ends the current phase and starts a new one. A phase that was seen before, like the same
+    // tests under another control word, continues its row instead of adding a new one.
+    void phase(std::string name) {
+        end_phase();
+        auto found = std::find_if(phases.begin(), phases.end(), [&] (const Phase &p) { return p.name == name; });
+        current = found - phases.begin();
+        if (found == phases.end())
+            phases.push_back({ std::move(name), 0, 0, {}, false });
+        ended = false;
+        phase_start = std::chrono::steady_clock::now();
+    }
+
+    void add(uint64_t cases, const StageTimes &stages, bool counted) {
+        if (phases.empty())
+            phase("");
+        Phase &p = phases[current];
+        p.cases += cases;
+        for (int i = 0; i < stage_count; i++)
+            p.stages[i] += stages[i];
+        p.counted |= counted;
+    }
+
+    void summary(FILE *out) {
+        end_phase();
+        if (phases.empty())
+            return;
+
+        fmt::print(out, "\n{:<50} {:>10} {:>9} {:>9}", "phase", "cases", "wall ms", "Mcases/s");
+        for (auto name : stage_names)
+            fmt::print(out, " {:>8}", name);
+        fmt::print(out, "\n");
+
+        Phase total = { "total", 0, 0, {}, false };
+        bool counted = false;
+        for (const Phase &p : phases) {
+            if (p.cases == 0)
+                continue;
+            print_phase(out, p);
+            total.cases += p.cases;
+            total.seconds += p.seconds;
+            for (int i = 0; i < stage_count; i++)
+                total.stages[i] += p.stages[i];
+            counted |= p.counted;
+        }
+        print_phase(out, total);
+
+        double worker_seconds = 0;
+        for (auto &stage : total.stages)
+            worker_seconds += stage.seconds;
+
+        fmt::print(out, "\n{:<10} {:>9} {:>6}", "stage", "cpu s", "share");
+        if (counted)
+            fmt::print(out, " {:>14} {:>14} {:>5} {:>13} {:>11} {:>12}",
+                       "cycles", "instructions", "ipc", "branch-misses", "cycles/case", "misses/case");
+        fmt::print(out, "\n");
+
+        for (int i = 0; i < stage_count; i++) {
+            const StageStats &s = total.stages[i];
+            fmt::print(out, "{:<10} {:>9.3f} {:>5.1f}%", stage_names[i], s.seconds, percent(s.seconds, worker_seconds));
+            if (counted) {
+                const Counts &c = s.counts;
+                fmt::print(out, " {:>14} {:>14} {:>5.2f} {:>13} {:>11.1f} {:>12.3f}", c.cycles, c.instructions,
+                           c.cycles ? double(c.instructions) / c.cycles : 0.0, c.branch_misses,
+                           double(c.cycles) / total.cases, double(c.branch_misses) / total.cases);
+            }
+            fmt::print(out, "\n");
+        }
+        if (!counted)
+            fmt::print(out, "(hardware counters unavailable, times only)\n");
+    }
+
+private:
+    struct Phase {
+        std::string name;
+        uint64_t cases = 0;
+        double seconds = 0;
+        StageTimes stages;
+        bool counted = false;
+    };
+
+    void end_phase() {
+        if (phases.empty() || ended)
+            return;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - phase_start;
+        phases[current].seconds += elapsed.count();
+        ended = true;
+    }
+
+    static double percent(double part, double whole) {
+        return whole > 0 ? part / whole * 100 : 0;
+    }
+
+    void print_phase(FILE *out, const Phase &p) {
+        double worker_seconds = 0;
+        for (auto &stage : p.stages)
+            worker_seconds += stage.seconds;
+
+        fmt::print(out, "{:<50} {:>10} {:>9.1f} {:>9.1f}", p.name.substr(0, 50), p.cases, p.seconds * 1e3,
+                   p.seconds > 0 ? p.cases / p.seconds / 1e6 : 0.0);
+        for (auto &stage : p.stages)
+            fmt::print(out, " {:>7.1f}%", percent(stage.seconds, worker_seconds));
+        fmt::print(out, "\n");
+    }
+
+    const char *stage_names[stage_count];
+    std::vector<Phase> phases;
+    size_t current = 0;
+    std::chrono::steady_clock::time_point phase_start;
+    bool ended = true;
+};
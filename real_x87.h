@@ -1,5 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <stddef.h>
+#include <type_traits>
+
 #include "x87.h"
 
 #define ST_ASM(str, val) do { assert(val < 8); switch (val) { \
@@ -13,38 +19,199 @@
     case 7: __asm__ volatile(str " %st(7)"); break; \
 } } while (false)
 
+// Converts count values from in to out, 8 at a time, entirely in asm.
+// Each block loads 8 values to fill the whole x87 stack and then stores them all in reverse,
+// the remainder is converted one at a time. The x87 stack must be empty.
+#define BATCH_ASM(load, store, in, out, count) do { \
+    size_t blocks = (count) / 8; \
+    size_t rest = (count) % 8; \
+    auto *in_ptr = (in); \
+    auto *out_ptr = (out); \
+    __asm__ volatile( \
+        "test %[blocks], %[blocks]\n\t" \
+        "jz 2f\n" \
+        "1:\n\t" \
+        load " 0*%c[isz](%[in])\n\t" \
+        load " 1*%c[isz](%[in])\n\t" \
+        load " 2*%c[isz](%[in])\n\t" \
+        load " 3*%c[isz](%[in])\n\t" \
+        load " 4*%c[isz](%[in])\n\t" \
+        load " 5*%c[isz](%[in])\n\t" \
+        load " 6*%c[isz](%[in])\n\t" \
+        load " 7*%c[isz](%[in])\n\t" \
+        store " 7*%c[osz](%[out])\n\t" \
+        store " 6*%c[osz](%[out])\n\t" \
+        store " 5*%c[osz](%[out])\n\t" \
+        store " 4*%c[osz](%[out])\n\t" \
+        store " 3*%c[osz](%[out])\n\t" \
+        store " 2*%c[osz](%[out])\n\t" \
+        store " 1*%c[osz](%[out])\n\t" \
+        store " 0*%c[osz](%[out])\n\t" \
+        "add $8*%c[isz], %[in]\n\t" \
+        "add $8*%c[osz], %[out]\n\t" \
+        "dec %[blocks]\n\t" \
+        "jnz 1b\n" \
+        "2:\n\t" \
+        "test %[rest], %[rest]\n\t" \
+        "jz 4f\n" \
+        "3:\n\t" \
+        load " (%[in])\n\t" \
+        store " (%[out])\n\t" \
+        "add $%c[isz], %[in]\n\t" \
+        "add $%c[osz], %[out]\n\t" \
+        "dec %[rest]\n\t" \
+        "jnz 3b\n" \
+        "4:" \
+        : [in] "+r"(in_ptr), [out] "+r"(out_ptr), [blocks] "+r"(blocks), [rest] "+r"(rest) \
+        : [isz] "i"(sizeof(*in_ptr)), [osz] "i"(sizeof(*out_ptr)) \
+        : "memory", "cc", "st", "st(1)", "st(2)", "st(3)", "st(4)", "st(5)", "st(6)", "st(7)"); \
+} while (false)
+
+#define BATCH_ASM_STORE(load, in, out, count) do { \
+    using OutType = std::remove_pointer_t<decltype(out)>; \
+    if constexpr (std::is_same<OutType, tword>::value) \
+        BATCH_ASM(load, "fstpt", in, out, count); \
+    else if constexpr (std::is_same<OutType, qword>::value) \
+        BATCH_ASM(load, "fstpl", in, out, count); \
+    else if constexpr (std::is_same<OutType, dword>::value) \
+        BATCH_ASM(load, "fstps", in, out, count); \
+    else \
+        static_assert(!sizeof(OutType), "Unsupported output type"); \
+} while (false)
+
 // This is a pass-though to the real x87 fpu.
 // We take advantage of the fact that gcc/llvm won't emit any x87 code, unless we use the long double type.
-// But this does mean there are a few restrictions. This class is not thread safe.
-class hard_x87 : public x87 {
+// But this does mean there are a few restrictions. This class is not thread safe,
+// but x87 state is per-thread, so each thread can safely use its own instance.
+class hard_x87 : public x87_base<hard_x87> {
 public:
-    virtual void faddp(int st) { ST_ASM("faddp", st); };
-    virtual void fadd(int st)  { ST_ASM("fadd", st); };;
-    virtual void fadd(qword f) { __asm__ volatile ("faddl %0" :: "m"(f)); };
-    virtual void fadd(dword f) { __asm__ volatile ("fadds %0" :: "m"(f)); };
-    // virtual void fmulp(int st) { ST_ASM("fmulp", st); };
-    // virtual void fmul(int st)  { ST_ASM("fmul", st); };
-    // virtual void fmul(qword f) { __asm__ volatile ("fmull %0" :: "m"(f)); };
-    // virtual void fmul(dword f) { __asm__ volatile ("fmuls %0" :: "m"(f)); };
-
-    virtual void fld(tword f)  { __asm__ volatile ("fldt %0" :: "m"(f)); };
-    virtual void fld(qword f)  { __asm__ volatile ("fldl %0" :: "m"(f)); };
-    virtual void fld(dword f)  { __asm__ volatile ("flds %0" :: "m"(f)); };
-    virtual void fld(int st)   { ST_ASM("fld", st); };
-
-    virtual void fild(int16_t i) { __asm__ volatile ("filds %0" :: "m"(i)); };
-    virtual void fild(int32_t i) { __asm__ volatile ("fildl %0" :: "m"(i)); };
-    virtual void fild(int64_t i) { __asm__ volatile ("fildq %0" :: "m"(i)); };
-
-    void fadd()  { fadd(1);  }
-    void faddp() { faddp(1); }
-    // void fmul()  { fmul(1); }
-    // void fmulp() { fmulp(1); }
-
-    virtual tword fstp_t() { tword ret; __asm__ ("fstpt %0" : "=&m"(ret)); return ret; };
-    virtual qword fstp_l() { qword ret; __asm__ ("fstpl %0" : "=&m"(ret)); return ret; };
-    virtual dword fstp_s() { dword ret; __asm__ ("fstps %0" : "=&m"(ret)); return ret; };
-
-    virtual uint16_t fstcw() { uint16_t cw; __asm__ ("fstcw %0" : "=&m"(cw)); return cw; }
-    virtual void fldcw(uint16_t cw) {  __asm__ volatile ("fldcw %0" :: "m"(cw)); }
+    void faddp(int st) { ST_ASM("faddp", st); };
+    void fadd(int st)  { ST_ASM("fadd", st); };;
+    void fadd(qword f) { __asm__ volatile ("faddl %0" :: "m"(f)); };
+    void fadd(dword f) { __asm__ volatile ("fadds %0" :: "m"(f)); };
+
+    // AT&T syntax swaps fsub and fsubr when the destination isn't ST(0), so the popping forms are
+    // written reversed to get the Intel behaviour, fsubp st(i) computing ST(i) - ST(0).
+    void fsub(int st)   { ST_ASM("fsub", st); };
+    void fsubp(int st)  { ST_ASM("fsubrp", st); };
+    void fsub(qword f)  { __asm__ volatile ("fsubl %0" :: "m"(f)); };
+    void fsub(dword f)  { __asm__ volatile ("fsubs %0" :: "m"(f)); };
+
+    void fsubr(int st)  { ST_ASM("fsubr", st); };
+    void fsubrp(int st) { ST_ASM("fsubp", st); };
+    void fsubr(qword f) { __asm__ volatile ("fsubrl %0" :: "m"(f)); };
+    void fsubr(dword f) { __asm__ volatile ("fsubrs %0" :: "m"(f)); };
+
+    void fmulp(int st) { ST_ASM("fmulp", st); };
+    void fmul(int st)  { ST_ASM("fmul", st); };
+    void fmul(qword f) { __asm__ volatile ("fmull %0" :: "m"(f)); };
+    void fmul(dword f) { __asm__ volatile ("fmuls %0" :: "m"(f)); };
+
+    // Reversed like fsubp and fsubrp
+    void fdiv(int st)   { ST_ASM("fdiv", st); };
+    void fdivp(int st)  { ST_ASM("fdivrp", st); };
+    void fdiv(qword f)  { __asm__ volatile ("fdivl %0" :: "m"(f)); };
+    void fdiv(dword f)  { __asm__ volatile ("fdivs %0" :: "m"(f)); };
+
+    void fdivr(int st)  { ST_ASM("fdivr", st); };
+    void fdivrp(int st) { ST_ASM("fdivp", st); };
+    void fdivr(qword f) { __asm__ volatile ("fdivrl %0" :: "m"(f)); };
+    void fdivr(dword f) { __asm__ volatile ("fdivrs %0" :: "m"(f)); };
+
+    void fsqrt() { __asm__ volatile ("fsqrt"); };
+
+    void fld(tword f)  { __asm__ volatile ("fldt %0" :: "m"(f)); };
+    void fld(qword f)  { __asm__ volatile ("fldl %0" :: "m"(f)); };
+    void fld(dword f)  { __asm__ volatile ("flds %0" :: "m"(f)); };
+    void fld(int st)   { ST_ASM("fld", st); };
+
+    void fild(int16_t i) { __asm__ volatile ("filds %0" :: "m"(i)); };
+    void fild(int32_t i) { __asm__ volatile ("fildl %0" :: "m"(i)); };
+    void fild(int64_t i) { __asm__ volatile ("fildq %0" :: "m"(i)); };
+
+    void fadd()   { fadd(1);  }
+    void faddp()  { faddp(1); }
+    void fsub()   { fsub(1); }
+    void fsubp()  { fsubp(1); }
+    void fsubr()  { fsubr(1); }
+    void fsubrp() { fsubrp(1); }
+    void fmul()   { fmul(1); }
+    void fmulp()  { fmulp(1); }
+    void fdiv()   { fdiv(1); }
+    void fdivp()  { fdivp(1); }
+    void fdivr()  { fdivr(1); }
+    void fdivrp() { fdivrp(1); }
+
+    tword fstp_t() { tword ret; __asm__ volatile ("fstpt %0" : "=&m"(ret)); return ret; };
+    qword fstp_l() { qword ret; __asm__ volatile ("fstpl %0" : "=&m"(ret)); return ret; };
+    dword fstp_s() { dword ret; __asm__ volatile ("fstps %0" : "=&m"(ret)); return ret; };
+
+    // Loads each value of in with fld/fild, and stores it to out with fstp
+    template<class In, class Out>
+    void convert(const In *in, Out *out, size_t count) {
+        if constexpr (std::is_same<In, tword>::value)
+            BATCH_ASM_STORE("fldt", in, out, count);
+        else if constexpr (std::is_same<In, qword>::value)
+            BATCH_ASM_STORE("fldl", in, out, count);
+        else if constexpr (std::is_same<In, dword>::value)
+            BATCH_ASM_STORE("flds", in, out, count);
+        else if constexpr (std::is_same<In, int16_t>::value)
+            BATCH_ASM_STORE("filds", in, out, count);
+        else if constexpr (std::is_same<In, int32_t>::value)
+            BATCH_ASM_STORE("fildl", in, out, count);
+        else if constexpr (std::is_same<In, int64_t>::value)
+            BATCH_ASM_STORE("fildq", in, out, count);
+        else
+            static_assert(!sizeof(In), "Unsupported input type");
+    }
+
+    void finit() { __asm__ volatile ("fninit"); }
+
+    // ST(0) to ST(7), without changing the fpu state. fnsave reinitializes the fpu, so it's restored right away.
+    std::array<tword, 8> registers() {
+        State state;
+        __asm__ volatile ("fnsave %0\n\tfrstor %0" : "=m"(state));
+
+        std::array<tword, 8> regs;
+        std::copy(state.st, state.st + 8, regs.begin());
+        return regs;
+    }
+
+    uint16_t fstcw() { uint16_t cw; __asm__ volatile ("fstcw %0" : "=&m"(cw)); return cw; }
+    void fldcw(uint16_t cw) {  __asm__ volatile ("fldcw %0" :: "m"(cw)); }
+
+    uint16_t fstsw() { uint16_t sw; __asm__ volatile ("fnstsw %0" : "=&m"(sw)); return sw; }
+    void fclex() { __asm__ volatile ("fnclex"); }
+
+    // Traps now if an earlier instruction raised an unmasked exception, instead of at the next one
+    void fwait() { __asm__ volatile ("fwait"); }
+
+    // fnstenv masks all exceptions after storing, so the control word is loaded back from what it stored
+    Environment fnstenv() {
+        State::Env env;
+        __asm__ volatile ("fnstenv %0\n\tfldcw %0" : "=m"(env));
+        return { env.control, env.status, env.tag };
+    }
+
+    // Reinitializes the fpu, like finit
+    SavedState fsave() {
+        State state;
+        __asm__ volatile ("fnsave %0" : "=m"(state));
+
+        SavedState saved = { { state.env.control, state.env.status, state.env.tag }, {} };
+        std::copy(state.st, state.st + 8, saved.registers.begin());
+        return saved;
+    }
+
+private:
+    // The 32 bit protected mode layout of fnstenv and fnsave
+    struct State {
+        struct Env {
+            uint16_t control, unused0;
+            uint16_t status, unused1;
+            uint16_t tag, unused2;
+            uint32_t pointers[4];
+        } env;
+        tword st[8];
+    };
 };
\ No newline at end of file
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <stdint.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Sleeps while word is still expected, for at most timeout. Works across processes when word is in
+// shared memory. May return early, callers check their condition again.
+inline void wait_while_equal(const std::atomic<uint32_t> &word, uint32_t expected, std::chrono::nanoseconds timeout) {
+    static_assert(sizeof(word) == sizeof(uint32_t) && std::atomic<uint32_t>::is_always_lock_free,
+                  "Futexes need a plain 32 bit word");
+#ifdef __linux__
+    timespec ts = { time_t(timeout.count() / 1'000'000'000), long(timeout.count() % 1'000'000'000) };
+    syscall(SYS_futex, &word, FUTEX_WAIT, expected, &ts, nullptr, 0);
+#else
+    if (word.load(std::memory_order_acquire) == expected)
+        std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(timeout, std::chrono::microseconds(50)));
+#endif
+}
+
+// Wakes everyone sleeping in wait_while_equal on word
+inline void wake_all(std::atomic<uint32_t> &word) {
+#ifdef __linux__
+    syscall(SYS_futex, &word, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+#endif
+}
+
+// A lock-free ring of N slots between one producer and one consumer.
+//
+// Slots are filled and read in place, so large batches are never copied through it: the producer
+// fills producer_slot() and publishes it, the consumer reads consumer_slot() and releases it. The
+// cursors are plain atomics and the slots are stored inline, so a ring placed in shared memory works
+// between processes too. Waiting spins briefly and then sleeps on a futex.
+template<class T, uint32_t N>
+class SpscRing {
+public:
+    static_assert(N && (N & (N - 1)) == 0, "N must be a power of two");
+
+    // The slot to fill next, or null if the ring is full
+    T *producer_slot() {
+        uint32_t head = published.load(std::memory_order_relaxed);
+        return head - released.load(std::memory_order_acquire) == N ? nullptr : &slots[head % N];
+    }
+
+    void publish() {
+        published.store(published.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_seq_cst))
+            wake_all(published);
+    }
+
+    // The oldest published slot, or null if the ring is empty
+    T *consumer_slot() {
+        uint32_t tail = released.load(std::memory_order_relaxed);
+        return published.load(std::memory_order_acquire) == tail ? nullptr : &slots[tail % N];
+    }
+
+    void release() {
+        released.store(released.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_seq_cst))
+            wake_all(released);
+    }
+
+    // The same, but waiting up to timeout for a slot. Null if there still is none.
+    T *wait_producer_slot(std::chrono::nanoseconds timeout) {
+        return wait([this] { return producer_slot(); }, released, timeout);
+    }
+
+    T *wait_consumer_slot(std::chrono::nanoseconds timeout) {
+        return wait([this] { return consumer_slot(); }, published, timeout);
+    }
+
+    // Slots published and released since the ring was created. When one side dies they tell the side
+    // that replaces it where it left off.
+    uint32_t total_published() const { return published.load(std::memory_order_acquire); }
+    uint32_t total_released() const { return released.load(std::memory_order_acquire); }
+
+private:
+    static constexpr int spins = 256;
+
+    // The other side moves cursor to make slot() available
+    template<class Slot>
+    T *wait(Slot slot, const std::atomic<uint32_t> &cursor, std::chrono::nanoseconds timeout) {
+        for (int i = 0; i < spins; i++) {
+            if (T *found = slot())
+                return found;
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (true) {
+            uint32_t seen = cursor.load(std::memory_order_acquire);
+            if (T *found = slot())
+                return found;
+            auto left = deadline - std::chrono::steady_clock::now();
+            if (left <= std::chrono::nanoseconds::zero())
+                return nullptr;
+
+            // Counted before the futex checks cursor again, so a publish or release either sees this
+            // sleeper and wakes it, or happened before the check
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            wait_while_equal(cursor, seen, left);
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    // On their own cache lines, so the two sides don't bounce one between them
+    alignas(64) std::atomic<uint32_t> published{0};
+    alignas(64) std::atomic<uint32_t> released{0};
+    alignas(64) std::atomic<uint32_t> sleepers{0}; // so the sides only make the wake syscall when needed
+    alignas(64) T slots[N];
+};
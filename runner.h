@@ -0,0 +1,859 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <stdio.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <fmt/format.h>
+
+#include "classify.h"
+#include "digest.h"
+#include "golden.h"
+#include "mismatch_log.h"
+#include "pipeline.h"
+#include "plan.h"
+#include "profile.h"
+#include "x87.h"
+
+// The seed a range of test inputs was generated from, or 0 for plain containers
+template<class Range>
+auto range_seed(const Range &range, int) -> decltype(uint64_t(range.seed())) {
+    return range.seed();
+}
+
+template<class Range>
+uint64_t range_seed(const Range &, long) {
+    return 0;
+}
+
+// The values plan asks for instead of range's, for random sequences it can resize and reseed
+template<class Range>
+auto plan_range(const Range &range, const TestPlan &plan, int) -> decltype(range.with(size_t(), uint64_t())) {
+    return range.with(plan.cases(range.size()), plan.seed(range.seed()));
+}
+
+template<class Range>
+const Range &plan_range(const Range &range, const TestPlan &, long) {
+    return range;
+}
+
+// Runs differential tests between two fpu implementations across all cores.
+//
+// Each worker thread owns its own pair of fpus, which is safe because the real x87
+// state is per-thread, and is pinned to its own core. Sequences are split into fixed
+// size shards which are handed out to idle workers, who generate the shard's values
+// themselves and run them through each fpu as a batch. Mismatch reports are buffered per
+// shard and printed in shard order, so the output is identical to a single threaded run.
+// Mismatches are sorted into buckets by likely root cause, and only the first few of each
+// bucket are printed. With a MismatchLog attached, all of them are written to it instead.
+// Every shard times its generate, fpu and compare stages, which add up to a per phase profile.
+// With set_pipeline each worker runs those stages at the same time instead, see Pipeline.
+// fpu_b's results can be recorded to a golden file, and later runs can replay them instead of running it.
+// A TestPlan picks which phases run, and the cases and seeds of their random sequences.
+// With digests one fpu runs alone, and its results per shard are reduced to a Digest, see use_digests.
+// Inputs that trap in an fpu_b that survives it, like forked_x87, have no result to compare or check,
+// they're reported as trapped instead. The status words both fpus leave are compared for a sample of
+// the inputs, see set_status_stride.
+template<class FpuA, class FpuB>
+class Runner {
+public:
+    static constexpr size_t shard_size = 1 << 16;
+
+    // Values per digest block, see use_digests
+    static constexpr size_t digest_block_size = 1 << 10;
+
+    // Blocks per compare whose results are kept when their digests differ, see use_digests
+    static constexpr size_t max_kept_blocks = 16;
+
+    // Values are run through each fpu in batches small enough to stay in L1
+    static constexpr size_t default_batch_size = 1 << 10;
+
+    struct Worker {
+        FpuA fpu_a;
+        FpuB fpu_b;
+        PerfCounters counters; // opened by the worker thread, so they count it
+        std::unique_ptr<Pipeline<FpuA, FpuB>> pipeline; // made on the first pipelined shard
+    };
+
+    struct Output {
+        fmt::memory_buffer text;
+        std::vector<MismatchRecord> mismatches;
+        std::vector<BucketKey> buckets; // bucket of each mismatch
+        uint64_t cases = 0;
+        StageTimes stages;
+        bool counted = false; // stages include hardware counts
+
+        bool recorded = false; // golden holds the shard's fpu_b results, packed against fpu_a's
+        std::vector<uint8_t> golden;
+        uint64_t input_hash = 0;
+        bool stale = false; // the inputs weren't the ones the replayed golden results were recorded for
+
+        bool digested = false; // digest is of the shard's results
+        ShardDigest digest;
+
+        std::vector<std::string> traps; // a line for each input fpu_b trapped on
+        std::vector<std::string> statuses; // a line for each sampled input the fpus left different status words for
+    };
+
+    using Job = std::function<void(Worker&, Output&)>;
+
+    // name_a and name_b label the fpus' stages in the profile
+    explicit Runner(unsigned thread_count = 0, const char *name_a = "fpu a", const char *name_b = "fpu b")
+        : fpu_names{ name_a, name_b }, profile(name_a, name_b) {
+        if (thread_count == 0)
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+        std::vector<int> cpus = allowed_cpus();
+        for (unsigned i = 0; i < thread_count; i++) {
+            threads.emplace_back([this] { worker_loop(); });
+            if (!cpus.empty())
+                pin(threads.back(), cpus[i % cpus.size()]);
+        }
+    }
+
+    ~Runner() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutdown = true;
+        }
+        work_available.notify_all();
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    Runner(const Runner&) = delete;
+    Runner& operator=(const Runner&) = delete;
+
+    unsigned size() const { return threads.size(); }
+
+    // Sends mismatches to log instead of printing them, or back to printing if log is null
+    void log_to(MismatchLog *mismatch_log) {
+        drain();
+        log = mismatch_log;
+    }
+
+    // How many mismatches of each bucket get printed
+    void set_print_limit(uint64_t limit) {
+        drain();
+        print_limit = limit;
+    }
+
+    // Loads cw into both fpus before each of the following jobs
+    void set_control_word(uint16_t cw) {
+        drain();
+        control_word = cw;
+    }
+
+    // Also compares the status words the fpus leave after every nth value of the following compares,
+    // or none if n is 0. The batched kernels don't keep a status word, so those values are run again
+    // one at a time. Compares that replay golden results, pipeline or digest their values don't do it.
+    void set_status_stride(size_t n) {
+        drain();
+        status_every = n;
+    }
+
+    size_t status_stride() const { return status_every; }
+
+    // Values per batch, for the following jobs
+    void set_batch_size(size_t size) {
+        drain();
+        batch_size = std::max<size_t>(size, 1);
+    }
+
+    // With depth > 0 each worker pipelines its shards, with depth batches in flight, for the following
+    // jobs. Its fpus then run on threads of their own, and no hardware counts are taken.
+    void set_pipeline(size_t depth) {
+        drain();
+        pipeline_depth = std::min(depth, Pipeline<FpuA, FpuB>::max_depth);
+    }
+
+    // Records fpu_b's results of the following compares to golden, or stops recording if it's null
+    void record_golden(GoldenWriter *golden) {
+        drain();
+        golden_out = golden;
+    }
+
+    // Takes fpu_b's results from golden instead of running it, from its first section on, or runs
+    // it again if golden is null. Exits if a compare isn't the one its section was recorded from.
+    void replay_golden(const GoldenReader *golden) {
+        drain();
+        golden_in = golden;
+        next_section = 0;
+        if (golden && golden->shard_size() != shard_size)
+            refuse("replay golden results", fmt::format("{} was recorded with shards of {} values, not {}", golden->name(),
+                               golden->shard_size(), shard_size));
+    }
+
+    // Runs only fpu_b, or fpu_a if !of_b, for the following compares, and reduces its results to a
+    // digest per block of digest_block_size values and one per shard of those, instead of comparing
+    // them. The digests are saved to save, and checked against check's if it isn't null. Blocks whose
+    // digests differ are reported, and counted in digests_differing. The results of the first
+    // max_kept_blocks of those in every compare are saved too. Where check has the other run's results
+    // of a differing block, every value that differs is reported. With both null the following
+    // compares run as usual.
+    void use_digests(DigestWriter *save, const DigestReader *check, bool of_b = true) {
+        drain();
+        digests_out = save;
+        digests_in = check;
+        digest_b = of_b;
+        next_digests = 0;
+        if (check && (check->shard_size() != shard_size || check->block_size() != digest_block_size))
+            refuse("check digests", fmt::format("{} has shards of {} values in blocks of {}, not {} in blocks of {}",
+                                                check->name(), check->shard_size(), check->block_size(), shard_size,
+                                                digest_block_size));
+    }
+
+    // How many shards' digests differed from the checked ones so far
+    uint64_t digests_differing() const { return differing_shards; }
+
+    // Runs the following phases as plan says, or all of them as they are if it's null
+    void set_plan(TestPlan *test_plan) {
+        drain();
+        plan = test_plan;
+        skipping = false;
+    }
+
+    // Prints name and starts attributing the following compares to it in the profile. If the plan
+    // leaves the phase out, its compares do nothing instead.
+    void phase(std::string name) {
+        drain();
+        skipping = plan && !plan->begin_phase(name);
+        if (skipping)
+            return;
+        fmt::print("{}...\n", name);
+        current_phase = name;
+        profile.phase(std::move(name));
+    }
+
+    // Prints the mismatch buckets seen so far, most common first, and where the time went to stderr
+    void summary() {
+        drain();
+        buckets.summary(stdout);
+        if (traps)
+            fmt::print("{} inputs trapped in {} instead of giving a result\n", traps, fpu_names[1]);
+        if (status_differences)
+            fmt::print("{} sampled inputs left other status words in {} and {}\n", status_differences, fpu_names[0],
+                       fpu_names[1]);
+        if (differing_shards)
+            fmt::print("{} shards' digests differ from {}\n", differing_shards, digests_in->name());
+        fflush(stdout);
+        profile.summary(stderr);
+    }
+
+    // Runs op(fpu, value) on both fpus for every value in values and reports any differing results.
+    // check(value, result_b) is called on every result from fpu_b, for sanity checking the reference.
+    // values must be random access, each worker generates the values of its own shards.
+    template<class Range, class Op, class Check>
+    void compare(Range&& values, Op op, Check check) {
+        if (!plan) {
+            compare_range(values, 0, values.size(), op, check);
+            return;
+        }
+        auto &&planned = plan_range(values, *plan, 0);
+        compare_range(planned, 0, planned.size(), op, check);
+    }
+
+    template<class Range, class Op>
+    void compare(Range&& values, Op op) {
+        compare(std::forward<Range>(values), op, [] (auto, auto) {});
+    }
+
+    // Same as compare, but only for the values in [begin, end)
+    template<class Range, class Op, class Check>
+    void compare_range(Range&& values, size_t begin, size_t end, Op op, Check check) {
+        if (skipping)
+            return;
+
+        auto start = std::chrono::steady_clock::now();
+        const auto *range = &values;
+        uint64_t seed = range_seed(values, 0);
+        uint64_t mismatches_before = buckets.size();
+        size_t printed_before = mismatches_printed;
+        uint16_t cw = control_word;
+
+        using In = std::decay_t<decltype(values[begin])>;
+        using Out = decltype(op(std::declval<FpuA&>(), std::declval<In>()));
+
+        GoldenSection section = {};
+        section.op = Op::code;
+        section.in_type = type_code<In>();
+        section.out_type = type_code<Out>();
+        section.control_word = cw;
+        section.seed = seed;
+        section.begin = begin;
+        section.end = end;
+        snprintf(section.phase, sizeof(section.phase), "%s", current_phase.c_str());
+
+        if (digests_out || digests_in) {
+            digest_range(values, begin, end, op, check, section);
+            finish_compare(begin, end, start, mismatches_before, printed_before);
+            return;
+        }
+
+        bool recording = golden_out;
+        const GoldenSection *replayed = nullptr;
+        if (recording)
+            golden_out->begin_section(section);
+        if (golden_in) {
+            if (next_section == golden_in->section_count())
+                refuse("replay golden results", fmt::format("{} ends before {}", golden_in->name(), section.describe()));
+            replayed = &golden_in->section(next_section++);
+            if (!replayed->same_run(section))
+                refuse("replay golden results", fmt::format("{} has {} where this run has {}", golden_in->name(), replayed->describe(),
+                                   section.describe()));
+        }
+
+        for (size_t first = begin; first < end; first += shard_size) {
+            size_t last = std::min(end, first + shard_size);
+            const GoldenChunk *chunk = replayed ? golden_in->chunk(*replayed, (first - begin) / shard_size) : nullptr;
+            const uint8_t *chunk_data = chunk ? golden_in->chunk_data(*chunk) : nullptr;
+            if (replayed && !chunk)
+                refuse("replay golden results", fmt::format("{} is missing values of {}", golden_in->name(), section.describe()));
+
+            submit([range, seed, cw, first, last, op, check, batch_size = batch_size, depth = pipeline_depth,
+                    recording, chunk, chunk_data, status_stride = status_every, name_a = fpu_names[0],
+                    name_b = fpu_names[1]] (Worker &w, Output &out) {
+                auto compare_batch = [&] (size_t batch, size_t count, const In *inputs, const Out *results_a,
+                                          const Out *results_b, const std::vector<Trap> &traps) {
+                    auto trap = traps.begin();
+                    for (size_t i = 0; i < count; i++) {
+                        if (trap != traps.end() && trap->index == i) {
+                            out.traps.push_back(describe_trap(inputs[i], name_b, *trap));
+                            ++trap;
+                            continue;
+                        }
+                        if (results_a[i] != results_b[i]) {
+                            out.mismatches.push_back(MismatchRecord::make<Op>(cw, seed, batch + i, inputs[i],
+                                                                              results_a[i], results_b[i]));
+                            out.buckets.push_back(classify<In, Out>(Op::code, inputs[i]));
+                        }
+                        check(inputs[i], results_b[i]);
+                    }
+                };
+
+                if (depth && !recording && !chunk) {
+                    using Batch = typename Pipeline<FpuA, FpuB>::Batch;
+
+                    struct Stages final : Pipeline<FpuA, FpuB>::Stages {
+                        decltype(range) values;
+                        uint16_t cw;
+                        Op op;
+                        decltype(compare_batch) &compare_values;
+
+                        Stages(decltype(range) values, uint16_t cw, Op op, decltype(compare_batch) &compare_values)
+                            : values(values), cw(cw), op(op), compare_values(compare_values) {}
+
+                        void generate(Batch &batch) override {
+                            In *inputs = batch.template values<In>(Batch::inputs);
+                            for (size_t i = 0; i < batch.count; i++)
+                                inputs[i] = (*values)[batch.first + i];
+                        }
+
+                        void run_a(FpuA &fpu, Batch &batch) override {
+                            fpu.fldcw(cw);
+                            execute(fpu, op, batch.template values<In>(Batch::inputs),
+                                    batch.template values<Out>(Batch::results_a), batch.count);
+                        }
+
+                        void run_b(FpuB &fpu, Batch &batch) override {
+                            fpu.fldcw(cw);
+                            const In *inputs = batch.template values<In>(Batch::inputs);
+                            Out *results = batch.template values<Out>(Batch::results_b);
+                            execute_start(fpu, op, inputs, results, batch.count);
+                            batch.traps = execute_finish(fpu, op, inputs, results, batch.count);
+                        }
+
+                        void compare(Batch &batch) override {
+                            compare_values(batch.first, batch.count, batch.template values<In>(Batch::inputs),
+                                           batch.template values<Out>(Batch::results_a),
+                                           batch.template values<Out>(Batch::results_b), batch.traps);
+                        }
+                    };
+
+                    if (!w.pipeline || w.pipeline->depth() != depth || w.pipeline->batch_capacity() != batch_size)
+                        w.pipeline = std::make_unique<Pipeline<FpuA, FpuB>>(depth, batch_size);
+
+                    Stages stages(range, cw, op, compare_batch);
+                    w.pipeline->run(first, last, stages, out.stages);
+                    out.cases = last - first;
+                    return;
+                }
+
+                // A replay never touches fpu_b, its results come from the chunk
+                w.fpu_a.fldcw(cw);
+                if (!chunk)
+                    w.fpu_b.fldcw(cw);
+
+                std::vector<In> inputs(batch_size);
+                std::vector<Out> results_a(batch_size);
+                std::vector<Out> results_b(batch_size);
+
+                // Counters are only read around the middle batch, which is warm but not the short last one
+                StageTimes sampled;
+                StageClock clock(w.counters, out.stages, sampled);
+                size_t sample_batch = first + (last - first) / batch_size / 2 * batch_size;
+                size_t sample_count = std::min(batch_size, last - sample_batch);
+
+                // Golden results are fpu_b's as their difference to fpu_a's, so recording keeps both fpus'
+                // results of the whole shard, and a replay rebuilds fpu_b's from fpu_a's a batch at a time.
+                // Inputs are hashed one at a time, so the hash doesn't depend on the batch size.
+                std::vector<Out> recorded_a, recorded_b;
+                uint64_t input_hash = 0;
+                if (recording) {
+                    recorded_a.reserve(last - first);
+                    recorded_b.reserve(last - first);
+                }
+                DeltaUnpacker replay(chunk_data, chunk ? chunk->size : 0);
+
+                for (size_t batch = first; batch < last; batch += batch_size) {
+                    size_t count = std::min(batch_size, last - batch);
+                    clock.start(batch == sample_batch);
+                    for (size_t i = 0; i < count; i++)
+                        inputs[i] = (*range)[batch + i];
+                    if (recording || chunk) {
+                        for (size_t i = 0; i < count; i++)
+                            input_hash = hash_bytes(&inputs[i], sizeof(In), input_hash);
+                    }
+                    clock.lap(Stage::generate);
+
+                    if (chunk) {
+                        execute(w.fpu_a, op, inputs.data(), results_a.data(), count);
+                        clock.lap(Stage::fpu_a);
+                        out.stale = !replay.unpack(results_a.data(), results_b.data(), count);
+                        clock.lap(Stage::fpu_b);
+                        if (out.stale)
+                            break;
+                        compare_batch(batch, count, inputs.data(), results_a.data(), results_b.data(), {});
+                        clock.lap(Stage::compare);
+                        continue;
+                    }
+
+                    // fpu_b runs alongside fpu_a if it runs batches somewhere else, then its stage is mostly the wait
+                    execute_start(w.fpu_b, op, inputs.data(), results_b.data(), count);
+                    clock.lap(Stage::fpu_b);
+                    execute(w.fpu_a, op, inputs.data(), results_a.data(), count);
+                    clock.lap(Stage::fpu_a);
+                    std::vector<Trap> traps = execute_finish(w.fpu_b, op, inputs.data(), results_b.data(), count);
+                    clock.lap(Stage::fpu_b);
+
+                    compare_batch(batch, count, inputs.data(), results_a.data(), results_b.data(), traps);
+                    if (status_stride) {
+                        for (size_t i = (status_stride - batch % status_stride) % status_stride; i < count; i += status_stride) {
+                            uint16_t status_a, status_b;
+                            if (!status_after(w.fpu_a, op, inputs[i], status_a) || !status_after(w.fpu_b, op, inputs[i], status_b))
+                                break;
+                            status_a &= defined_status;
+                            status_b &= defined_status;
+                            if (status_a != status_b)
+                                out.statuses.push_back(fmt::format("{} left status {:#06x} in {} and {:#06x} in {}",
+                                                                   describe(inputs[i]), status_a, name_a, status_b, name_b));
+                        }
+                    }
+                    clock.lap(Stage::compare);
+
+                    if (recording) {
+                        recorded_a.insert(recorded_a.end(), results_a.begin(), results_a.begin() + count);
+                        recorded_b.insert(recorded_b.end(), results_b.begin(), results_b.begin() + count);
+                    }
+                }
+
+                // Mismatches against results recorded for other inputs, or that didn't unpack, mean nothing
+                if (chunk && (out.stale || input_hash != chunk->input_hash || !replay.finished())) {
+                    out.stale = true;
+                    out.mismatches.clear();
+                    out.buckets.clear();
+                }
+                if (recording) {
+                    out.recorded = true;
+                    out.golden = pack_deltas(recorded_b.data(), recorded_a.data(), recorded_b.size());
+                    out.input_hash = input_hash;
+                }
+
+                out.cases = last - first;
+                out.counted = w.counters.available();
+                for (int i = 0; i < stage_count; i++)
+                    out.stages[i].counts = sampled[i].counts.scaled(double(out.cases) / sample_count);
+            });
+        }
+        drain();
+
+        if (recording)
+            golden_out->end_section();
+        if (golden_stale)
+            refuse("replay golden results", fmt::format("{} was recorded for other inputs than {}, or is corrupt",
+                                                        golden_in->name(), section.describe()));
+
+        finish_compare(begin, end, start, mismatches_before, printed_before);
+    }
+
+    // Queues a job for any idle worker. Anything the job writes to its buffer is
+    // printed in submission order. Blocks while too many jobs are in flight.
+    void submit(Job job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        slot_available.wait(lock, [this] { return submitted - printed < 2 * threads.size(); });
+
+        pending.push_back({submitted++, std::move(job)});
+        lock.unlock();
+        work_available.notify_one();
+    }
+
+    // Waits for all submitted jobs to finish and their output to be printed or logged
+    void drain() {
+        std::unique_lock<std::mutex> lock(mutex);
+        slot_available.wait(lock, [this] { return printed == submitted; });
+    }
+
+private:
+    struct Pending {
+        size_t index;
+        Job job;
+    };
+
+    void worker_loop() {
+        Worker worker;
+
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_available.wait(lock, [this] { return shutdown || !pending.empty(); });
+            if (pending.empty())
+                return;
+
+            Pending p = std::move(pending.front());
+            pending.pop_front();
+            lock.unlock();
+
+            Output out;
+            p.job(worker, out);
+
+            lock.lock();
+            finished.emplace(p.index, std::move(out));
+
+            // Print every consecutive finished job, so output stays in submission order
+            bool progress = false;
+            for (auto next = finished.find(printed); next != finished.end(); next = finished.find(printed)) {
+                Output &output = next->second;
+                fwrite(output.text.data(), 1, output.text.size(), stdout);
+
+                for (size_t i = 0; i < output.mismatches.size(); i++) {
+                    uint64_t seen = buckets.add(output.buckets[i], output.mismatches[i]);
+                    if (!log && seen <= print_limit) {
+                        fmt::print("{}\n", describe(output.mismatches[i]));
+                        mismatches_printed++;
+                    }
+                }
+                if (log)
+                    log->append(std::move(output.mismatches));
+                for (const std::string &trap : output.traps) {
+                    if (compare_traps++ < print_limit)
+                        fmt::print("{}\n", trap);
+                }
+                for (const std::string &status : output.statuses) {
+                    if (compare_statuses++ < print_limit)
+                        fmt::print("{}\n", status);
+                }
+                if (output.recorded)
+                    golden_out->add_chunk(output.input_hash, output.golden);
+                golden_stale |= output.stale;
+                if (output.digested)
+                    shard_digests.push_back(std::move(output.digest));
+                profile.add(output.cases, output.stages, output.counted);
+                finished.erase(next);
+                printed++;
+                progress = true;
+            }
+            if (progress) {
+                fflush(stdout);
+                slot_available.notify_all();
+            }
+        }
+    }
+
+    // Reports what a compare of [begin, end) that started at start found, to the plan and as totals
+    void finish_compare(size_t begin, size_t end, std::chrono::steady_clock::time_point start,
+                        uint64_t mismatches_before, size_t printed_before) {
+        uint64_t mismatches = buckets.size() - mismatches_before;
+        if (plan) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            plan->record(end - begin, elapsed.count(), mismatches);
+        }
+        uint64_t unprinted = mismatches - (mismatches_printed - printed_before);
+        if (log && mismatches)
+            fmt::print("{} mismatches logged to {}\n", mismatches, log->name());
+        else if (unprinted)
+            fmt::print("{} more mismatches not printed\n", unprinted);
+
+        if (compare_traps > print_limit)
+            fmt::print("{} more trapped inputs not printed\n", compare_traps - print_limit);
+        traps += compare_traps;
+        compare_traps = 0;
+
+        if (compare_statuses > print_limit)
+            fmt::print("{} more status word differences not printed\n", compare_statuses - print_limit);
+        status_differences += compare_statuses;
+        compare_statuses = 0;
+    }
+
+    template<class In>
+    static std::string describe_trap(const In &input, const char *fpu, const Trap &trap) {
+        return fmt::format("{} trapped in {}, {}", describe(input), fpu, trap.reason);
+    }
+
+    // compare_range with digests: runs one fpu over values' shards, then reports the blocks whose
+    // digests differ from the checked file's, and the values that differ where it has their results
+    template<class Range, class Op, class Check>
+    void digest_range(const Range &values, size_t begin, size_t end, Op op, Check check, const GoldenSection &key) {
+        using In = std::decay_t<decltype(values[begin])>;
+        using Out = decltype(op(std::declval<FpuA&>(), std::declval<In>()));
+
+        const auto *range = &values;
+        uint16_t cw = key.control_word;
+        bool of_b = digest_b;
+        shard_digests.clear();
+
+        // Looked up first, so the shards know which of their blocks' results to keep
+        const DigestSection *theirs = nullptr;
+        if (digests_in) {
+            if (next_digests == digests_in->section_count())
+                refuse("check digests", fmt::format("{} ends before {}", digests_in->name(), key.describe()));
+            theirs = &digests_in->section(next_digests++);
+            if (!theirs->key.same_run(key))
+                refuse("check digests", fmt::format("{} has {} where this run has {}", digests_in->name(),
+                                                    theirs->key.describe(), key.describe()));
+        }
+
+        for (size_t first = begin; first < end; first += shard_size) {
+            size_t last = std::min(end, first + shard_size);
+            size_t shard = (first - begin) / shard_size;
+            const ShardDigest *other = theirs && shard < theirs->shards.size() ? &theirs->shards[shard] : nullptr;
+
+            submit([range, cw, first, last, op, check, of_b, batch_size = batch_size, name_b = fpu_names[1],
+                    checking = theirs != nullptr, other] (Worker &w, Output &out) {
+                w.fpu_a.fldcw(cw);
+                w.fpu_b.fldcw(cw);
+
+                std::vector<In> inputs(batch_size);
+                std::vector<Out> results(batch_size);
+                StageTimes sampled;
+                StageClock clock(w.counters, out.stages, sampled);
+                size_t sample_batch = first + (last - first) / batch_size / 2 * batch_size;
+                size_t sample_count = std::min(batch_size, last - sample_batch);
+
+                // Values are added one at a time, so the digests don't depend on the batch size. When
+                // checking, the block's results are kept until its digest is known to match.
+                Digest block;
+                std::vector<Out> block_results;
+                for (size_t batch = first; batch < last; batch += batch_size) {
+                    size_t count = std::min(batch_size, last - batch);
+                    clock.start(batch == sample_batch);
+                    for (size_t i = 0; i < count; i++)
+                        inputs[i] = (*range)[batch + i];
+                    clock.lap(Stage::generate);
+
+                    std::vector<Trap> traps;
+                    if (of_b) {
+                        execute_start(w.fpu_b, op, inputs.data(), results.data(), count);
+                        traps = execute_finish(w.fpu_b, op, inputs.data(), results.data(), count);
+                    } else {
+                        execute(w.fpu_a, op, inputs.data(), results.data(), count);
+                    }
+                    clock.lap(of_b ? Stage::fpu_b : Stage::fpu_a);
+
+                    // Trapped inputs are digested with their zero results, the trap happens the same way every run
+                    auto trap = traps.begin();
+                    for (size_t i = 0; i < count; i++) {
+                        block.add(results[i]);
+                        if (checking)
+                            block_results.push_back(results[i]);
+                        if ((batch + i - first + 1) % digest_block_size == 0 || batch + i + 1 == last) {
+                            size_t index = out.digest.blocks.size();
+                            if (checking && !(other && index < other->blocks.size() && other->blocks[index] == block)) {
+                                BlockValues kept = { uint32_t(index), uint32_t(sizeof(Out)), {} };
+                                kept.bits.resize(block_results.size() * sizeof(Out));
+                                memcpy(kept.bits.data(), block_results.data(), kept.bits.size());
+                                out.digest.values.push_back(std::move(kept));
+                            }
+                            out.digest.whole.add(block);
+                            out.digest.blocks.push_back(block);
+                            block = Digest();
+                            block_results.clear();
+                        }
+                        if (trap != traps.end() && trap->index == i) {
+                            out.traps.push_back(describe_trap(inputs[i], name_b, *trap));
+                            ++trap;
+                        } else if (of_b) {
+                            check(inputs[i], results[i]);
+                        }
+                    }
+                    clock.lap(Stage::compare);
+                }
+                out.digested = true;
+                out.cases = last - first;
+                out.counted = w.counters.available();
+                for (int i = 0; i < stage_count; i++)
+                    out.stages[i].counts = sampled[i].counts.scaled(double(out.cases) / sample_count);
+            });
+        }
+        drain();
+
+        // Only the first differing blocks of the compare keep their results, the rest are only reported
+        size_t kept = 0;
+        for (ShardDigest &shard : shard_digests) {
+            shard.values.resize(std::min(shard.values.size(), max_kept_blocks - kept));
+            kept += shard.values.size();
+        }
+
+        DigestSection section = { key, fpu_names[of_b], shard_digests };
+        if (digests_out)
+            digests_out->add(section);
+        if (!theirs)
+            return;
+
+        // Runs of consecutive differing blocks are reported as one range, and the whole shard if only
+        // its own digest differs. Blocks with both runs' results are compared value by value.
+        uint64_t named = 0;
+        bool unnamed = false;
+        for (size_t shard = 0; shard < shard_digests.size(); shard++) {
+            const ShardDigest &ours = shard_digests[shard];
+            const ShardDigest *other = shard < theirs->shards.size() ? &theirs->shards[shard] : nullptr;
+            if (other && other->whole == ours.whole && other->blocks == ours.blocks)
+                continue;
+            differing_shards++;
+
+            size_t shard_first = begin + shard * shard_size;
+            bool reported = false;
+            for (size_t b = 0; b < ours.blocks.size(); b++) {
+                if (other && b < other->blocks.size() && other->blocks[b] == ours.blocks[b])
+                    continue;
+                size_t run = b;
+                while (b + 1 < ours.blocks.size() && !(other && b + 1 < other->blocks.size()
+                                                       && other->blocks[b + 1] == ours.blocks[b + 1]))
+                    b++;
+                size_t first = shard_first + run * digest_block_size;
+                size_t last = std::min(end, shard_first + (b + 1) * digest_block_size);
+                fmt::print("{}'s results of values {} to {} differ from {}'s in {}\n", section.fpu, first, last,
+                           theirs->fpu, digests_in->name());
+                reported = true;
+
+                for (; run <= b; run++) {
+                    const BlockValues *mine = ours.values_of(run);
+                    const BlockValues *others = other ? other->values_of(run) : nullptr;
+                    if (!mine || !others || others->value_size != sizeof(Out) || others->count() != mine->count()) {
+                        unnamed = true;
+                        continue;
+                    }
+                    for (size_t i = 0; i < mine->count(); i++) {
+                        if (memcmp(mine->value(i), others->value(i), sizeof(Out)) == 0)
+                            continue;
+                        size_t index = shard_first + run * digest_block_size + i;
+                        if (named++ < print_limit)
+                            fmt::print("    value {} {}: {} here, {} in {}\n", index, describe(values[index]),
+                                       describe(decode_value<Out>(mine->value(i))),
+                                       describe(decode_value<Out>(others->value(i))), digests_in->name());
+                    }
+                }
+            }
+            if (!reported) {
+                fmt::print("{}'s results of values {} to {} differ from {}'s in {}\n", section.fpu, shard_first,
+                           std::min(end, shard_first + shard_size), theirs->fpu, digests_in->name());
+                unnamed = true;
+            }
+        }
+        if (named > print_limit)
+            fmt::print("{} more differing values not printed\n", named - print_limit);
+        if (unnamed && digests_out && kept)
+            fmt::print("results of {} differing blocks saved to {}, checking it in the other run names the values "
+                       "that differ\n", kept, digests_out->name());
+        else if (unnamed)
+            fmt::print("saving this run's digests and checking them in the other run names the values that differ\n");
+    }
+
+    // Golden results or digests that don't belong to this run would make everything after them meaningless
+    [[noreturn]] static void refuse(const char *what, const std::string &reason) {
+        fflush(stdout);
+        fmt::print(stderr, "refusing to {}: {}\n", what, reason);
+        exit(1);
+    }
+
+    static std::vector<int> allowed_cpus() {
+        std::vector<int> cpus;
+#ifdef __linux__
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &set))
+                    cpus.push_back(cpu);
+            }
+        }
+#endif
+        return cpus;
+    }
+
+    static void pin(std::thread &thread, int cpu) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+    }
+
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::condition_variable slot_available;
+    std::deque<Pending> pending;
+    std::map<size_t, Output> finished;
+    size_t submitted = 0;
+    size_t printed = 0;
+    bool shutdown = false;
+
+    MismatchLog *log = nullptr;
+    const char *fpu_names[2];
+    MismatchBuckets buckets;
+    uint64_t print_limit = 10;
+    uint16_t control_word = default_control_word;
+    size_t batch_size = default_batch_size;
+    size_t pipeline_depth = 0;
+    uint64_t mismatches_printed = 0;
+    uint64_t compare_traps = 0; // inputs fpu_b trapped on in the current compare
+    uint64_t traps = 0;         // and in the ones before
+    size_t status_every = 0;
+    uint64_t compare_statuses = 0;   // sampled inputs whose status words differ in the current compare
+    uint64_t status_differences = 0; // and in the ones before
+    std::string current_phase;
+
+    DigestWriter *digests_out = nullptr;
+    const DigestReader *digests_in = nullptr;
+    bool digest_b = true;
+    size_t next_digests = 0;
+    std::vector<ShardDigest> shard_digests; // of the current compare, in order
+    uint64_t differing_shards = 0;
+
+    TestPlan *plan = nullptr;
+    bool skipping = false; // the current phase isn't part of the plan
+
+    GoldenWriter *golden_out = nullptr;
+    const GoldenReader *golden_in = nullptr;
+    size_t next_section = 0;
+    bool golden_stale = false;
+    Profile profile;
+};
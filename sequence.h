@@ -1,118 +1,283 @@
 #pragma once
 
-#include <functional>
-#include <optional>
-#include <random>
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <stdint.h>
+#include <type_traits>
 
-// Iterates over a sequence defined by a generator
+// Counter based random number generator.
+// Every output is a keyed hash of (seed, index, lane), so any element of a sequence
+// can be generated directly, without generating all the elements before it.
+// The mixing function is the SplitMix64 finalizer.
+struct CounterRng {
+    CounterRng(uint64_t seed) : key(mix(seed + golden_gamma)) {}
+
+    uint64_t operator()(uint64_t index, uint64_t lane) const {
+        return mix(mix(key + index * golden_gamma) ^ ((lane + 1) * lane_gamma));
+    }
+
+    static constexpr uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }
+
+private:
+    static constexpr uint64_t golden_gamma = 0x9e3779b97f4a7c15;
+    static constexpr uint64_t lane_gamma = 0xd1b54a32d192ed03;
+
+    uint64_t key;
+};
+
+// Fills a value of T with random bits, using lanes [first_lane, first_lane + words)
 template<class T>
+T random_value(const CounterRng &rng, uint64_t index, uint64_t first_lane = 0) {
+    T result;
+    size_t remaining_bytes = sizeof(result);
+    char *data = reinterpret_cast<char*>(&result);
+
+    for (uint64_t lane = first_lane; remaining_bytes > 0; lane++) {
+        uint64_t num = rng(index, lane);
+        size_t count = std::min(remaining_bytes, sizeof(num));
+        std::memcpy(data, &num, count);
+        remaining_bytes -= count;
+        data += count;
+    }
+    return result;
+}
+
+// Iterates over a random access sequence. Elements are made on the fly, so dereferencing returns
+// them by value.
+template<class T, class Seq>
 struct sequenceIterator {
-    using iterator_category = std::input_iterator_tag;
+    using iterator_category = std::random_access_iterator_tag;
     using value_type = T;
-    using difference_type = void;
-    using pointer = T*;
-    using reference = T&;
+    using difference_type = ptrdiff_t;
+    using pointer = const T*;
+    using reference = T;
 
     sequenceIterator() {}
-    sequenceIterator(std::function<std::optional<T>()> gen) : generator(gen), current(gen()) { }
-    T operator*() const { return *current; }
-    T* operator->() const { return current.operator->(); }
+    sequenceIterator(const Seq *seq, size_t index) : seq(seq), index(index) { }
+    T operator*() const { return (*seq)[index]; }
+    T operator[](difference_type n) const { return (*seq)[index + n]; }
+
     sequenceIterator& operator++() {
-        current = generator();
+        index++;
         return *this;
     }
+    sequenceIterator operator++(int) {
+        sequenceIterator ret = *this;
+        index++;
+        return ret;
+    }
+    sequenceIterator& operator--() {
+        index--;
+        return *this;
+    }
+    sequenceIterator operator--(int) {
+        sequenceIterator ret = *this;
+        index--;
+        return ret;
+    }
+
+    sequenceIterator& operator+=(difference_type n) {
+        index += n;
+        return *this;
+    }
+    sequenceIterator& operator-=(difference_type n) {
+        index -= n;
+        return *this;
+    }
+    friend sequenceIterator operator+(sequenceIterator it, difference_type n) { return it += n; }
+    friend sequenceIterator operator+(difference_type n, sequenceIterator it) { return it += n; }
+    friend sequenceIterator operator-(sequenceIterator it, difference_type n) { return it -= n; }
+    friend difference_type operator-(sequenceIterator const& lhs, sequenceIterator const& rhs) {
+        return difference_type(lhs.index - rhs.index);
+    }
+
     friend bool operator==(sequenceIterator const& lhs, sequenceIterator const& rhs) {
-        return lhs.current == rhs.current;
+        return lhs.index == rhs.index;
     }
     friend bool operator!=(sequenceIterator const& lhs, sequenceIterator const& rhs) {
         return !(lhs==rhs);
     }
-
-    struct postinc_return {
-        postinc_return(T value) : value(value) {}
-        T operator*() { return value; }
-    private:
-        T value;
-    };
-    postinc_return operator++(int) {
-        postinc_return ret(*this);
-        ++this;
-        return ret;
-    }
+    friend bool operator<(sequenceIterator const& lhs, sequenceIterator const& rhs) { return lhs.index < rhs.index; }
+    friend bool operator>(sequenceIterator const& lhs, sequenceIterator const& rhs) { return rhs < lhs; }
+    friend bool operator<=(sequenceIterator const& lhs, sequenceIterator const& rhs) { return !(rhs < lhs); }
+    friend bool operator>=(sequenceIterator const& lhs, sequenceIterator const& rhs) { return !(lhs < rhs); }
 
 protected:
-    std::optional<T> current;
-    std::function<std::optional<T>()> generator;
+    const Seq *seq = nullptr;
+    size_t index = 0;
 };
 
-template<class T, size_t length>
-struct Sequence {
-    sequenceIterator<T> begin() {
-        auto inner_generator = generator;
-        size_t count = 0;
+// Sequences are built from generators composed into a pipeline, for example:
+//
+//     auto happy_floats = uniform<dword>() | filter(is_happy) | transform(negate) | take(4'000'000);
+//
+// A generator is a small copyable function object with a
+//     value_type operator()(uint64_t index, uint64_t &lane) const
+// which produces element index, consuming rng lanes starting at lane, and a
+//     uint64_t seed() const
+// which reports the seed the values came from. Every stage is a template on the stage
+// before it, so the compiler can inline the whole chain into the consumer loop. Random
+// generators also have a
+//     reseeded(uint64_t seed) const
+// which returns the same chain drawing from another seed, so test plans can pick seeds.
+
+// Uniformly random bits
+template<class T>
+struct Uniform {
+    using value_type = T;
 
-        auto boundedGenerator = [inner_generator,count] () mutable -> std::optional<T> {
-            if (count++ < length) {
-                return inner_generator();
-            }
-            return std::nullopt;
-        };
+    // How many rng lanes each value consumes
+    static constexpr uint64_t lanes = (sizeof(T) + 7) / 8;
 
-        return sequenceIterator<T>(boundedGenerator);
+    CounterRng rng;
+    uint64_t rng_seed;
+
+    T operator()(uint64_t index, uint64_t &lane) const {
+        T value = random_value<T>(rng, index, lane);
+        lane += lanes;
+        return value;
     }
 
-    sequenceIterator<T> end() {
-        return sequenceIterator<T>();
+    uint64_t seed() const { return rng_seed; }
+
+    Uniform reseeded(uint64_t seed) const { return {CounterRng(seed), seed}; }
+};
+
+// Rejected values are redrawn from the next lanes of the same index,
+// so filtering doesn't depend on any other element.
+template<class Source, class Filter>
+struct Filtered {
+    using value_type = typename Source::value_type;
+
+    Source source;
+    Filter filter;
+
+    value_type operator()(uint64_t index, uint64_t &lane) const {
+        while (true) {
+            value_type value = source(index, lane);
+            if (filter(value))
+                return value;
+        }
     }
 
-protected:
-    std::function<T()> generator;
+    uint64_t seed() const { return source.seed(); }
+
+    template<class S = Source>
+    auto reseeded(uint64_t seed) const -> Filtered<decltype(std::declval<const S&>().reseeded(seed)), Filter> {
+        return {source.reseeded(seed), filter};
+    }
 };
 
-template<class T, size_t length, uint64_t seed=0>
-struct UniformSequence : public Sequence<T, length> {
-    UniformSequence() {
-        std::mt19937_64 rng;
-        rng.seed(seed);
-
-        this->generator = [rng] () mutable -> T {
-            T result;
-            ssize_t remaining_bytes = sizeof(result);
-            char *data = reinterpret_cast<char*>(&result);
-
-            while (remaining_bytes > 0) {
-                uint64_t num = rng();
-                std::memcpy(data, &num, std::min<ssize_t>(remaining_bytes, sizeof(num)));
-                remaining_bytes -= sizeof(num);
-                data += sizeof(num);
-            }
-            return result;
-        };
+template<class Source, class Transformation>
+struct Transformed {
+    using value_type = std::decay_t<std::invoke_result_t<Transformation, typename Source::value_type>>;
+
+    Source source;
+    Transformation transformation;
+
+    value_type operator()(uint64_t index, uint64_t &lane) const {
+        return transformation(source(index, lane));
+    }
+
+    uint64_t seed() const { return source.seed(); }
+
+    template<class S = Source>
+    auto reseeded(uint64_t seed) const -> Transformed<decltype(std::declval<const S&>().reseeded(seed)), Transformation> {
+        return {source.reseeded(seed), transformation};
     }
 };
 
-template<class T, size_t length, uint64_t seed=0>
-struct FilteredSequence : public UniformSequence<T, length, seed> {
-    FilteredSequence(std::function<bool(T)> filter) : UniformSequence<T, length, seed>() {
-        auto original_generator = this->generator;
+// A finite, random access sequence. Element i only depends on i, so any sub-range [i, j)
+// can be produced on its own and will have identical values.
+template<class Source>
+struct Sequence {
+    using value_type = typename Source::value_type;
+    using iterator = sequenceIterator<value_type, Sequence>;
+
+    Source source;
+    size_t length;
 
-        this->generator = [original_generator, filter] () -> T {
-            while (true) {
-                T value = original_generator();
-                if (filter(value))
-                    return value;
-            }
-        };
+    value_type operator[](size_t index) const {
+        uint64_t lane = 0;
+        return source(index, lane);
+    }
+    size_t size() const { return length; }
+    uint64_t seed() const { return source.seed(); }
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, length); }
+
+    // length values of the same kind, drawn from seed. Only for random sequences.
+    template<class S = Source>
+    auto with(size_t new_length, uint64_t new_seed) const -> Sequence<decltype(std::declval<const S&>().reseeded(new_seed))> {
+        return {source.reseeded(new_seed), new_length};
     }
 };
 
-template<class T, size_t length, uint64_t seed=0>
-struct TransformedSequence : public UniformSequence<T, length, seed> {
-    TransformedSequence(std::function<T(T)> transformation) : UniformSequence<T, length, seed>() {
-        auto original_generator = this->generator;
+template<class T>
+Uniform<T> uniform(uint64_t seed = 0) {
+    return Uniform<T>{CounterRng(seed), seed};
+}
 
-        this->generator = [original_generator, transformation] () -> T {
-            return transformation(original_generator());
-        };
+template<class Filter>
+struct filter_stage { Filter filter; };
+
+template<class Filter>
+filter_stage<Filter> filter(Filter f) {
+    return {f};
+}
+
+template<class Transformation>
+struct transform_stage { Transformation transformation; };
+
+template<class Transformation>
+transform_stage<Transformation> transform(Transformation t) {
+    return {t};
+}
+
+struct take_stage { size_t length; };
+
+inline take_stage take(size_t length) {
+    return {length};
+}
+
+template<class Source, class Filter>
+Filtered<Source, Filter> operator|(Source source, filter_stage<Filter> stage) {
+    return {source, stage.filter};
+}
+
+template<class Source, class Transformation>
+Transformed<Source, Transformation> operator|(Source source, transform_stage<Transformation> stage) {
+    return {source, stage.transformation};
+}
+
+template<class Source>
+Sequence<Source> operator|(Source source, take_stage stage) {
+    return {source, stage.length};
+}
+
+// Every bit pattern of T, in order. Only for small types, and not for use with filter.
+template<class T>
+struct Exhaustive {
+    using value_type = T;
+
+    static_assert(sizeof(T) <= 4, "Too many values to enumerate");
+
+    T operator()(uint64_t index, uint64_t &) const {
+        T value;
+        std::memcpy(reinterpret_cast<char*>(&value), &index, sizeof(value));
+        return value;
     }
+
+    uint64_t seed() const { return 0; }
 };
+
+template<class T>
+Sequence<Exhaustive<T>> exhaustive() {
+    return {Exhaustive<T>(), size_t(1) << (sizeof(T) * 8)};
+}
@@ -0,0 +1,155 @@
+// Microbenchmark comparing the template composed generator pipeline in sequence.h
+// against the std::function based sequence classes it replaced.
+
+#include <chrono>
+#include <functional>
+#include <optional>
+
+#include <fmt/format.h>
+
+#include "float_types.h"
+#include "sequence.h"
+
+// The std::function based sequences, kept here as the baseline.
+namespace legacy {
+
+template<class T>
+struct sequenceIterator {
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = void;
+    using pointer = T*;
+    using reference = T&;
+
+    sequenceIterator() {}
+    sequenceIterator(std::function<std::optional<T>()> gen) : current(gen()), generator(gen) { }
+    T operator*() const { return *current; }
+    sequenceIterator& operator++() {
+        current = generator();
+        return *this;
+    }
+    friend bool operator==(sequenceIterator const& lhs, sequenceIterator const& rhs) {
+        return lhs.current == rhs.current;
+    }
+    friend bool operator!=(sequenceIterator const& lhs, sequenceIterator const& rhs) {
+        return !(lhs==rhs);
+    }
+
+protected:
+    std::optional<T> current;
+    std::function<std::optional<T>()> generator;
+};
+
+template<class T, size_t length>
+struct Sequence {
+    sequenceIterator<T> begin() {
+        auto inner_generator = generator;
+        size_t count = 0;
+
+        auto boundedGenerator = [inner_generator,count] () mutable -> std::optional<T> {
+            if (count < length) {
+                return inner_generator(count++);
+            }
+            return std::nullopt;
+        };
+
+        return sequenceIterator<T>(boundedGenerator);
+    }
+
+    sequenceIterator<T> end() {
+        return sequenceIterator<T>();
+    }
+
+protected:
+    std::function<T(uint64_t)> generator;
+};
+
+template<class T, size_t length, uint64_t seed=0>
+struct UniformSequence : public Sequence<T, length> {
+    UniformSequence() {
+        CounterRng rng(seed);
+
+        this->generator = [rng] (uint64_t index) -> T {
+            return random_value<T>(rng, index);
+        };
+    }
+
+    static constexpr uint64_t lanes = (sizeof(T) + 7) / 8;
+};
+
+template<class T, size_t length, uint64_t seed=0>
+struct FilteredSequence : public UniformSequence<T, length, seed> {
+    FilteredSequence(std::function<bool(T)> filter) : UniformSequence<T, length, seed>() {
+        CounterRng rng(seed);
+
+        this->generator = [rng, filter] (uint64_t index) -> T {
+            for (uint64_t lane = 0; ; lane += UniformSequence<T, length, seed>::lanes) {
+                T value = random_value<T>(rng, index, lane);
+                if (filter(value))
+                    return value;
+            }
+        };
+    }
+};
+
+template<class T, size_t length, uint64_t seed=0>
+struct TransformedSequence : public UniformSequence<T, length, seed> {
+    TransformedSequence(std::function<T(T)> transformation) : UniformSequence<T, length, seed>() {
+        auto original_generator = this->generator;
+
+        this->generator = [original_generator, transformation] (uint64_t index) -> T {
+            return transformation(original_generator(index));
+        };
+    }
+};
+
+} // namespace legacy
+
+constexpr size_t length = 10'000'000;
+
+// Consumes every value of a sequence, returning ns per value
+template<class Seq>
+double consume(Seq &&seq, uint64_t &checksum) {
+    auto start = std::chrono::steady_clock::now();
+    for (auto val : seq) {
+        uint64_t bits = 0;
+        memcpy(&bits, &val, std::min(sizeof(val), sizeof(bits)));
+        checksum += bits;
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / length;
+}
+
+template<class Legacy, class Pipeline>
+void compare(const char *name, Legacy &&legacy, Pipeline &&pipeline) {
+    uint64_t legacy_sum = 0;
+    uint64_t pipeline_sum = 0;
+    double legacy_ns = consume(legacy, legacy_sum);
+    double pipeline_ns = consume(pipeline, pipeline_sum);
+
+    fmt::print("{:<24} {:>8.2f} ns {:>8.2f} ns {:>7.2f}x{}\n", name, legacy_ns, pipeline_ns,
+               legacy_ns / pipeline_ns, legacy_sum == pipeline_sum ? "" : " (values differ!)");
+}
+
+int main() {
+    auto is_happy = [] (dword f) { return f.exponent != dword::exponent_max && f.exponent != 0; };
+    auto make_nan = [] (tword f) { f.exponent = tword::exponent_max; return f; };
+
+    fmt::print("{:<24} {:>11} {:>11} {:>8}\n", "sequence", "legacy", "pipeline", "speedup");
+
+    compare("uniform dword",
+            legacy::UniformSequence<dword, length>(),
+            uniform<dword>() | take(length));
+
+    compare("uniform tword",
+            legacy::UniformSequence<tword, length>(),
+            uniform<tword>() | take(length));
+
+    compare("filtered dword",
+            legacy::FilteredSequence<dword, length>(is_happy),
+            uniform<dword>() | filter(is_happy) | take(length));
+
+    compare("transformed tword",
+            legacy::TransformedSequence<tword, length>(make_nan),
+            uniform<tword>() | transform(make_nan) | take(length));
+}
@@ -1,63 +1,472 @@
 #include "soft_x87.h"
 
+#include <algorithm>
+#include <array>
+#include <cstdlib>
 
-void soft_x87::add(tword& a, tword &b, bool subtract) {
-    subtract = subtract ^ (a.sign ^ b.sign);
+namespace {
 
-    int diff = a.exponent - b.exponent;
+// dwords and qwords are handled as plain integers, their bitfields compile to masked loads and stores
+template<class T>
+uint64_t to_bits(T f) {
+    uint64_t bits = 0;
+    memcpy(&bits, reinterpret_cast<const char*>(&f), sizeof(f));
+    return bits;
+}
+
+template<class T>
+T from_bits(uint64_t sign, uint64_t exponent, uint64_t significand) {
+    uint64_t bits = (sign << (T::bits - 1)) | (exponent << T::significand_width) | significand;
+    T f;
+    memcpy(reinterpret_cast<char*>(&f), &bits, sizeof(f));
+    return f;
+}
+
+constexpr uint64_t integer_bit = tword::interger_bit_mask;
+constexpr uint64_t quiet_bit = 0x4000'0000'0000'0000;
+
+using uint128_t = unsigned __int128;
 
-    uint64_t bigger_sig = a.significand;
-    uint64_t smaller_sig = b.significand;
-    int exponent = a.exponent;
-    uint64_t sign = a.sign;
+// Zeros, denormals and normals, everything the arithmetic handles on its fast path
+template<class Reg>
+bool is_finite(const Reg &r) {
+    return r.exponent != tword::exponent_max && (r.exponent == 0 || (r.significand & integer_bit));
+}
+
+// Encodings x87 refuses to compute with since the 387: unnormals, pseudo-NaNs and pseudo-infinities
+template<class Reg>
+bool is_unsupported(const Reg &r) {
+    return r.exponent != 0 && !(r.significand & integer_bit);
+}
+
+template<class Reg>
+bool is_nan(const Reg &r) {
+    return r.exponent == tword::exponent_max && r.significand != integer_bit;
+}
+
+template<class Reg>
+bool is_signaling(const Reg &r) {
+    return is_nan(r) && !(r.significand & quiet_bit);
+}
 
-    // Swap if b is bigger than a;
-    if (diff < 0) {
-        diff = -diff;
-        bigger_sig = b.significand;
-        smaller_sig = a.significand;
-        exponent = b.exponent;
-        sign = b.sign;
+// Status::denormal if either operand is a denormal. Memory operands were normalized when they were
+// widened, so they carry the flag instead. Registers on the stack carry no flags.
+template<class Reg>
+uint8_t denormal_flags(const Reg &a, const Reg &b) {
+    bool denormal = (a.exponent == 0 && a.significand != 0) | (b.exponent == 0 && b.significand != 0);
+    return a.flags | b.flags | (denormal ? Status::denormal : 0);
+}
+
+// Whether the magnitude of a result gets rounded up, from the bits below its last one. half is the
+// value of rest that is exactly half an ulp.
+template<Rounding R>
+bool round_up(unsigned sign, bool odd, uint64_t rest, uint64_t half) {
+    if constexpr (R == Rounding::nearest)
+        return rest > half || (rest == half && odd);
+    else if constexpr (R == Rounding::up)
+        return rest && !sign;
+    else if constexpr (R == Rounding::down)
+        return rest && sign;
+    else
+        return false;
+}
+
+// Results too large for the format become infinity, unless rounding goes the other way
+template<Rounding R>
+bool overflows_to_infinity(unsigned sign) {
+    return R == Rounding::nearest || (R == Rounding::up && !sign) || (R == Rounding::down && sign);
+}
+
+int clz128(uint128_t x) {
+    uint64_t high = x >> 64;
+    return high ? __builtin_clzll(high) : 64 + __builtin_clzll(uint64_t(x));
+}
+
+// Seed of the reciprocal iteration, 11 bits of 2^19 / d for the top 9 bits of d
+constexpr std::array<uint16_t, 256> reciprocal_table = [] {
+    std::array<uint16_t, 256> table = {};
+    for (int i = 0; i < 256; i++)
+        table[i] = 0x7fd00 / (256 + i);
+    return table;
+}();
+
+constexpr uint64_t isqrt64(uint64_t x) {
+    uint64_t root = 0;
+    for (uint64_t bit = 1ull << 62; bit; bit >>= 2) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
     }
+    return root;
+}
 
-    uint64_t smaller_sig_shifted = smaller_sig >> diff;
+// Seed of the reciprocal square root iteration, 2^16 / sqrt(x) for x in [1, 4) with 8 fraction bits,
+// taken at the middle of each interval
+constexpr std::array<uint16_t, 768> rsqrt_table = [] {
+    std::array<uint16_t, 768> table = {};
+    for (int i = 0; i < 768; i++)
+        table[i] = isqrt64((1ull << 41) / (2 * (256 + i) + 1));
+    return table;
+}();
+
+// floor((2^128 - 1) / d) - 2^64 for a normalized d, from a table seed and three Newton iterations.
+// See Möller and Granlund, "Improved division by invariant integers", algorithm 2.
+__attribute__((always_inline)) inline uint64_t reciprocal(uint64_t d) {
+    uint64_t d0 = d & 1;
+    uint64_t d9 = d >> 55;
+    uint64_t d40 = (d >> 24) + 1;
+    uint64_t d63 = (d >> 1) + d0;
+    uint64_t v0 = reciprocal_table[d9 - 256];
+    uint64_t v1 = (v0 << 11) - ((v0 * v0 * d40) >> 40) - 1;
+    uint64_t v2 = (v1 << 13) + ((v1 * ((1ull << 60) - v1 * d40)) >> 47);
+    uint64_t e = ((v2 >> 1) & (0 - d0)) - v2 * d63;
+    uint64_t v3 = (v2 << 31) + (uint64_t((uint128_t(v2) * e) >> 64) >> 1);
+    uint128_t p = uint128_t(v3) * d + d;
+    return v3 - uint64_t(p >> 64) - d;
+}
 
-    uint64_t significand;
-    if (subtract) {
-        significand = bigger_sig - smaller_sig_shifted;
-        if (significand == 0) {
-            exponent = 0;
+// Divides high:low by a normalized d with its reciprocal v, high must be below d.
+// Algorithm 4 of the same paper, the estimate is off by at most two.
+__attribute__((always_inline)) inline uint64_t divide(uint64_t high, uint64_t low, uint64_t d, uint64_t v, uint64_t &remainder) {
+    uint128_t q = uint128_t(v) * high + ((uint128_t(high) << 64) | low);
+    uint64_t q1 = uint64_t(q >> 64) + 1;
+    uint64_t r = low - q1 * d;
+    if (r > uint64_t(q)) {
+        q1--;
+        r += d;
+    }
+    if (r >= d) {
+        q1++;
+        r -= d;
+    }
+    remainder = r;
+    return q1;
+}
+
+// floor(sqrt(x)) for x in [2^126, 2^128). Two coupled Goldschmidt iterations from the table seed get
+// about 38 bits of both sqrt(x) and 1/(2 sqrt(x)), the two halves of each step don't depend on each
+// other. Then one Newton step on the root itself gets within one of the result, which the exact
+// remainder corrects.
+__attribute__((always_inline)) inline uint64_t square_root(uint128_t x, uint128_t &remainder) {
+    uint64_t high = x >> 64;
+    uint64_t y = uint64_t(rsqrt_table[(high >> 54) - 256]) << 47; // 1/sqrt(high / 2^62), 63 fraction bits
+    uint64_t g = (uint128_t(high) * y) >> 63;                      // sqrt(high / 2^62), 62 fraction bits
+    int64_t h = y >> 1;                                             // 1/(2 sqrt(high / 2^62)), 63 fraction bits
+    for (int i = 0; i < 2; i++) {
+        int64_t r = (1ll << 62) - int64_t((uint128_t(g) * uint64_t(h)) >> 62); // 1/2 - g h
+        g += int64_t((__int128(g) * r) >> 63);
+        h += int64_t((__int128(h) * r) >> 63);
+    }
+
+    uint64_t root = g >> 63 ? ~0ull : g << 1;
+    __int128 residual = __int128(x - uint128_t(root) * root);
+    root += int64_t((__int128(int64_t(residual >> 32)) * h) >> 94);
+
+    uint128_t square = uint128_t(root) * root;
+    while (square > x) {
+        root--;
+        square = uint128_t(root) * root;
+    }
+    while (x - square > 2 * uint128_t(root)) {
+        root++;
+        square = uint128_t(root) * root;
+    }
+    remainder = x - square;
+    return root;
+}
+
+} // namespace
+
+// Rounds an exact result in mode R to the top Precision bits of the significand. significand holds the
+// top 64 bits, normalized unless the result is zero, and rest the bits below it. exponent is biased and
+// may be out of range, results below the normal range are denormalized first so they only get rounded
+// once, at the same bit as normal results. The result's flags are flags plus what rounding raised,
+// tininess is detected before rounding.
+template<Rounding R, int Precision>
+__attribute__((always_inline)) inline soft_x87::reg soft_x87::round(unsigned sign, int exponent, uint64_t significand,
+                                                                    uint64_t rest, uint8_t flags) {
+    bool tiny = exponent <= 0;
+    if (tiny) {
+        int shift = 1 - exponent;
+        uint64_t sticky = rest != 0;
+        if (shift < 64) {
+            rest = significand << (64 - shift);
+            significand >>= shift;
+        } else if (shift == 64) {
+            rest = significand;
+            significand = 0;
         } else {
-            int msb = __builtin_clz(significand);
-            int shift = std::min(msb, exponent); // Clamp to zero
-            significand <<= shift;
-            exponent -= shift;
+            rest = significand != 0;
+            significand = 0;
         }
-        // TODO: sign.
+        rest |= sticky;
+        exponent = 0;
+    }
+
+    // Bits below the precision join the rest, the kept ones are rounded at the bottom of significand
+    constexpr int dropped = 64 - Precision;
+    if constexpr (dropped > 0) {
+        rest = (significand << Precision) | (rest != 0);
+        significand >>= dropped;
+    }
+
+    uint8_t inexact = rest != 0 ? Status::precision : 0;
+    flags |= tiny ? inexact | (inexact ? Status::underflow : 0) : inexact;
+
+    constexpr uint64_t top = 1ull << (Precision - 1);
+    bool up = round_up<R>(sign, significand & 1, rest, 1ull << 63);
+    flags |= up ? rounded_up : 0;
+    if (up) {
+        significand++;
+        if (significand == top << 1) {
+            significand = top;
+            exponent++;
+        } else if (exponent == 0 && (significand & top)) {
+            exponent = 1; // rounded up out of the denormals
+        }
+    }
+
+    if (exponent >= tword::exponent_max) {
+        flags |= Status::overflow | Status::precision;
+        if (overflows_to_infinity<R>(sign))
+            return { integer_bit, tword::exponent_max, uint16_t(sign), uint8_t(flags | rounded_up) };
+        // The largest finite value
+        return { ~0ull << dropped, tword::exponent_max - 1, uint16_t(sign), uint8_t(flags & ~rounded_up) };
+    }
+    return { significand << dropped, uint16_t(exponent), uint16_t(sign), flags };
+}
+
+// The invalid operation result, the negative QNaN x87 calls real indefinite
+soft_x87::reg soft_x87::indefinite() {
+    return { integer_bit | quiet_bit, tword::exponent_max, 1, Status::invalid };
+}
+
+// Result when either operand is a NaN or unsupported. Unsupported ones are invalid, otherwise a
+// quiet NaN beats a signaling one, then the larger significand wins, then the positive one.
+// Signaling NaNs are invalid too, but still propagate.
+soft_x87::reg soft_x87::propagate_nan(const reg &a, const reg &b) {
+    if (is_unsupported(a) || is_unsupported(b))
+        return indefinite();
+
+    reg result = b;
+    if (is_nan(a) && is_nan(b)) {
+        bool a_quiet = a.significand & quiet_bit;
+        bool b_quiet = b.significand & quiet_bit;
+        if (a_quiet != b_quiet)
+            result = a_quiet ? a : b;
+        else if (a.significand != b.significand)
+            result = a.significand > b.significand ? a : b;
+        else
+            result = a.sign ? b : a;
+    } else if (is_nan(a)) {
+        result = a;
+    }
+    result.significand |= quiet_bit;
+    result.flags = is_signaling(a) || is_signaling(b) ? Status::invalid : 0;
+    return result;
+}
+
+template<Rounding R, int Precision>
+soft_x87::reg soft_x87::add(const reg &a, const reg &b, bool subtract) {
+    unsigned b_sign = b.sign ^ subtract;
+
+    if (!is_finite(a) || !is_finite(b)) {
+        if (is_nan(a) || is_nan(b) || is_unsupported(a) || is_unsupported(b))
+            return propagate_nan(a, b);
+        bool a_infinite = a.exponent == tword::exponent_max;
+        bool b_infinite = b.exponent == tword::exponent_max;
+        if (a_infinite && b_infinite && a.sign != b_sign)
+            return indefinite(); // inf - inf
+        return { integer_bit, tword::exponent_max, uint16_t(a_infinite ? a.sign : b_sign), denormal_flags(a, b) };
+    }
+
+    // Zeros of different signs, and exact cancellation below, sum to +0 except when rounding down
+    if (a.significand == 0 && b.significand == 0)
+        return { 0, 0, uint16_t(R == Rounding::down ? a.sign | b_sign : a.sign & b_sign), 0 };
+    uint8_t flags = denormal_flags(a, b);
+
+    // Denormals have the same exponent as the smallest normals, without the integer bit
+    int a_exponent = std::max<int>(a.exponent, 1);
+    int b_exponent = std::max<int>(b.exponent, 1);
+
+    // Order by magnitude, so the difference is never negative
+    bool swap = a_exponent < b_exponent || (a_exponent == b_exponent && a.significand < b.significand);
+    uint64_t bigger_sig = swap ? b.significand : a.significand;
+    uint64_t smaller_sig = swap ? a.significand : b.significand;
+    int exponent = swap ? b_exponent : a_exponent;
+    unsigned sign = swap ? b_sign : a.sign;
+    int diff = std::abs(a_exponent - b_exponent);
+
+    // Align in 128 bits. Anything shifted out of the bottom only matters as a sticky bit, and when
+    // it does the difference is at least 2, so subtraction can't cancel far enough to expose it.
+    // The shifts are split into 64 bit halves, variable 128 bit shifts are slow.
+    uint128_t bigger = uint128_t(bigger_sig) << 64;
+    uint128_t smaller;
+    if (diff < 64) {
+        uint64_t low = diff ? smaller_sig << (64 - diff) : 0;
+        smaller = (uint128_t(smaller_sig >> diff) << 64) | low;
+    } else if (diff < 128) {
+        uint64_t low = diff > 64 ? smaller_sig >> (diff - 64) : smaller_sig;
+        smaller = low | ((smaller_sig & ((1ull << (diff - 64)) - 1)) != 0);
+    } else {
+        smaller = smaller_sig != 0;
+    }
+
+    uint128_t sum;
+    if (a.sign != b_sign) {
+        sum = bigger - smaller;
+        if (sum == 0)
+            return { 0, 0, uint16_t(R == Rounding::down), flags };
     } else {
-        bool overflow = __builtin_add_overflow(bigger_sig, smaller_sig_shifted, &significand);
-        if (overflow) {
-            significand = (significand >> 1) | 0x8000000000000000;
+        sum = bigger + smaller;
+        if (sum < bigger) {
+            sum = (sum >> 1) | (sum & 1) | (uint128_t(1) << 127);
             exponent++;
         }
     }
 
-    tword &result = ST(0);
-    result.significand = significand;
-    result.exponent = exponent;
-    result.sign = sign;
+    int shift = clz128(sum);
+    sum <<= shift;
+    return round<R, Precision>(sign, exponent - shift, uint64_t(sum >> 64), uint64_t(sum), flags);
+}
+
+template<Rounding R, int Precision>
+soft_x87::reg soft_x87::mul(const reg &a, const reg &b) {
+    unsigned sign = a.sign ^ b.sign;
+
+    if (!is_finite(a) || !is_finite(b)) {
+        if (is_nan(a) || is_nan(b) || is_unsupported(a) || is_unsupported(b))
+            return propagate_nan(a, b);
+        if (a.significand == 0 || b.significand == 0)
+            return indefinite(); // 0 * inf
+        return { integer_bit, tword::exponent_max, uint16_t(sign), denormal_flags(a, b) };
+    }
+
+    uint8_t flags = denormal_flags(a, b);
+    if (a.significand == 0 || b.significand == 0)
+        return { 0, 0, uint16_t(sign), flags };
+
+    // Normalize denormal operands, their exponents go below the normal range
+    int a_shift = __builtin_clzll(a.significand);
+    int b_shift = __builtin_clzll(b.significand);
+    int a_exponent = std::max<int>(a.exponent, 1) - a_shift;
+    int b_exponent = std::max<int>(b.exponent, 1) - b_shift;
+
+    // Both significands are in [2^63, 2^64), so the exact product is in [2^126, 2^128)
+    uint128_t product = uint128_t(a.significand << a_shift) * (b.significand << b_shift);
+    int exponent = a_exponent + b_exponent - tword::exponent_bias + 1;
+    if (!(product >> 127)) {
+        product <<= 1;
+        exponent--;
+    }
+    return round<R, Precision>(sign, exponent, uint64_t(product >> 64), uint64_t(product), flags);
+}
+
+template<Rounding R, int Precision>
+soft_x87::reg soft_x87::div(const reg &a, const reg &b) {
+    unsigned sign = a.sign ^ b.sign;
+
+    if (!is_finite(a) || !is_finite(b)) {
+        if (is_nan(a) || is_nan(b) || is_unsupported(a) || is_unsupported(b))
+            return propagate_nan(a, b);
+        bool a_infinite = a.exponent == tword::exponent_max;
+        if (a_infinite && b.exponent == tword::exponent_max)
+            return indefinite(); // inf / inf
+        if (a_infinite)
+            return { integer_bit, tword::exponent_max, uint16_t(sign), denormal_flags(a, b) };
+        return { 0, 0, uint16_t(sign), denormal_flags(a, b) };
+    }
+
+    if (b.significand == 0) {
+        if (a.significand == 0)
+            return indefinite(); // 0 / 0
+        return { integer_bit, tword::exponent_max, uint16_t(sign), Status::zero_divide };
+    }
+    uint8_t flags = denormal_flags(a, b);
+    if (a.significand == 0)
+        return { 0, 0, uint16_t(sign), flags };
+
+    int a_shift = __builtin_clzll(a.significand);
+    int b_shift = __builtin_clzll(b.significand);
+    uint64_t a_significand = a.significand << a_shift;
+    uint64_t b_significand = b.significand << b_shift;
+    int exponent = (std::max<int>(a.exponent, 1) - a_shift) - (std::max<int>(b.exponent, 1) - b_shift)
+                 + tword::exponent_bias;
+
+    // The quotient of a * 2^64 / b is in [2^63, 2^64) when a < b, otherwise a is halved to keep it there
+    bool smaller = a_significand < b_significand;
+    uint64_t high = smaller ? a_significand : a_significand >> 1;
+    uint64_t low = smaller ? 0 : a_significand << 63;
+    exponent -= smaller;
+
+    uint64_t remainder;
+    uint64_t quotient = divide(high, low, b_significand, reciprocal(b_significand), remainder);
+
+    // Only how the remainder compares to half of b matters for rounding. It can't be exactly half,
+    // b would have to be a multiple of a 65 bit odd number.
+    uint64_t rest = remainder > b_significand - remainder ? (1ull << 63) | 1 : remainder != 0;
+    return round<R, Precision>(sign, exponent, quotient, rest, flags);
+}
+
+template<Rounding R, int Precision>
+soft_x87::reg soft_x87::sqrt(const reg &a) {
+    if (!is_finite(a)) {
+        if (is_nan(a) || is_unsupported(a))
+            return propagate_nan(a, a);
+        return a.sign ? indefinite() : a; // sqrt(-inf) is invalid
+    }
+    if (a.significand == 0)
+        return a; // sqrt(-0) is -0
+    if (a.sign)
+        return indefinite();
+
+    uint8_t flags = denormal_flags(a, a);
+    int shift = __builtin_clzll(a.significand);
+    int exponent = std::max<int>(a.exponent, 1) - shift - tword::exponent_bias;
+
+    // An odd exponent moves a factor of two into the significand, so the root's exponent is exact
+    int odd = exponent & 1;
+    uint128_t x = uint128_t(a.significand << shift) << (63 + odd);
+    uint128_t remainder;
+    uint64_t root = square_root(x, remainder);
+
+    // The root is never exactly halfway, that would make x a square plus a quarter
+    uint64_t rest = remainder > root ? (1ull << 63) | 1 : remainder != 0;
+    return round<R, Precision>(0, (exponent - odd) / 2 + tword::exponent_bias, root, rest, flags);
 }
 
 template<class T>
-tword soft_x87::expand(T f) {
+soft_x87::reg soft_x87::operand(T f) {
+    reg r = expand(f);
+    uint64_t bits = to_bits(f);
+    uint64_t fraction = bits & T::significand_max;
+    bool nan = ((bits >> T::significand_width) & T::exponent_max) == T::exponent_max && fraction;
+    if (nan && !(fraction >> (T::significand_width - 1)))
+        r.significand &= ~quiet_bit;
+    return r;
+}
+
+template<class B, class Kernel>
+void soft_x87::arithmetic(const Operands<B> *in, tword *out, size_t count, Kernel kernel) {
+    for (size_t i = 0; i < count; i++)
+        out[i] = kernel(reg::unpack(in[i].a), operand(in[i].b)).pack();
+}
+
+template<class T>
+soft_x87::reg soft_x87::expand(T f) {
     static_assert(std::is_same<T, qword>::value || std::is_same<T, dword>::value, "Unsupported type");
 
-    tword expanded;
-    expanded.sign = f.sign;
+    uint64_t bits = to_bits(f);
+
+    reg expanded = {};
+    expanded.sign = bits >> (T::bits - 1);
 
     int shift = 63 - f.significand_width;
-    uint64_t significand = f.significand;
-    int exponent = f.exponent;
+    uint64_t significand = bits & T::significand_max;
+    int exponent = (bits >> T::significand_width) & T::exponent_max;
 
     int exponent_max = (1 << f.exponent_width) - 1;
     if (exponent == exponent_max) {
@@ -66,6 +475,8 @@ tword soft_x87::expand(T f) {
             expanded.significand = 0x8000'0000'0000'0000;
         else
             expanded.significand = (significand << shift) | 0xc000'0000'0000'0000;
+        if (significand && !(significand >> (T::significand_width - 1)))
+            expanded.flags = Status::invalid; // a signaling NaN
         //expanded.significand &= ~0x4000000000000000; // Suppress signaling NaNs.
         return expanded;
     }
@@ -78,7 +489,7 @@ tword soft_x87::expand(T f) {
         }
 
         // convert denormal
-        // TODO: Does x87 actually convert denormals?
+        expanded.flags = Status::denormal;
         uint64_t mask = 1ULL << (f.significand_width);
         while ((significand & mask) == 0) {
             // Shift significand until interger bit is set
@@ -100,54 +511,64 @@ tword soft_x87::expand(T f) {
     return expanded;
 }
 
-template<class T>
-T soft_x87::compress(tword f) {
+template<class T, Rounding R>
+T soft_x87::compress(reg f, uint8_t &flags) {
     static_assert(std::is_same<T, qword>::value || std::is_same<T, dword>::value, "Unsupported type");
 
-    T compressed;
-    compressed.sign = f.sign;
+    uint64_t sign = f.sign;
+    flags = 0;
+
+    // Unsupported encodings are invalid, and store the indefinite NaN
+    if (is_unsupported(f)) {
+        flags = Status::invalid;
+        return from_bits<T>(1, T::exponent_max, 1ull << (T::significand_width - 1));
+    }
 
     uint64_t significand = f.significand & ~tword::interger_bit_mask;
     int shift = 63 - T::significand_width;
 
 
     // Handle pre-existing infinity
-    int exponent_max = (1 << compressed.exponent_width) - 1;
+    int exponent_max = (1 << T::exponent_width) - 1;
     if (f.exponent == tword::exponent_max && f.significand == 0) {
-        compressed.significand = 0;
-        compressed.exponent = exponent_max;
-        return compressed;
+        return from_bits<T>(sign, exponent_max, 0);
     }
 
     // Handle NAN
     if (f.exponent == tword::exponent_max) {
-        compressed.exponent = exponent_max;
         if (significand) {
+            if (is_signaling(f))
+                flags = Status::invalid;
             significand |= 0x4000'0000'0000'0000; // Force to be quiet
-            compressed.significand = significand >> shift;
+            return from_bits<T>(sign, exponent_max, significand >> shift);
         }
-        return compressed;
+        return from_bits<T>(sign, exponent_max, 0);
     }
 
-    int compressed_zero_offset = (1 << (compressed.exponent_width -1)) - 1;
+    int compressed_zero_offset = (1 << (T::exponent_width -1)) - 1;
     int zero_offset = (1 << (15 -1)) - 1;
 
     int exponent = (f.exponent - zero_offset) + compressed_zero_offset;
 
-    // Overflow to infinity
+    // Overflow to infinity, or the largest finite value when rounding the other way
     if (exponent >= exponent_max) {
-        compressed.significand = 0;
-        compressed.exponent = exponent_max;
-        return compressed;
+        flags = Status::overflow | Status::precision;
+        if (overflows_to_infinity<R>(sign)) {
+            flags |= rounded_up;
+            return from_bits<T>(sign, exponent_max, 0);
+        }
+        return from_bits<T>(sign, exponent_max - 1, T::significand_max);
     }
 
     // Underflow
     if (exponent <= 0) {
         if (exponent < -T::significand_width) {
-            // Too big for denormal, underflow to zero
-            compressed.significand = 0;
-            compressed.exponent = 0;
-            return compressed;
+            // Too small for a denormal, below half the smallest one. Zero unless rounding away from it.
+            if (f.significand == 0)
+                return from_bits<T>(sign, 0, 0);
+            bool up = round_up<R>(sign, false, 1, 1ull << 63);
+            flags = Status::precision | Status::underflow | (up ? rounded_up : 0);
+            return from_bits<T>(sign, 0, up);
         }
 
         // denormalize
@@ -167,6 +588,7 @@ T soft_x87::compress(tword f) {
 
     }
 
+    uint64_t unrounded = significand;
     uint64_t rounding;
     uint64_t rounding_point_five;
     if (shift == 64) {
@@ -180,28 +602,40 @@ T soft_x87::compress(tword f) {
         significand = significand >> shift;
     }
 
+    if (rounding)
+        flags = exponent == 0 ? Status::precision | Status::underflow : Status::precision;
+
     bool odd = (significand & 1) == 1;
-    if (rounding > rounding_point_five || (rounding == rounding_point_five && odd)) {
+    if (round_up<R>(sign, odd, rounding, rounding_point_five)) {
+        flags |= rounded_up;
         significand += 1;
 
         if (significand > T::significand_max) {
             exponent += 1;
             significand = 0;
+            // Tininess is decided after rounding to T's full precision, which keeps one more bit than the
+            // denormal did. Only if that rounds up to the smallest normal too did the value not underflow.
+            if (exponent == 1) {
+                int normal_shift = shift - 1;
+                bool carries = (unrounded >> normal_shift) == (~0ull >> normal_shift)
+                            && round_up<R>(sign, true, unrounded & ((1ull << normal_shift) - 1), 1ull << (normal_shift - 1));
+                if (carries)
+                    flags &= ~Status::underflow;
+            }
+            if (exponent == exponent_max)
+                flags |= Status::overflow;
         }
     }
 
-    compressed.significand = significand;
-    compressed.exponent = exponent;
-
-    return compressed;
+    return from_bits<T>(sign, exponent, significand);
 }
 
-tword soft_x87::convert(int64_t i) {
+soft_x87::reg soft_x87::convert(int64_t i) {
     if (i == 0) {
-        return {0, 0, 0};
+        return {0, 0, 0, 0};
     }
 
-    tword result;
+    reg result = {};
 
     result.sign = i < 0;
     uint64_t absolute = result.sign ? -i : i;
@@ -212,8 +646,100 @@ tword soft_x87::convert(int64_t i) {
     return result;
 }
 
-template tword soft_x87::expand(dword);
-template tword soft_x87::expand(qword);
+template<Rounding R, int Precision, class B>
+constexpr soft_x87::Kernels::Batches<B> soft_x87::make_batches() {
+    return {
+        [] (const Operands<B> *in, tword *out, size_t count) {
+            arithmetic(in, out, count, [] (const reg &a, const reg &b) { return add<R, Precision>(a, b, false); });
+        },
+        [] (const Operands<B> *in, tword *out, size_t count) {
+            arithmetic(in, out, count, [] (const reg &a, const reg &b) { return add<R, Precision>(a, b, true); });
+        },
+        [] (const Operands<B> *in, tword *out, size_t count) {
+            arithmetic(in, out, count, [] (const reg &a, const reg &b) { return add<R, Precision>(b, a, true); });
+        },
+        [] (const Operands<B> *in, tword *out, size_t count) {
+            arithmetic(in, out, count, [] (const reg &a, const reg &b) { return mul<R, Precision>(a, b); });
+        },
+        [] (const Operands<B> *in, tword *out, size_t count) {
+            arithmetic(in, out, count, [] (const reg &a, const reg &b) { return div<R, Precision>(a, b); });
+        },
+        [] (const Operands<B> *in, tword *out, size_t count) {
+            arithmetic(in, out, count, [] (const reg &a, const reg &b) { return div<R, Precision>(b, a); });
+        },
+    };
+}
+
+// Precision control doesn't apply to stores, they round to the format stored
+template<Rounding R, class T>
+void soft_x87::compress_batch(const tword *in, T *out, size_t count) {
+    if constexpr (R == Rounding::nearest) {
+        compress(in, out, count);
+    } else {
+        uint8_t flags;
+        for (size_t i = 0; i < count; i++)
+            out[i] = compress<T, R>(reg::unpack(in[i]), flags);
+    }
+}
+
+template<Rounding R, int Precision>
+constexpr soft_x87::Kernels soft_x87::make_kernels() {
+    return {
+        add<R, Precision>,
+        mul<R, Precision>,
+        div<R, Precision>,
+        sqrt<R, Precision>,
+        compress<qword, R>,
+        compress<dword, R>,
+        make_batches<R, Precision, dword>(),
+        make_batches<R, Precision, qword>(),
+        make_batches<R, Precision, tword>(),
+        [] (const tword *in, tword *out, size_t count) {
+            for (size_t i = 0; i < count; i++)
+                out[i] = sqrt<R, Precision>(reg::unpack(in[i])).pack();
+        },
+        compress_batch<R, qword>,
+        compress_batch<R, dword>,
+    };
+}
+
+template<Rounding R>
+constexpr std::array<soft_x87::Kernels, 4> soft_x87::make_kernels_for() {
+    // Indexed by the precision control field
+    return { make_kernels<R, 24>(), make_kernels<R, 64>(), make_kernels<R, 53>(), make_kernels<R, 64>() };
+}
+
+uint16_t soft_x87::tag_word() const {
+    uint16_t tags = 0;
+    for (int i = 0; i < 8; i++) {
+        const reg &r = stack[i];
+        Tag tag = Tag::valid;
+        if (r.flags == empty_tag)
+            tag = Tag::empty;
+        else if (r.exponent == 0 && r.significand == 0)
+            tag = Tag::zero;
+        else if (!is_finite(r) || r.exponent == 0)
+            tag = Tag::special;
+        tags |= uint16_t(tag) << (2 * i);
+    }
+    return tags;
+}
+
+const soft_x87::Kernels &soft_x87::kernels(uint16_t cw) {
+    static constexpr std::array<std::array<Kernels, 4>, 4> table = {
+        make_kernels_for<Rounding::nearest>(),
+        make_kernels_for<Rounding::down>(),
+        make_kernels_for<Rounding::up>(),
+        make_kernels_for<Rounding::zero>(),
+    };
+    return table[(cw >> 10) & 3][(cw >> 8) & 3];
+}
+
+template soft_x87::reg soft_x87::expand(dword);
+template soft_x87::reg soft_x87::expand(qword);
+
+template dword soft_x87::compress(reg, uint8_t&);
+template qword soft_x87::compress(reg, uint8_t&);
 
-template dword soft_x87::compress(tword);
-template qword soft_x87::compress(tword);
\ No newline at end of file
+template soft_x87::reg soft_x87::operand(dword);
+template soft_x87::reg soft_x87::operand(qword);
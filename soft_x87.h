@@ -1,46 +1,321 @@
 #pragma once
 
+#include <array>
+
+#include <stdint.h>
+#include <string.h>
+
 #include "x87.h"
 
-class soft_x87 : public x87 {
+class soft_x87 : public x87_base<soft_x87> {
 private:
-    std::array<tword, 8> stack;
+    // Working format of the stack registers. It holds the same bits as a tword, but unpacked into
+    // aligned fields, so the arithmetic doesn't pay for a masked unaligned access on every field.
+    // Registers are only packed into the 80bit memory layout by fld and fstp of twords.
+    struct alignas(16) reg {
+        uint64_t significand;
+        uint16_t exponent; // 15 bits
+        uint16_t sign;     // 0 or 1
+
+        // What computing the value raised: exception flags of the status word, and rounded_up for C1.
+        // It lives in the padding, so results carry it for free. Registers on the stack have 0, or
+        // empty_tag if they are empty.
+        uint8_t flags;
+
+        static reg unpack(const tword &f) {
+            uint16_t sign_exponent;
+            reg r;
+            r.flags = 0;
+            memcpy(&r.significand, reinterpret_cast<const char*>(&f), 8);
+            memcpy(&sign_exponent, reinterpret_cast<const char*>(&f) + 8, 2);
+            r.exponent = sign_exponent & tword::exponent_max;
+            r.sign = sign_exponent >> 15;
+            return r;
+        }
+
+        tword pack() const {
+            tword f;
+            uint16_t sign_exponent = (sign << 15) | exponent;
+            memcpy(reinterpret_cast<char*>(&f), &significand, 8);
+            memcpy(reinterpret_cast<char*>(&f) + 8, &sign_exponent, 2);
+            return f;
+        }
+    };
+
+    // Stands in for C1 in flags, the bit is error summary in the real status word
+    static constexpr uint8_t rounded_up = 0x80;
+
+    // The flags of an empty register. Keeping it in the register rather than in a tag word means
+    // checking it doesn't make every instruction depend on the last one through memory.
+    static constexpr uint8_t empty_tag = 0xff;
+    static constexpr reg empty_register = { 0, 0, 0, empty_tag };
+
+    std::array<reg, 8> stack = { empty_register, empty_register, empty_register, empty_register,
+                                 empty_register, empty_register, empty_register, empty_register };
     int top = 0;
 
-    tword& ST(int i) { return stack[(top + i) & 7]; }
-    tword POP() { tword val = stack[top]; top = (top + 1) & 7; return val; }
-    void PUSH() { top = (top - 1) & 7; }
+    // The exception and stack fault flags raised since the last fclex, and the flags of the last
+    // instruction alone, for C1. The rest of the status word and the tag word are only put together
+    // when they are read.
+    uint8_t status = 0;
+    uint8_t last_flags = 0;
+
+    reg& ST(int i) { return stack[(top + i) & 7]; }
+    reg POP() { reg val = stack[top]; DROP(); return val; }
+    void DROP() { stack[top].flags = empty_tag; top = (top + 1) & 7; } // POP without copying the register out
+
+    bool is_empty(int i) const { return stack[(top + i) & 7].flags != 0; }
+    bool either_empty(int i, int j) const { return (stack[(top + i) & 7].flags | stack[(top + j) & 7].flags) != 0; }
+
+    // Exceptions are sticky, C1 only describes the last instruction
+    void raise(uint8_t flags) { status |= flags; last_flags = flags; }
+
+    // Stores the result of an instruction
+    void set(int i, reg r) { raise(r.flags); r.flags = 0; ST(i) = r; }
+
+    // Pushes a register. On a stack overflow the new ST(0) gets the indefinite NaN instead, as
+    // the masked response, and false is returned.
+    bool push() {
+        top = (top - 1) & 7;
+        if (!is_empty(0)) {
+            set(0, indefinite());
+            raise(Status::invalid | Status::stack_fault | rounded_up);
+            return false;
+        }
+        return true; // the caller sets ST(0), which marks it full
+    }
+
+    // Reading an empty register is a stack underflow, masked the destination gets the indefinite NaN
+    void underflow(int i) {
+        set(i, indefinite());
+        raise(Status::invalid | Status::stack_fault);
+    }
 
     template<class T>
-    tword expand(T f); // Expands 32bit/64 bit floats to 80bit
+    static reg expand(T f); // Expands 32bit/64 bit floats to 80bit
+
+    template<class T, Rounding R = Rounding::nearest>
+    static T compress(reg f, uint8_t &flags); // Compresses 80bit floats to 32bit/64bit
+
+    static reg convert(int64_t i); // Converts signed ints to 80bit float
 
+    // Memory operands of arithmetic. Unlike expand, signaling NaNs stay signaling, because
+    // which NaN an instruction returns depends on it. Denormals are normalized by widening, so
+    // their flags say they were one.
     template<class T>
-    T compress(tword f); // Compresses 80bit floats to 32bit/64bit
+    static reg operand(T f);
+    static reg operand(tword f) { return reg::unpack(f); }
+
+    // The arithmetic, rounded in mode R to the top Precision bits of the significand. Division and square
+    // root use table seeded Newton iterations in integers, then correct the result with the exact remainder.
+    template<Rounding R, int Precision>
+    static reg add(const reg &a, const reg &b, bool subtract);
+    template<Rounding R, int Precision>
+    static reg mul(const reg &a, const reg &b);
+    template<Rounding R, int Precision>
+    static reg div(const reg &a, const reg &b);
+    template<Rounding R, int Precision>
+    static reg sqrt(const reg &a);
+
+    template<Rounding R, int Precision>
+    static reg round(unsigned sign, int exponent, uint64_t significand, uint64_t rest, uint8_t flags);
+    static reg indefinite();
+    static reg propagate_nan(const reg &a, const reg &b);
+
+    // Batched instruction, see the public overloads below
+    template<class B, class Kernel>
+    static void arithmetic(const Operands<B> *in, tword *out, size_t count, Kernel kernel);
 
-    tword convert(int64_t i); // Converts signed ints to 80bit float
+    // The kernels of one rounding and precision control setting. fldcw points mode at the matching
+    // table, so instructions run code specialized for the setting without checking the control word.
+    struct Kernels {
+        template<class B>
+        struct Batches {
+            void (*add)(const Operands<B> *in, tword *out, size_t count);
+            void (*sub)(const Operands<B> *in, tword *out, size_t count);
+            void (*subr)(const Operands<B> *in, tword *out, size_t count);
+            void (*mul)(const Operands<B> *in, tword *out, size_t count);
+            void (*div)(const Operands<B> *in, tword *out, size_t count);
+            void (*divr)(const Operands<B> *in, tword *out, size_t count);
+        };
 
-    void add(tword& a, tword &b, bool subtract = false);
+        reg (*add)(const reg &a, const reg &b, bool subtract);
+        reg (*mul)(const reg &a, const reg &b);
+        reg (*div)(const reg &a, const reg &b);
+        reg (*sqrt)(const reg &a);
+        qword (*compress_l)(reg f, uint8_t &flags);
+        dword (*compress_s)(reg f, uint8_t &flags);
+
+        Batches<dword> m32;
+        Batches<qword> m64;
+        Batches<tword> st;
+        void (*sqrt_batch)(const tword *in, tword *out, size_t count);
+        void (*compress_l_batch)(const tword *in, qword *out, size_t count);
+        void (*compress_s_batch)(const tword *in, dword *out, size_t count);
+    };
+
+    template<Rounding R, int Precision, class B>
+    static constexpr Kernels::Batches<B> make_batches();
+    template<Rounding R, class T>
+    static void compress_batch(const tword *in, T *out, size_t count);
+    template<Rounding R, int Precision>
+    static constexpr Kernels make_kernels();
+    template<Rounding R>
+    static constexpr std::array<Kernels, 4> make_kernels_for();
+    static const Kernels &kernels(uint16_t cw);
+
+    template<class B>
+    const Kernels::Batches<B> &batches() const {
+        if constexpr (std::is_same<B, dword>::value)
+            return mode->m32;
+        else if constexpr (std::is_same<B, qword>::value)
+            return mode->m64;
+        else
+            return mode->st;
+    }
+
+    const Kernels *mode = &kernels(default_control_word);
+    uint16_t control = default_control_word;
 
 public:
-    virtual void fadd(int st) { add(ST(0), ST(st)); }
-    virtual void faddp(int st) { tword &a = ST(st); tword b = POP(); add(a, b); }
-    virtual void fadd(tword b) { add(ST(0), b); }
-    virtual void fadd(qword f) { tword b = expand(f); add(ST(0), b); }
-    virtual void fadd(dword f) { tword b = expand(f); add(ST(0), b); }
-
-    virtual void fld(tword f)  { PUSH(); ST(0) = f; };
-    virtual void fld(qword f)  { PUSH(); ST(0) = expand(f); };
-    virtual void fld(dword f)  { PUSH(); ST(0) = expand(f);  };
-    virtual void fld(int st)   { PUSH(); ST(0) = ST(st); };
-
-    virtual void fild(int16_t i) { PUSH(); ST(0) = convert(int64_t(i)); };
-    virtual void fild(int32_t i) { PUSH(); ST(0) = convert(int64_t(i)); };
-    virtual void fild(int64_t i) { PUSH(); ST(0) = convert(int64_t(i)); };
-
-    void fadd()  { fadd(1);  }
-    void faddp() { faddp(1); }
-
-    virtual tword fstp_t() { return POP(); };
-    virtual qword fstp_l() { return compress<qword>(POP()); };
-    virtual dword fstp_s() { return compress<dword>(POP()); };
+    void fadd(int st)   { if (either_empty(0, st)) underflow(0); else set(0, mode->add(ST(0), ST(st), false)); }
+    void faddp(int st)  { if (either_empty(0, st)) underflow(st); else set(st, mode->add(ST(st), ST(0), false)); DROP(); }
+    void fadd(tword f)  { if (is_empty(0)) underflow(0); else set(0, mode->add(ST(0), operand(f), false)); }
+    void fadd(qword f)  { if (is_empty(0)) underflow(0); else set(0, mode->add(ST(0), operand(f), false)); }
+    void fadd(dword f)  { if (is_empty(0)) underflow(0); else set(0, mode->add(ST(0), operand(f), false)); }
+
+    void fsub(int st)   { if (either_empty(0, st)) underflow(0); else set(0, mode->add(ST(0), ST(st), true)); }
+    void fsubp(int st)  { if (either_empty(0, st)) underflow(st); else set(st, mode->add(ST(st), ST(0), true)); DROP(); }
+    void fsub(qword f)  { if (is_empty(0)) underflow(0); else set(0, mode->add(ST(0), operand(f), true)); }
+    void fsub(dword f)  { if (is_empty(0)) underflow(0); else set(0, mode->add(ST(0), operand(f), true)); }
+
+    void fsubr(int st)  { if (either_empty(0, st)) underflow(0); else set(0, mode->add(ST(st), ST(0), true)); }
+    void fsubrp(int st) { if (either_empty(0, st)) underflow(st); else set(st, mode->add(ST(0), ST(st), true)); DROP(); }
+    void fsubr(qword f) { if (is_empty(0)) underflow(0); else set(0, mode->add(operand(f), ST(0), true)); }
+    void fsubr(dword f) { if (is_empty(0)) underflow(0); else set(0, mode->add(operand(f), ST(0), true)); }
+
+    void fmul(int st)   { if (either_empty(0, st)) underflow(0); else set(0, mode->mul(ST(0), ST(st))); }
+    void fmulp(int st)  { if (either_empty(0, st)) underflow(st); else set(st, mode->mul(ST(st), ST(0))); DROP(); }
+    void fmul(qword f)  { if (is_empty(0)) underflow(0); else set(0, mode->mul(ST(0), operand(f))); }
+    void fmul(dword f)  { if (is_empty(0)) underflow(0); else set(0, mode->mul(ST(0), operand(f))); }
+
+    void fdiv(int st)   { if (either_empty(0, st)) underflow(0); else set(0, mode->div(ST(0), ST(st))); }
+    void fdivp(int st)  { if (either_empty(0, st)) underflow(st); else set(st, mode->div(ST(st), ST(0))); DROP(); }
+    void fdiv(qword f)  { if (is_empty(0)) underflow(0); else set(0, mode->div(ST(0), operand(f))); }
+    void fdiv(dword f)  { if (is_empty(0)) underflow(0); else set(0, mode->div(ST(0), operand(f))); }
+
+    void fdivr(int st)  { if (either_empty(0, st)) underflow(0); else set(0, mode->div(ST(st), ST(0))); }
+    void fdivrp(int st) { if (either_empty(0, st)) underflow(st); else set(st, mode->div(ST(0), ST(st))); DROP(); }
+    void fdivr(qword f) { if (is_empty(0)) underflow(0); else set(0, mode->div(operand(f), ST(0))); }
+    void fdivr(dword f) { if (is_empty(0)) underflow(0); else set(0, mode->div(operand(f), ST(0))); }
+
+    void fsqrt() { if (is_empty(0)) underflow(0); else set(0, mode->sqrt(ST(0))); }
+
+    void fld(tword f)  { if (push()) set(0, reg::unpack(f)); };
+    void fld(qword f)  { if (push()) set(0, expand(f)); };
+    void fld(dword f)  { if (push()) set(0, expand(f)); };
+    void fld(int st)   { reg r = ST(st); bool was_empty = is_empty(st); if (push()) { if (was_empty) underflow(0); else set(0, r); } };
+
+    void fild(int16_t i) { if (push()) set(0, convert(int64_t(i))); };
+    void fild(int32_t i) { if (push()) set(0, convert(int64_t(i))); };
+    void fild(int64_t i) { if (push()) set(0, convert(int64_t(i))); };
+
+    void fadd()   { fadd(1);  }
+    void faddp()  { faddp(1); }
+    void fsub()   { fsub(1); }
+    void fsubp()  { fsubp(1); }
+    void fsubr()  { fsubr(1); }
+    void fsubrp() { fsubrp(1); }
+    void fmul()   { fmul(1); }
+    void fmulp()  { fmulp(1); }
+    void fdiv()   { fdiv(1); }
+    void fdivp()  { fdivp(1); }
+    void fdivr()  { fdivr(1); }
+    void fdivrp() { fdivrp(1); }
+
+    // An empty ST(0) stores the indefinite NaN
+    tword fstp_t() { if (is_empty(0)) underflow(0); else raise(0); return POP().pack(); };
+    qword fstp_l() { if (is_empty(0)) underflow(0); uint8_t flags; qword f = mode->compress_l(POP(), flags); raise(flags); return f; };
+    dword fstp_s() { if (is_empty(0)) underflow(0); uint8_t flags; dword f = mode->compress_s(POP(), flags); raise(flags); return f; };
+
+    // Empties the stack, clears the status word and resets the control word. The registers are zeroed
+    // too, so registers() is repeatable for ones that were never loaded.
+    void finit() { stack.fill(empty_register); top = 0; status = 0; last_flags = 0; fldcw(default_control_word); }
+
+    // Only the rounding and precision control fields change results. Unmasked exceptions never trap,
+    // they only set the error summary and busy bits of the status word.
+    void fldcw(uint16_t cw) { control = cw; mode = &kernels(cw); }
+    uint16_t fstcw() const { return control; }
+
+    // C0, C2 and C3 are always clear, none of the instructions here define them
+    uint16_t fstsw() const {
+        uint16_t sw = (status & ~rounded_up) | (top << Status::top_shift);
+        if (last_flags & rounded_up)
+            sw |= Status::c1;
+        if (status & ~control & Status::exceptions)
+            sw |= Status::error_summary | Status::busy;
+        return sw;
+    }
+
+    void fclex() { status = 0; }
+
+    // Nothing is ever pending, as nothing traps
+    void fwait() {}
+
+    uint16_t tag_word() const;
+    Environment fnstenv() const { return { control, fstsw(), tag_word() }; }
+
+    // Reinitializes the fpu, like finit
+    SavedState fsave() {
+        SavedState saved = { fnstenv(), registers() };
+        finit();
+        return saved;
+    }
+
+    // ST(0) to ST(7)
+    std::array<tword, 8> registers() {
+        std::array<tword, 8> regs;
+        for (int i = 0; i < 8; i++)
+            regs[i] = ST(i).pack();
+        return regs;
+    }
+
+    // Batched versions of expand and compress, for bulk conversion of memory operands.
+    // They are vectorized with the best instruction set the cpu supports, and match the
+    // scalar conversions bit for bit. compress always rounds to nearest.
+    enum class Simd { scalar, sse42, avx2, avx512 };
+
+    static Simd best_simd();
+    static const char *simd_name(Simd simd);
+
+    template<class T>
+    static void expand(const T *in, tword *out, size_t count, Simd simd = best_simd());
+
+    template<class T>
+    static void compress(const tword *in, T *out, size_t count, Simd simd = best_simd());
+
+    // Equivalent to fld then fstp for each value, without touching the stack
+    void convert(const dword *in, tword *out, size_t count) { expand(in, out, count); }
+    void convert(const qword *in, tword *out, size_t count) { expand(in, out, count); }
+    void convert(const tword *in, dword *out, size_t count) { mode->compress_s_batch(in, out, count); }
+    void convert(const tword *in, qword *out, size_t count) { mode->compress_l_batch(in, out, count); }
+
+    // Equivalent to fld a, then the instruction with b from memory and fstp for each pair. For
+    // tword pairs b is loaded after a and the popping form works on ST(1), like fsubp computes a - b.
+    // The kernels run straight from memory to memory, without touching the stack.
+    template<class B>
+    void fadd(const Operands<B> *in, tword *out, size_t count)  { batches<B>().add(in, out, count); }
+    template<class B>
+    void fsub(const Operands<B> *in, tword *out, size_t count)  { batches<B>().sub(in, out, count); }
+    template<class B>
+    void fsubr(const Operands<B> *in, tword *out, size_t count) { batches<B>().subr(in, out, count); }
+    template<class B>
+    void fmul(const Operands<B> *in, tword *out, size_t count)  { batches<B>().mul(in, out, count); }
+    template<class B>
+    void fdiv(const Operands<B> *in, tword *out, size_t count)  { batches<B>().div(in, out, count); }
+    template<class B>
+    void fdivr(const Operands<B> *in, tword *out, size_t count) { batches<B>().divr(in, out, count); }
+
+    // Equivalent to fld, fsqrt then fstp for each value
+    void fsqrt(const tword *in, tword *out, size_t count) { mode->sqrt_batch(in, out, count); }
 };
\ No newline at end of file
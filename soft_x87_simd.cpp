@@ -0,0 +1,309 @@
+#include <utility>
+
+#include "soft_x87.h"
+
+// Vectorized batch versions of soft_x87::expand and soft_x87::compress.
+//
+// The kernels are written once with gcc vector extensions and instantiated inside functions
+// compiled for sse4.2 (2 lanes), avx2 (4 lanes) and avx512 (4 lanes). Each value is unpacked into
+// its own 64bit lane, converted with branch free bitwise selects that follow the scalar code exactly,
+// and packed again. A batch that isn't a multiple of the lane count is padded.
+//
+// The avx512 kernel sticks to 256bit vectors and only uses avx512vl for the 64bit shifts and
+// compares, gcc scalarizes most of the 512bit version and it ends up slower than avx2.
+
+namespace {
+
+template<int N>
+struct lanes {
+    typedef uint64_t u64 __attribute__((vector_size(N * 8)));
+    typedef int64_t  i64 __attribute__((vector_size(N * 8)));
+    typedef double   f64 __attribute__((vector_size(N * 8)));
+    typedef uint32_t u32 __attribute__((vector_size(N * 4)));
+};
+
+// Sets the lanes of v where mask is set to a, a can be a scalar. Masks are the all ones
+// or all zeros lanes that vector comparisons return. Vectors are only passed by reference,
+// as passing them by value has a different abi depending on the target.
+template<class M, class A, class V>
+__attribute__((always_inline)) inline void assign_where(const M &mask, const A &a, V &v) {
+    V m = (V)mask;
+    v = ((V{} + a) & m) | (v & ~m);
+}
+
+// Loads N dwords or qwords, zero extended to 64bit lanes
+template<class T, int N>
+__attribute__((always_inline)) inline void load_lanes(const T *in, typename lanes<N>::u64 &bits) {
+    if constexpr (sizeof(T) == 4) {
+        typename lanes<N>::u32 narrow;
+        memcpy(&narrow, reinterpret_cast<const char*>(in), sizeof(narrow));
+        bits = __builtin_convertvector(narrow, typename lanes<N>::u64);
+    } else {
+        memcpy(&bits, reinterpret_cast<const char*>(in), sizeof(bits));
+    }
+}
+
+template<class T, int N>
+__attribute__((always_inline)) inline void store_lanes(T *out, const typename lanes<N>::u64 &bits) {
+    if constexpr (sizeof(T) == 4) {
+        auto narrow = __builtin_convertvector(bits, typename lanes<N>::u32);
+        memcpy(reinterpret_cast<char*>(out), &narrow, sizeof(narrow));
+    } else {
+        memcpy(reinterpret_cast<char*>(out), &bits, sizeof(bits));
+    }
+}
+
+// 80bit floats are split into a significand lane and a sign/exponent lane.
+// The vectors are built directly from the scalars, going through memory here stalls store forwarding.
+inline uint64_t tword_significand(const tword *in) {
+    uint64_t significand;
+    memcpy(&significand, reinterpret_cast<const char*>(in), 8);
+    return significand;
+}
+
+inline uint64_t tword_sign_exponent(const tword *in) {
+    uint16_t sign_exponent;
+    memcpy(&sign_exponent, reinterpret_cast<const char*>(in) + 8, 2);
+    return sign_exponent;
+}
+
+template<int N, size_t... I>
+__attribute__((always_inline)) inline void load_twords(const tword *in, typename lanes<N>::u64 &significand,
+                                                       typename lanes<N>::u64 &sign_exponent,
+                                                       std::index_sequence<I...>) {
+    significand = typename lanes<N>::u64{ tword_significand(in + I)... };
+    sign_exponent = typename lanes<N>::u64{ tword_sign_exponent(in + I)... };
+}
+
+template<int N>
+__attribute__((always_inline)) inline void store_twords(tword *out, const typename lanes<N>::u64 &significand,
+                                                        const typename lanes<N>::u64 &sign_exponent) {
+    uint64_t sig[N];
+    uint64_t se[N];
+    memcpy(sig, &significand, sizeof(sig));
+    memcpy(se, &sign_exponent, sizeof(se));
+    for (int i = 0; i < N; i++) {
+        uint16_t upper = se[i];
+        memcpy(reinterpret_cast<char*>(&out[i]), &sig[i], 8);
+        memcpy(reinterpret_cast<char*>(&out[i]) + 8, &upper, 2);
+    }
+}
+
+template<class T, int N>
+__attribute__((always_inline)) inline void expand_lanes(const T *in, tword *out) {
+    using u64 = typename lanes<N>::u64;
+    using i64 = typename lanes<N>::i64;
+    using f64 = typename lanes<N>::f64;
+
+    constexpr int shift = 63 - T::significand_width;
+    constexpr uint64_t rebias = tword::exponent_bias - T::exponent_bias;
+
+    u64 bits;
+    load_lanes<T, N>(in, bits);
+
+    u64 sign = bits >> (T::bits - 1);
+    u64 exponent = (bits >> T::significand_width) & T::exponent_max;
+    u64 fraction = bits & T::significand_max;
+
+    i64 is_max = exponent == T::exponent_max;
+    i64 is_zero_exponent = exponent == 0;
+    i64 is_zero_fraction = fraction == 0;
+
+    // Normals
+    u64 significand = 0x8000'0000'0000'0000 | (fraction << shift);
+    u64 expanded_exponent = exponent + rebias;
+
+    // Infinities and NaNs, NaNs get forced to quiet
+    assign_where(is_max & ~is_zero_fraction, significand | 0x4000'0000'0000'0000, significand);
+    assign_where(is_max, 0x7fff, expanded_exponent);
+
+    // Denormals get normalized. The highest set bit is found by converting the fraction
+    // to a double, which is exact as it's less than 2^52.
+    f64 as_double = (f64)(fraction | 0x4330'0000'0000'0000) - 4503599627370496.0;
+    u64 msb = (((u64)as_double >> 52) - 1023) & 63;
+    i64 is_denormal = is_zero_exponent & ~is_zero_fraction;
+    assign_where(is_denormal, fraction << (63 - msb), significand);
+    assign_where(is_denormal, msb + (rebias + 1 - T::significand_width), expanded_exponent);
+
+    // Zeros
+    i64 is_zero = is_zero_exponent & is_zero_fraction;
+    assign_where(is_zero, 0, significand);
+    assign_where(is_zero, 0, expanded_exponent);
+
+    u64 sign_exponent = (sign << 15) | expanded_exponent;
+    store_twords<N>(out, significand, sign_exponent);
+}
+
+template<class T, int N>
+__attribute__((always_inline)) inline void compress_lanes(const tword *in, T *out) {
+    using u64 = typename lanes<N>::u64;
+    using i64 = typename lanes<N>::i64;
+
+    constexpr int64_t rebias = T::exponent_bias - tword::exponent_bias;
+
+    u64 raw_significand;
+    u64 sign_exponent;
+    load_twords<N>(in, raw_significand, sign_exponent, std::make_index_sequence<N>());
+
+    u64 sign = sign_exponent >> 15;
+    u64 raw_exponent = sign_exponent & tword::exponent_max;
+
+    u64 fraction = raw_significand & ~tword::interger_bit_mask;
+    i64 exponent = (i64)raw_exponent + rebias;
+    i64 shift = i64{} + (63 - T::significand_width);
+
+    i64 is_max = raw_exponent == tword::exponent_max;
+    i64 is_overflow = exponent >= T::exponent_max;
+    i64 is_underflow = exponent < -T::significand_width;
+
+    // Denormalize
+    i64 is_denormal = exponent <= 0;
+    u64 significand = fraction;
+    assign_where(is_denormal, fraction | tword::interger_bit_mask, significand);
+    assign_where(is_denormal, shift + 1 - exponent, shift);
+    assign_where(shift > 64, 64, shift); // only underflowing lanes, which get replaced below
+    assign_where(is_denormal, 0, exponent);
+
+    // Round to nearest even. Shifts are split so a shift of 64 works out.
+    u64 ushift = (u64)shift;
+    u64 one = u64{} + 1;
+    u64 rounding = significand & (((one + one) << (ushift - 1)) - 1);
+    u64 rounding_point_five = one << (ushift - 1);
+    significand = (significand >> 1) >> (ushift - 1);
+
+    i64 odd = (significand & 1) == 1;
+    i64 round_up = (rounding > rounding_point_five) | ((rounding == rounding_point_five) & odd);
+    assign_where(round_up, significand + 1, significand);
+
+    i64 carry = significand > T::significand_max;
+    assign_where(carry, exponent + 1, exponent);
+    assign_where(carry, 0, significand);
+
+    // Underflow to zero
+    assign_where(is_underflow, 0, significand);
+    assign_where(is_underflow, 0, exponent);
+
+    // Overflow to infinity
+    assign_where(is_overflow, 0, significand);
+    assign_where(is_overflow, T::exponent_max, exponent);
+
+    // Infinities and NaNs, NaNs get forced to quiet
+    u64 nan_significand = (fraction | 0x4000'0000'0000'0000) >> (63 - T::significand_width);
+    assign_where(fraction == 0, 0, nan_significand);
+    assign_where(is_max, nan_significand, significand);
+    assign_where(is_max, T::exponent_max, exponent);
+
+    // Unsupported encodings, without the integer bit, store the indefinite NaN
+    i64 is_unsupported = (raw_exponent != 0) & ((raw_significand & tword::interger_bit_mask) == 0);
+    assign_where(is_unsupported, u64{} + 1, sign);
+    assign_where(is_unsupported, T::exponent_max, exponent);
+    assign_where(is_unsupported, u64{} + (1ull << (T::significand_width - 1)), significand);
+
+    u64 bits = (sign << (T::bits - 1)) | ((u64)exponent << T::significand_width) | significand;
+    store_lanes<T, N>(out, bits);
+}
+
+template<int N, class T>
+__attribute__((always_inline)) inline void expand_loop(const T *in, tword *out, size_t count) {
+    size_t i = 0;
+    for (; i + N <= count; i += N)
+        expand_lanes<T, N>(in + i, out + i);
+
+    if (i < count) {
+        T padded_in[N];
+        tword padded_out[N];
+        std::copy(in + i, in + count, padded_in);
+        expand_lanes<T, N>(padded_in, padded_out);
+        std::copy(padded_out, padded_out + (count - i), out + i);
+    }
+}
+
+template<int N, class T>
+__attribute__((always_inline)) inline void compress_loop(const tword *in, T *out, size_t count) {
+    size_t i = 0;
+    for (; i + N <= count; i += N)
+        compress_lanes<T, N>(in + i, out + i);
+
+    if (i < count) {
+        tword padded_in[N];
+        T padded_out[N];
+        std::copy(in + i, in + count, padded_in);
+        compress_lanes<T, N>(padded_in, padded_out);
+        std::copy(padded_out, padded_out + (count - i), out + i);
+    }
+}
+
+#define SIMD_KERNELS(name, isa, N) \
+    __attribute__((target(isa))) void expand_##name(const dword *in, tword *out, size_t count) { \
+        expand_loop<N>(in, out, count); \
+    } \
+    __attribute__((target(isa))) void expand_##name(const qword *in, tword *out, size_t count) { \
+        expand_loop<N>(in, out, count); \
+    } \
+    __attribute__((target(isa))) void compress_##name(const tword *in, dword *out, size_t count) { \
+        compress_loop<N>(in, out, count); \
+    } \
+    __attribute__((target(isa))) void compress_##name(const tword *in, qword *out, size_t count) { \
+        compress_loop<N>(in, out, count); \
+    }
+
+SIMD_KERNELS(sse42, "sse4.2", 2)
+SIMD_KERNELS(avx2, "avx2", 4)
+SIMD_KERNELS(avx512, "avx512f,avx512vl", 4)
+
+} // namespace
+
+soft_x87::Simd soft_x87::best_simd() {
+    static const Simd best = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl"))
+            return Simd::avx512;
+        if (__builtin_cpu_supports("avx2"))
+            return Simd::avx2;
+        if (__builtin_cpu_supports("sse4.2"))
+            return Simd::sse42;
+        return Simd::scalar;
+    }();
+    return best;
+}
+
+const char *soft_x87::simd_name(Simd simd) {
+    switch (simd) {
+    case Simd::scalar: return "scalar";
+    case Simd::sse42:  return "sse4.2";
+    case Simd::avx2:   return "avx2";
+    case Simd::avx512: return "avx512";
+    }
+    return "unknown";
+}
+
+template<class T>
+void soft_x87::expand(const T *in, tword *out, size_t count, Simd simd) {
+    switch (simd) {
+    case Simd::avx512: return expand_avx512(in, out, count);
+    case Simd::avx2:   return expand_avx2(in, out, count);
+    case Simd::sse42:  return expand_sse42(in, out, count);
+    case Simd::scalar: break;
+    }
+    for (size_t i = 0; i < count; i++)
+        out[i] = expand(in[i]).pack();
+}
+
+template<class T>
+void soft_x87::compress(const tword *in, T *out, size_t count, Simd simd) {
+    switch (simd) {
+    case Simd::avx512: return compress_avx512(in, out, count);
+    case Simd::avx2:   return compress_avx2(in, out, count);
+    case Simd::sse42:  return compress_sse42(in, out, count);
+    case Simd::scalar: break;
+    }
+    uint8_t flags;
+    for (size_t i = 0; i < count; i++)
+        out[i] = compress<T>(reg::unpack(in[i]), flags);
+}
+
+template void soft_x87::expand(const dword*, tword*, size_t, Simd);
+template void soft_x87::expand(const qword*, tword*, size_t, Simd);
+
+template void soft_x87::compress(const tword*, dword*, size_t, Simd);
+template void soft_x87::compress(const tword*, qword*, size_t, Simd);
@@ -0,0 +1,468 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include "float_types.h"
+#include "mismatch_log.h"
+
+// Binary traces of x87 instruction streams, for replaying real programs through both fpus.
+//
+// A trace is a TraceHeader followed by variable length records. Each record is one byte holding
+// the instruction (TraceOp), followed by a byte with the ST(i) index if it has a register operand, or
+// the raw bits of its memory operand if it has one of those. Stores record no operand, their result is
+// what gets compared. A record is at most 11 bytes, most loads are 5 or 9.
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+
+    static constexpr char expected_magic[8] = { 'X', '8', '7', 'T', 'R', 'A', 'C', 'E' };
+    static constexpr uint32_t current_version = 2;
+};
+
+// The instructions of the x87 interface
+enum class TraceOp : uint8_t {
+    fadd_st,
+    faddp_st,
+    fadd_m32,
+    fadd_m64,
+    fsub_st,
+    fsubp_st,
+    fsub_m32,
+    fsub_m64,
+    fsubr_st,
+    fsubrp_st,
+    fsubr_m32,
+    fsubr_m64,
+    fmul_st,
+    fmulp_st,
+    fmul_m32,
+    fmul_m64,
+    fdiv_st,
+    fdivp_st,
+    fdiv_m32,
+    fdiv_m64,
+    fdivr_st,
+    fdivrp_st,
+    fdivr_m32,
+    fdivr_m64,
+    fsqrt,
+    fld_st,
+    fld_m32,
+    fld_m64,
+    fld_m80,
+    fild_m16,
+    fild_m32,
+    fild_m64,
+    fstp_m32,
+    fstp_m64,
+    fstp_m80,
+    count,
+};
+
+inline const char *trace_op_name(TraceOp op) {
+    switch (op) {
+    case TraceOp::fadd_st:  return "fadd st";
+    case TraceOp::faddp_st: return "faddp st";
+    case TraceOp::fadd_m32: return "fadd m32";
+    case TraceOp::fadd_m64: return "fadd m64";
+    case TraceOp::fsub_st:  return "fsub st";
+    case TraceOp::fsubp_st: return "fsubp st";
+    case TraceOp::fsub_m32: return "fsub m32";
+    case TraceOp::fsub_m64: return "fsub m64";
+    case TraceOp::fsubr_st:  return "fsubr st";
+    case TraceOp::fsubrp_st: return "fsubrp st";
+    case TraceOp::fsubr_m32: return "fsubr m32";
+    case TraceOp::fsubr_m64: return "fsubr m64";
+    case TraceOp::fmul_st:  return "fmul st";
+    case TraceOp::fmulp_st: return "fmulp st";
+    case TraceOp::fmul_m32: return "fmul m32";
+    case TraceOp::fmul_m64: return "fmul m64";
+    case TraceOp::fdiv_st:  return "fdiv st";
+    case TraceOp::fdivp_st: return "fdivp st";
+    case TraceOp::fdiv_m32: return "fdiv m32";
+    case TraceOp::fdiv_m64: return "fdiv m64";
+    case TraceOp::fdivr_st:  return "fdivr st";
+    case TraceOp::fdivrp_st: return "fdivrp st";
+    case TraceOp::fdivr_m32: return "fdivr m32";
+    case TraceOp::fdivr_m64: return "fdivr m64";
+    case TraceOp::fsqrt:    return "fsqrt";
+    case TraceOp::fld_st:   return "fld st";
+    case TraceOp::fld_m32:  return "fld m32";
+    case TraceOp::fld_m64:  return "fld m64";
+    case TraceOp::fld_m80:  return "fld m80";
+    case TraceOp::fild_m16: return "fild m16";
+    case TraceOp::fild_m32: return "fild m32";
+    case TraceOp::fild_m64: return "fild m64";
+    case TraceOp::fstp_m32: return "fstp m32";
+    case TraceOp::fstp_m64: return "fstp m64";
+    case TraceOp::fstp_m80: return "fstp m80";
+    case TraceOp::count:    break;
+    }
+    return "unknown";
+}
+
+// Bytes of memory operand following the opcode byte
+constexpr size_t trace_operand_size(TraceOp op) {
+    switch (op) {
+    case TraceOp::fild_m16: return 2;
+    case TraceOp::fadd_m32:
+    case TraceOp::fsub_m32:
+    case TraceOp::fsubr_m32:
+    case TraceOp::fmul_m32:
+    case TraceOp::fdiv_m32:
+    case TraceOp::fdivr_m32:
+    case TraceOp::fld_m32:
+    case TraceOp::fild_m32: return 4;
+    case TraceOp::fadd_m64:
+    case TraceOp::fsub_m64:
+    case TraceOp::fsubr_m64:
+    case TraceOp::fmul_m64:
+    case TraceOp::fdiv_m64:
+    case TraceOp::fdivr_m64:
+    case TraceOp::fld_m64:
+    case TraceOp::fild_m64: return 8;
+    case TraceOp::fld_m80:  return 10;
+    default:                return 0;
+    }
+}
+
+// Bytes of result a store writes
+constexpr size_t trace_result_size(TraceOp op) {
+    switch (op) {
+    case TraceOp::fstp_m32: return 4;
+    case TraceOp::fstp_m64: return 8;
+    case TraceOp::fstp_m80: return 10;
+    default:                return 0;
+    }
+}
+
+// +1 for instructions that push, -1 for ones that pop
+constexpr int trace_stack_effect(TraceOp op) {
+    switch (op) {
+    case TraceOp::fld_st:
+    case TraceOp::fld_m32:
+    case TraceOp::fld_m64:
+    case TraceOp::fld_m80:
+    case TraceOp::fild_m16:
+    case TraceOp::fild_m32:
+    case TraceOp::fild_m64: return 1;
+    case TraceOp::faddp_st:
+    case TraceOp::fsubp_st:
+    case TraceOp::fsubrp_st:
+    case TraceOp::fmulp_st:
+    case TraceOp::fdivp_st:
+    case TraceOp::fdivrp_st:
+    case TraceOp::fstp_m32:
+    case TraceOp::fstp_m64:
+    case TraceOp::fstp_m80: return -1;
+    default:                return 0;
+    }
+}
+
+constexpr bool trace_uses_st(TraceOp op) {
+    switch (op) {
+    case TraceOp::fadd_st:
+    case TraceOp::faddp_st:
+    case TraceOp::fsub_st:
+    case TraceOp::fsubp_st:
+    case TraceOp::fsubr_st:
+    case TraceOp::fsubrp_st:
+    case TraceOp::fmul_st:
+    case TraceOp::fmulp_st:
+    case TraceOp::fdiv_st:
+    case TraceOp::fdivp_st:
+    case TraceOp::fdivr_st:
+    case TraceOp::fdivrp_st:
+    case TraceOp::fld_st:   return true;
+    default:                return false;
+    }
+}
+
+// Bytes of the whole record: the opcode, then the ST(i) index or the memory operand
+constexpr size_t trace_record_size(TraceOp op) {
+    return 1 + (trace_uses_st(op) ? 1 : 0) + trace_operand_size(op);
+}
+
+constexpr size_t max_trace_record_size = 1 + 10;
+
+struct TraceInstruction {
+    TraceOp op;
+    uint8_t st;          // ST(i) index, for instructions with a register operand
+    uint8_t operand[10]; // raw bits of the memory operand, zero padded
+
+    static TraceInstruction make(TraceOp op, int st = 0) {
+        TraceInstruction ins = {};
+        ins.op = op;
+        ins.st = st;
+        return ins;
+    }
+
+    template<class T>
+    static TraceInstruction make(TraceOp op, const T &operand) {
+        static_assert(sizeof(T) <= sizeof(TraceInstruction::operand), "Operand too large");
+
+        TraceInstruction ins = {};
+        ins.op = op;
+        memcpy(ins.operand, reinterpret_cast<const char*>(&operand), sizeof(T));
+        return ins;
+    }
+};
+
+// Whether ins would underflow (-1) or overflow (1) the stack at depth, or 0 if it runs normally.
+// fld st(i) reads ST(i) and the other register forms read ST(0) and ST(i), the rest read at least ST(0).
+inline int trace_stack_fault(const TraceInstruction &ins, int depth) {
+    int effect = trace_stack_effect(ins.op);
+    int required = trace_uses_st(ins.op) ? ins.st + 1 : (effect > 0 ? 0 : 1);
+    if (depth < required)
+        return -1;
+    return effect > 0 && depth == 8 ? 1 : 0;
+}
+
+inline std::string describe(const TraceInstruction &ins) {
+    if (trace_uses_st(ins.op))
+        return fmt::format("{}({})", trace_op_name(ins.op), ins.st);
+    switch (ins.op) {
+    case TraceOp::fild_m16: return fmt::format("{} {}", trace_op_name(ins.op), describe(decode_value<int16_t>(ins.operand)));
+    case TraceOp::fild_m32: return fmt::format("{} {}", trace_op_name(ins.op), describe(decode_value<int32_t>(ins.operand)));
+    case TraceOp::fild_m64: return fmt::format("{} {}", trace_op_name(ins.op), describe(decode_value<int64_t>(ins.operand)));
+    default:                break;
+    }
+    switch (trace_operand_size(ins.op)) {
+    case 4:  return fmt::format("{} {}", trace_op_name(ins.op), describe(decode_value<dword>(ins.operand)));
+    case 8:  return fmt::format("{} {}", trace_op_name(ins.op), describe(decode_value<qword>(ins.operand)));
+    case 10: return fmt::format("{} {}", trace_op_name(ins.op), describe(decode_value<tword>(ins.operand)));
+    default: return trace_op_name(ins.op);
+    }
+}
+
+// Formats the result a store wrote
+inline std::string describe_stored(TraceOp op, const uint8_t *bits) {
+    switch (trace_result_size(op)) {
+    case 4:  return describe(decode_value<dword>(bits));
+    case 8:  return describe(decode_value<qword>(bits));
+    default: return describe(decode_value<tword>(bits));
+    }
+}
+
+// Runs one traced instruction. Stores write the bits of their result to stored.
+template<class Fpu>
+inline void execute(Fpu &fpu, const TraceInstruction &ins, uint8_t (&stored)[10]) {
+    switch (ins.op) {
+    case TraceOp::fadd_st:  fpu.fadd(int(ins.st)); break;
+    case TraceOp::faddp_st: fpu.faddp(int(ins.st)); break;
+    case TraceOp::fadd_m32: fpu.fadd(decode_value<dword>(ins.operand)); break;
+    case TraceOp::fadd_m64: fpu.fadd(decode_value<qword>(ins.operand)); break;
+    case TraceOp::fsub_st:  fpu.fsub(int(ins.st)); break;
+    case TraceOp::fsubp_st: fpu.fsubp(int(ins.st)); break;
+    case TraceOp::fsub_m32: fpu.fsub(decode_value<dword>(ins.operand)); break;
+    case TraceOp::fsub_m64: fpu.fsub(decode_value<qword>(ins.operand)); break;
+    case TraceOp::fsubr_st:  fpu.fsubr(int(ins.st)); break;
+    case TraceOp::fsubrp_st: fpu.fsubrp(int(ins.st)); break;
+    case TraceOp::fsubr_m32: fpu.fsubr(decode_value<dword>(ins.operand)); break;
+    case TraceOp::fsubr_m64: fpu.fsubr(decode_value<qword>(ins.operand)); break;
+    case TraceOp::fmul_st:  fpu.fmul(int(ins.st)); break;
+    case TraceOp::fmulp_st: fpu.fmulp(int(ins.st)); break;
+    case TraceOp::fmul_m32: fpu.fmul(decode_value<dword>(ins.operand)); break;
+    case TraceOp::fmul_m64: fpu.fmul(decode_value<qword>(ins.operand)); break;
+    case TraceOp::fdiv_st:  fpu.fdiv(int(ins.st)); break;
+    case TraceOp::fdivp_st: fpu.fdivp(int(ins.st)); break;
+    case TraceOp::fdiv_m32: fpu.fdiv(decode_value<dword>(ins.operand)); break;
+    case TraceOp::fdiv_m64: fpu.fdiv(decode_value<qword>(ins.operand)); break;
+    case TraceOp::fdivr_st:  fpu.fdivr(int(ins.st)); break;
+    case TraceOp::fdivrp_st: fpu.fdivrp(int(ins.st)); break;
+    case TraceOp::fdivr_m32: fpu.fdivr(decode_value<dword>(ins.operand)); break;
+    case TraceOp::fdivr_m64: fpu.fdivr(decode_value<qword>(ins.operand)); break;
+    case TraceOp::fsqrt:    fpu.fsqrt(); break;
+    case TraceOp::fld_st:   fpu.fld(int(ins.st)); break;
+    case TraceOp::fld_m32:  fpu.fld(decode_value<dword>(ins.operand)); break;
+    case TraceOp::fld_m64:  fpu.fld(decode_value<qword>(ins.operand)); break;
+    case TraceOp::fld_m80:  fpu.fld(decode_value<tword>(ins.operand)); break;
+    case TraceOp::fild_m16: fpu.fild(decode_value<int16_t>(ins.operand)); break;
+    case TraceOp::fild_m32: fpu.fild(decode_value<int32_t>(ins.operand)); break;
+    case TraceOp::fild_m64: fpu.fild(decode_value<int64_t>(ins.operand)); break;
+    case TraceOp::fstp_m32: { dword f = fpu.fstp_s(); memcpy(stored, reinterpret_cast<const char*>(&f), 4); break; }
+    case TraceOp::fstp_m64: { qword f = fpu.fstp_l(); memcpy(stored, reinterpret_cast<const char*>(&f), 8); break; }
+    case TraceOp::fstp_m80: { tword f = fpu.fstp_t(); memcpy(stored, reinterpret_cast<const char*>(&f), 10); break; }
+    case TraceOp::count:    break;
+    }
+}
+
+// Writes a trace, buffered through stdio
+class TraceWriter {
+public:
+    explicit TraceWriter(const std::string &path) {
+        file = fopen(path.c_str(), "wb");
+        if (!file)
+            return;
+
+        TraceHeader header = {};
+        memcpy(header.magic, TraceHeader::expected_magic, sizeof(header.magic));
+        header.version = TraceHeader::current_version;
+        failed = fwrite(&header, sizeof(header), 1, file) != 1;
+    }
+
+    ~TraceWriter() {
+        if (file)
+            fclose(file);
+    }
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    bool ok() const { return file && !failed; }
+
+    void append(const TraceInstruction &ins) {
+        if (!file)
+            return;
+
+        uint8_t record[max_trace_record_size];
+        size_t size = trace_record_size(ins.op);
+        record[0] = uint8_t(ins.op);
+        if (trace_uses_st(ins.op))
+            record[1] = ins.st & 7;
+        else
+            memcpy(record + 1, ins.operand, size - 1);
+        failed |= fwrite(record, 1, size, file) != size;
+    }
+
+    // Returns false if anything failed to write
+    bool flush() {
+        failed |= file && fflush(file) != 0;
+        return ok();
+    }
+
+private:
+    FILE *file = nullptr;
+    bool failed = false;
+};
+
+// Streams a trace with large sequential reads, so traces of any size are replayed in a fixed
+// amount of memory, and from pipes too. The path "-" reads stdin.
+class TraceReader {
+public:
+    static constexpr size_t buffer_size = 1 << 20;
+
+    explicit TraceReader(const std::string &path) : path(path) {
+        fd = path == "-" ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error = fmt::format("can't open {}: {}", path, strerror(errno));
+            return;
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        // Padded, so operands can always be copied whole
+        buffer = std::make_unique<uint8_t[]>(buffer_size + max_trace_record_size);
+        pos = end = buffer.get();
+
+        TraceHeader header;
+        refill();
+        if (size_t(end - pos) < sizeof(header)) {
+            if (error.empty())
+                error = fmt::format("{} is not a trace", path);
+            return;
+        }
+        memcpy(&header, pos, sizeof(header));
+        pos += sizeof(header);
+
+        if (memcmp(header.magic, TraceHeader::expected_magic, sizeof(header.magic)) != 0
+                || header.version != TraceHeader::current_version)
+            error = fmt::format("{} is not a trace, or from an incompatible version", path);
+    }
+
+    ~TraceReader() {
+        if (fd > STDIN_FILENO)
+            close(fd);
+    }
+
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    // Empty unless opening or reading the trace failed, or it's corrupt
+    const std::string &failure() const { return error; }
+
+    // Instructions read so far
+    uint64_t count() const { return instructions; }
+
+    // Reads the next instruction, returns false at the end of the trace or on errors
+    bool next(TraceInstruction &ins) {
+        if (size_t(end - pos) < max_trace_record_size && !at_eof)
+            refill();
+        if (pos == end || !error.empty())
+            return false;
+
+        TraceOp op = TraceOp(*pos);
+        if (op >= TraceOp::count) {
+            error = fmt::format("{}: bad opcode {:#x} at instruction {}", path, *pos, instructions);
+            return false;
+        }
+        size_t size = trace_record_size(op);
+        if (size_t(end - pos) < size) {
+            error = fmt::format("{}: truncated at instruction {}", path, instructions);
+            return false;
+        }
+
+        ins.op = op;
+        if (trace_uses_st(op)) {
+            ins.st = pos[1];
+            if (ins.st > 7) {
+                error = fmt::format("{}: bad register {} at instruction {}", path, ins.st, instructions);
+                return false;
+            }
+            memset(ins.operand, 0, sizeof(ins.operand));
+        } else {
+            ins.st = 0;
+            memcpy(ins.operand, pos + 1, sizeof(ins.operand));
+        }
+        pos += size;
+        instructions++;
+        return true;
+    }
+
+private:
+    // Moves the unread bytes to the front of the buffer and fills the rest
+    void refill() {
+        size_t left = end - pos;
+        memmove(buffer.get(), pos, left);
+        pos = buffer.get();
+        end = pos + left;
+
+        while (size_t(end - pos) < buffer_size && !at_eof) {
+            ssize_t got = read(fd, end, buffer_size - (end - pos));
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0) {
+                error = fmt::format("can't read {}: {}", path, strerror(errno));
+                at_eof = true;
+            }
+            if (got <= 0)
+                at_eof = true;
+            else
+                end += got;
+        }
+    }
+
+    std::string path;
+    std::string error;
+    int fd = -1;
+    std::unique_ptr<uint8_t[]> buffer;
+    uint8_t *pos = nullptr;
+    uint8_t *end = nullptr;
+    bool at_eof = false;
+    uint64_t instructions = 0;
+};
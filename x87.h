@@ -1,23 +1,160 @@
 #pragma once
 
+#include <array>
+#include <type_traits>
+
+#include <stdint.h>
+
 #include "float_types.h"
 
-// Generic interface for x87 fpu implementations
+// Fields of the control word. soft_x87 never traps, so only the rounding and precision control
+// fields change its results. The real fpu traps on unmasked exceptions, which only forked_x87 survives.
+enum class Rounding : uint8_t {
+    nearest, // to nearest even
+    down,    // toward -infinity
+    up,      // toward +infinity
+    zero,    // toward zero
+};
+
+// fninit's control word: all exceptions masked, 64 bit precision and rounding to nearest
+constexpr uint16_t default_control_word = 0x037f;
+
+constexpr Rounding rounding_control(uint16_t cw) { return Rounding((cw >> 10) & 3); }
+
+// Significand bits arithmetic results are rounded to. The reserved setting is treated as 64.
+constexpr int precision_control(uint16_t cw) {
+    switch ((cw >> 8) & 3) {
+    case 0:  return 24;
+    case 2:  return 53;
+    default: return 64;
+    }
+}
+
+constexpr uint16_t control_word(Rounding rounding, int precision) {
+    int pc = precision == 24 ? 0 : precision == 53 ? 2 : 3;
+    return (default_control_word & 0xf0ff) | (int(rounding) << 10) | (pc << 8);
+}
+
+// Bits of the status word. The six exception flags are in the same order as their masks in the control word.
+struct Status {
+    static constexpr uint16_t invalid       = 1 << 0;
+    static constexpr uint16_t denormal      = 1 << 1;
+    static constexpr uint16_t zero_divide   = 1 << 2;
+    static constexpr uint16_t overflow      = 1 << 3;
+    static constexpr uint16_t underflow     = 1 << 4;
+    static constexpr uint16_t precision     = 1 << 5;
+    static constexpr uint16_t stack_fault   = 1 << 6;
+    static constexpr uint16_t error_summary = 1 << 7;
+    static constexpr uint16_t c0            = 1 << 8;
+    static constexpr uint16_t c1            = 1 << 9;
+    static constexpr uint16_t c2            = 1 << 10;
+    static constexpr int      top_shift     = 11;
+    static constexpr uint16_t top           = 7 << top_shift;
+    static constexpr uint16_t c3            = 1 << 14;
+    static constexpr uint16_t busy          = 1 << 15;
+
+    static constexpr uint16_t exceptions    = 0x3f;
+};
+
+// The status word bits the instructions define, C0, C2 and C3 are left undefined by all of them
+constexpr uint16_t defined_status = ~(Status::c0 | Status::c2 | Status::c3);
+
+// Tag word entries, two bits per physical register
+enum class Tag : uint8_t {
+    valid,
+    zero,
+    special, // NaNs, infinities, denormals and unsupported encodings
+    empty,
+};
+
+constexpr Tag tag_of(uint16_t tag_word, int physical) { return Tag((tag_word >> (2 * physical)) & 3); }
+
+// What fnstenv stores, without the instruction and operand pointers
+struct Environment {
+    uint16_t control;
+    uint16_t status;
+    uint16_t tag;
+};
+
+// What fsave stores, the registers are ST(0) to ST(7)
+struct SavedState {
+    Environment environment;
+    std::array<tword, 8> registers;
+};
+
+inline const char *rounding_name(Rounding rounding) {
+    switch (rounding) {
+    case Rounding::nearest: return "nearest";
+    case Rounding::down:    return "down";
+    case Rounding::up:      return "up";
+    case Rounding::zero:    return "zero";
+    }
+    return "unknown";
+}
+
+// Common base for x87 fpu implementations.
+// Implementations derive from x87_base<Self> and provide the instructions as plain member functions,
+// so the test drivers, which are templated on the implementation, call them directly and can inline them.
+template<class Impl>
+class x87_base {
+public:
+    template<typename T>
+    T fstp() {
+        if constexpr (std::is_same<tword, T>::value)
+            return self().fstp_t();
+        if constexpr (std::is_same<qword, T>::value)
+            return self().fstp_l();
+        if constexpr (std::is_same<dword, T>::value)
+            return self().fstp_s();
+    }
+
+private:
+    Impl &self() { return static_cast<Impl&>(*this); }
+};
+
+// Generic interface for x87 fpu implementations, for code that needs to pick one at runtime
 class x87 {
 public:
+    virtual ~x87() = default;
+
     virtual void faddp(int st) = 0;
     virtual void fadd(int st) = 0;
     virtual void fadd(qword f) = 0;
     virtual void fadd(dword f) = 0;
-    // virtual void fmulp(int st) = 0;
-    // virtual void fmul(int st) = 0;
-    // virtual void fmul(qword f) = 0;
-    // virtual void fmul(dword f) = 0;
+    virtual void fsubp(int st) = 0;
+    virtual void fsub(int st) = 0;
+    virtual void fsub(qword f) = 0;
+    virtual void fsub(dword f) = 0;
+    virtual void fsubrp(int st) = 0;
+    virtual void fsubr(int st) = 0;
+    virtual void fsubr(qword f) = 0;
+    virtual void fsubr(dword f) = 0;
+    virtual void fmulp(int st) = 0;
+    virtual void fmul(int st) = 0;
+    virtual void fmul(qword f) = 0;
+    virtual void fmul(dword f) = 0;
+    virtual void fdivp(int st) = 0;
+    virtual void fdiv(int st) = 0;
+    virtual void fdiv(qword f) = 0;
+    virtual void fdiv(dword f) = 0;
+    virtual void fdivrp(int st) = 0;
+    virtual void fdivr(int st) = 0;
+    virtual void fdivr(qword f) = 0;
+    virtual void fdivr(dword f) = 0;
+    virtual void fsqrt() = 0;
 
-    void fadd()  { fadd(1);  }
-    void faddp() { faddp(1); }
-    // void fmul()  { fmul(1); }
-    // void fmulp() { fmulp(1); }
+    void fadd()   { fadd(1);  }
+    void faddp()  { faddp(1); }
+    void fsub()   { fsub(1); }
+    void fsubp()  { fsubp(1); }
+    void fsubr()  { fsubr(1); }
+    void fsubrp() { fsubrp(1); }
+    void fmul()   { fmul(1); }
+    void fmulp()  { fmulp(1); }
+    void fdiv()   { fdiv(1); }
+    void fdivp()  { fdivp(1); }
+    void fdivr()  { fdivr(1); }
+    void fdivrp() { fdivrp(1); }
 
     virtual void fld(tword f) = 0;
     virtual void fld(qword f) = 0;
@@ -32,6 +169,17 @@ public:
     virtual qword fstp_l() = 0;
     virtual dword fstp_s() = 0;
 
+    virtual void finit() = 0;
+    virtual std::array<tword, 8> registers() = 0;
+
+    virtual void fldcw(uint16_t cw) = 0;
+    virtual uint16_t fstcw() = 0;
+
+    virtual uint16_t fstsw() = 0;
+    virtual void fclex() = 0;
+    virtual Environment fnstenv() = 0;
+    virtual SavedState fsave() = 0;
+
     template<typename T>
     T fstp() {
         if constexpr (std::is_same<tword, T>::value)
@@ -41,4 +189,61 @@ public:
         if constexpr (std::is_same<dword, T>::value)
             return fstp_s();
     }
-};
\ No newline at end of file
+};
+
+// Thin adapter exposing an implementation through the virtual interface
+template<class Impl>
+class x87_adapter final : public x87 {
+public:
+    Impl impl;
+
+    void faddp(int st) override { impl.faddp(st); }
+    void fadd(int st)  override { impl.fadd(st); }
+    void fadd(qword f) override { impl.fadd(f); }
+    void fadd(dword f) override { impl.fadd(f); }
+    void fsubp(int st)  override { impl.fsubp(st); }
+    void fsub(int st)   override { impl.fsub(st); }
+    void fsub(qword f)  override { impl.fsub(f); }
+    void fsub(dword f)  override { impl.fsub(f); }
+    void fsubrp(int st) override { impl.fsubrp(st); }
+    void fsubr(int st)  override { impl.fsubr(st); }
+    void fsubr(qword f) override { impl.fsubr(f); }
+    void fsubr(dword f) override { impl.fsubr(f); }
+    void fmulp(int st)  override { impl.fmulp(st); }
+    void fmul(int st)   override { impl.fmul(st); }
+    void fmul(qword f)  override { impl.fmul(f); }
+    void fmul(dword f)  override { impl.fmul(f); }
+    void fdivp(int st)  override { impl.fdivp(st); }
+    void fdiv(int st)   override { impl.fdiv(st); }
+    void fdiv(qword f)  override { impl.fdiv(f); }
+    void fdiv(dword f)  override { impl.fdiv(f); }
+    void fdivrp(int st) override { impl.fdivrp(st); }
+    void fdivr(int st)  override { impl.fdivr(st); }
+    void fdivr(qword f) override { impl.fdivr(f); }
+    void fdivr(dword f) override { impl.fdivr(f); }
+    void fsqrt()        override { impl.fsqrt(); }
+
+    void fld(tword f) override { impl.fld(f); }
+    void fld(qword f) override { impl.fld(f); }
+    void fld(dword f) override { impl.fld(f); }
+    void fld(int st)  override { impl.fld(st); }
+
+    void fild(int16_t i) override { impl.fild(i); }
+    void fild(int32_t i) override { impl.fild(i); }
+    void fild(int64_t i) override { impl.fild(i); }
+
+    tword fstp_t() override { return impl.fstp_t(); }
+    qword fstp_l() override { return impl.fstp_l(); }
+    dword fstp_s() override { return impl.fstp_s(); }
+
+    void finit() override { impl.finit(); }
+    std::array<tword, 8> registers() override { return impl.registers(); }
+
+    void fldcw(uint16_t cw) override { impl.fldcw(cw); }
+    uint16_t fstcw() override { return impl.fstcw(); }
+
+    uint16_t fstsw() override { return impl.fstsw(); }
+    void fclex() override { impl.fclex(); }
+    Environment fnstenv() override { return impl.fnstenv(); }
+    SavedState fsave() override { return impl.fsave(); }
+};
@@ -0,0 +1,413 @@
+// Throughput of each instruction on soft_x87 and hard_x87, over a few operand mixes.
+//
+// Instructions that push or pop can't run on their own, so every kernel includes the fld or fstp
+// needed to keep the stack balanced, the name says what's under test, and fld+fstp m80 measures
+// that overhead on its own. Independent kernels load fresh operands every iteration, dependent
+// ones keep an accumulator on the stack so each instruction waits for the last.
+//
+// Results are written as JSON, one benchmark per line. Given a baseline file from an earlier run,
+// each result is compared against it and slowdowns beyond the threshold are flagged as regressions,
+// which also makes the exit status 2.
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fmt/format.h>
+
+#include "float_types.h"
+#include "real_x87.h"
+#include "sequence.h"
+#include "soft_x87.h"
+
+// Operands per pass, small enough to stay in L1
+constexpr size_t operand_count = 4096;
+
+enum class Mix { normal, denormal, special };
+
+const char *mix_name(Mix mix) {
+    switch (mix) {
+    case Mix::normal:   return "normal";
+    case Mix::denormal: return "denormal";
+    case Mix::special:  return "special";
+    }
+    return "unknown";
+}
+
+template<class T>
+std::vector<T> operands(Mix mix) {
+    auto values = uniform<T>(uint64_t(mix)) | transform([mix] (T f) {
+        uint64_t integer_bit = T::interger_bit_mask;
+        switch (mix) {
+        case Mix::normal:
+            // Keep twords in roughly double range, so accumulators don't overflow
+            if constexpr (std::is_same<T, tword>::value)
+                f.exponent = T::exponent_bias - 1024 + f.exponent % 2048;
+            else if (f.exponent == 0 || f.exponent == T::exponent_max)
+                f.exponent = T::exponent_bias;
+            f.significand |= integer_bit;
+            break;
+        case Mix::denormal:
+            f.exponent = 0;
+            f.significand = (f.significand & ~integer_bit) | 1;
+            break;
+        case Mix::special:
+            // Equal parts zeros, infinities and NaNs
+            switch (f.significand % 3) {
+            case 0: f.exponent = 0; f.significand = 0; break;
+            case 1: f.exponent = T::exponent_max; f.significand = integer_bit; break;
+            case 2: f.exponent = T::exponent_max; f.significand |= integer_bit | 1; break;
+            }
+            break;
+        }
+        return f;
+    }) | take(operand_count);
+    return std::vector<T>(values.begin(), values.end());
+}
+
+template<class T>
+std::vector<T> int_operands() {
+    auto values = uniform<T>() | take(operand_count);
+    return std::vector<T>(values.begin(), values.end());
+}
+
+struct Result {
+    std::string fpu;
+    std::string instruction;
+    std::string mix;
+    std::string chain;
+    double ns_per_op;
+
+    std::string key() const { return fpu + "|" + instruction + "|" + mix + "|" + chain; }
+};
+
+class Bench {
+public:
+    explicit Bench(const char *filter) : filter(filter) {}
+
+    // Times pass, which runs the instruction operand_count times. Takes the best of several
+    // runs, each long enough to swamp the timer.
+    template<class Pass>
+    void run(const char *fpu, const char *instruction, const char *mix, const char *chain, Pass pass) {
+        Result result = { fpu, instruction, mix, chain, 0 };
+        if (filter && result.key().find(filter) == std::string::npos)
+            return;
+
+        constexpr int repeats = 5;
+        constexpr double min_seconds = 0.01;
+
+        double best = 1e30;
+        for (int r = 0; r < repeats; r++) {
+            auto start = std::chrono::steady_clock::now();
+            size_t ops = 0;
+            std::chrono::duration<double> elapsed;
+            do {
+                pass();
+                ops += operand_count;
+                elapsed = std::chrono::steady_clock::now() - start;
+            } while (elapsed.count() < min_seconds);
+            best = std::min(best, elapsed.count() * 1e9 / ops);
+        }
+
+        result.ns_per_op = best;
+        results.push_back(result);
+        fmt::print(stderr, "{:<4} {:<14} {:<8} {:<11} {:>8.2f} ns/op\n", fpu, instruction, mix, chain, best);
+    }
+
+    std::vector<Result> results;
+
+private:
+    const char *filter;
+};
+
+template<class Fpu>
+void instruction_benchmarks(Bench &bench, const char *fpu_name) {
+    Fpu fpu;
+    std::vector<tword> sink_t(operand_count);
+    std::vector<qword> sink_l(operand_count);
+    std::vector<dword> sink_s(operand_count);
+
+    for (Mix mix : { Mix::normal, Mix::denormal, Mix::special }) {
+        const char *m = mix_name(mix);
+        auto t = operands<tword>(mix);
+        auto t2 = operands<tword>(mix);
+        auto l = operands<qword>(mix);
+        auto s = operands<dword>(mix);
+
+        // The pair every load and store kernel below is built on
+        bench.run(fpu_name, "fld+fstp m80", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) { fpu.fld(t[i]); sink_t[i] = fpu.fstp_t(); }
+        });
+
+        // Loads, each followed by fstp m80
+        bench.run(fpu_name, "fld m64", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) { fpu.fld(l[i]); sink_t[i] = fpu.fstp_t(); }
+        });
+        bench.run(fpu_name, "fld m32", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) { fpu.fld(s[i]); sink_t[i] = fpu.fstp_t(); }
+        });
+        bench.run(fpu_name, "fld st(0)", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) {
+                fpu.fld(t[i]);
+                fpu.fld(0);
+                sink_t[i] = fpu.fstp_t();
+                sink_t[i] = fpu.fstp_t();
+            }
+        });
+
+        // Stores, each after fld m80
+        bench.run(fpu_name, "fstp m64", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) { fpu.fld(t[i]); sink_l[i] = fpu.fstp_l(); }
+        });
+        bench.run(fpu_name, "fstp m32", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) { fpu.fld(t[i]); sink_s[i] = fpu.fstp_s(); }
+        });
+
+        // Additions. The independent ones load and store around each fadd.
+        bench.run(fpu_name, "fadd m64", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) { fpu.fld(t[i]); fpu.fadd(l[i]); sink_t[i] = fpu.fstp_t(); }
+        });
+        bench.run(fpu_name, "fadd m64", m, "dependent", [&] {
+            fpu.fld(t[0]);
+            for (size_t i = 0; i < operand_count; i++)
+                fpu.fadd(l[i]);
+            sink_t[0] = fpu.fstp_t();
+        });
+        bench.run(fpu_name, "fadd m32", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) { fpu.fld(t[i]); fpu.fadd(s[i]); sink_t[i] = fpu.fstp_t(); }
+        });
+        bench.run(fpu_name, "fadd m32", m, "dependent", [&] {
+            fpu.fld(t[0]);
+            for (size_t i = 0; i < operand_count; i++)
+                fpu.fadd(s[i]);
+            sink_t[0] = fpu.fstp_t();
+        });
+        bench.run(fpu_name, "fadd st(1)", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) {
+                fpu.fld(t2[i]);
+                fpu.fld(t[i]);
+                fpu.fadd(1);
+                sink_t[i] = fpu.fstp_t();
+                sink_t[i] = fpu.fstp_t();
+            }
+        });
+        bench.run(fpu_name, "fadd st(1)", m, "dependent", [&] {
+            fpu.fld(t2[0]);
+            fpu.fld(t[0]);
+            for (size_t i = 0; i < operand_count; i++)
+                fpu.fadd(1);
+            sink_t[0] = fpu.fstp_t();
+            sink_t[1] = fpu.fstp_t();
+        });
+        bench.run(fpu_name, "faddp st(1)", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) {
+                fpu.fld(t2[i]);
+                fpu.fld(t[i]);
+                fpu.faddp(1);
+                sink_t[i] = fpu.fstp_t();
+            }
+        });
+        bench.run(fpu_name, "faddp st(1)", m, "dependent", [&] {
+            fpu.fld(t2[0]);
+            for (size_t i = 0; i < operand_count; i++) {
+                fpu.fld(t[i]);
+                fpu.faddp(1);
+            }
+            sink_t[0] = fpu.fstp_t();
+        });
+
+        // Subtractions and multiplications, in the forms compilers use most
+        bench.run(fpu_name, "fsub m64", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) { fpu.fld(t[i]); fpu.fsub(l[i]); sink_t[i] = fpu.fstp_t(); }
+        });
+        bench.run(fpu_name, "fsub m64", m, "dependent", [&] {
+            fpu.fld(t[0]);
+            for (size_t i = 0; i < operand_count; i++)
+                fpu.fsub(l[i]);
+            sink_t[0] = fpu.fstp_t();
+        });
+        bench.run(fpu_name, "fsubp st(1)", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) {
+                fpu.fld(t2[i]);
+                fpu.fld(t[i]);
+                fpu.fsubp(1);
+                sink_t[i] = fpu.fstp_t();
+            }
+        });
+        bench.run(fpu_name, "fmul m64", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) { fpu.fld(t[i]); fpu.fmul(l[i]); sink_t[i] = fpu.fstp_t(); }
+        });
+        bench.run(fpu_name, "fmul m64", m, "dependent", [&] {
+            fpu.fld(t[0]);
+            for (size_t i = 0; i < operand_count; i++)
+                fpu.fmul(l[i]);
+            sink_t[0] = fpu.fstp_t();
+        });
+        bench.run(fpu_name, "fmulp st(1)", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) {
+                fpu.fld(t2[i]);
+                fpu.fld(t[i]);
+                fpu.fmulp(1);
+                sink_t[i] = fpu.fstp_t();
+            }
+        });
+
+        // Divisions and square roots, the slowest instructions to emulate
+        bench.run(fpu_name, "fdiv m64", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) { fpu.fld(t[i]); fpu.fdiv(l[i]); sink_t[i] = fpu.fstp_t(); }
+        });
+        bench.run(fpu_name, "fdiv m64", m, "dependent", [&] {
+            fpu.fld(t[0]);
+            for (size_t i = 0; i < operand_count; i++)
+                fpu.fdiv(l[i]);
+            sink_t[0] = fpu.fstp_t();
+        });
+        bench.run(fpu_name, "fdivp st(1)", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) {
+                fpu.fld(t2[i]);
+                fpu.fld(t[i]);
+                fpu.fdivp(1);
+                sink_t[i] = fpu.fstp_t();
+            }
+        });
+        bench.run(fpu_name, "fsqrt", m, "independent", [&] {
+            for (size_t i = 0; i < operand_count; i++) { fpu.fld(t[i]); fpu.fsqrt(); sink_t[i] = fpu.fstp_t(); }
+        });
+        bench.run(fpu_name, "fsqrt", m, "dependent", [&] {
+            fpu.fld(t[0]);
+            for (size_t i = 0; i < operand_count; i++)
+                fpu.fsqrt();
+            sink_t[0] = fpu.fstp_t();
+        });
+    }
+
+    auto i16 = int_operands<int16_t>();
+    auto i32 = int_operands<int32_t>();
+    auto i64 = int_operands<int64_t>();
+
+    bench.run(fpu_name, "fild m16", "integer", "independent", [&] {
+        for (size_t i = 0; i < operand_count; i++) { fpu.fild(i16[i]); sink_t[i] = fpu.fstp_t(); }
+    });
+    bench.run(fpu_name, "fild m32", "integer", "independent", [&] {
+        for (size_t i = 0; i < operand_count; i++) { fpu.fild(i32[i]); sink_t[i] = fpu.fstp_t(); }
+    });
+    bench.run(fpu_name, "fild m64", "integer", "independent", [&] {
+        for (size_t i = 0; i < operand_count; i++) { fpu.fild(i64[i]); sink_t[i] = fpu.fstp_t(); }
+    });
+}
+
+// Finds "key": in one line of our own JSON output and returns the value after it
+std::string json_field(const std::string &line, const char *key) {
+    std::string pattern = fmt::format("\"{}\": ", key);
+    size_t start = line.find(pattern);
+    if (start == std::string::npos)
+        return "";
+    start += pattern.size();
+
+    if (line[start] == '"') {
+        size_t end = line.find('"', start + 1);
+        return line.substr(start + 1, end - start - 1);
+    }
+    size_t end = line.find_first_of(",}", start);
+    return line.substr(start, end - start);
+}
+
+// Reads results from a file written by x87bench
+bool read_baseline(const char *path, std::map<std::string, double> &baseline) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), f)) {
+        std::string line = buffer;
+        if (line.find("\"ns_per_op\"") == std::string::npos)
+            continue;
+
+        Result r = { json_field(line, "fpu"), json_field(line, "instruction"), json_field(line, "mix"),
+                     json_field(line, "chain"), atof(json_field(line, "ns_per_op").c_str()) };
+        baseline[r.key()] = r.ns_per_op;
+    }
+    fclose(f);
+    return true;
+}
+
+void usage(const char *name) {
+    fmt::print(stderr, "usage: {} [--out file.json] [--baseline file.json] [--threshold percent] [--filter text]\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *out_path = nullptr;
+    const char *baseline_path = nullptr;
+    const char *filter = nullptr;
+    double threshold = 10;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_arg = i + 1 < argc;
+        if (strcmp(argv[i], "--out") == 0 && has_arg) {
+            out_path = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && has_arg) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && has_arg) {
+            threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && has_arg) {
+            filter = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::map<std::string, double> baseline;
+    if (baseline_path && !read_baseline(baseline_path, baseline)) {
+        fmt::print(stderr, "can't read baseline {}\n", baseline_path);
+        return 1;
+    }
+
+    Bench bench(filter);
+    instruction_benchmarks<soft_x87>(bench, "soft");
+    instruction_benchmarks<hard_x87>(bench, "hard");
+
+    FILE *out = stdout;
+    if (out_path && !(out = fopen(out_path, "w"))) {
+        fmt::print(stderr, "can't write {}\n", out_path);
+        return 1;
+    }
+
+    size_t regressions = 0;
+    fmt::print(out, "{{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < bench.results.size(); i++) {
+        const Result &r = bench.results[i];
+        std::string entry = fmt::format(
+            "{{\"fpu\": \"{}\", \"instruction\": \"{}\", \"mix\": \"{}\", \"chain\": \"{}\", "
+            "\"ns_per_op\": {:.3f}, \"ops_per_sec\": {:.0f}",
+            r.fpu, r.instruction, r.mix, r.chain, r.ns_per_op, 1e9 / r.ns_per_op);
+
+        auto base = baseline.find(r.key());
+        if (base != baseline.end()) {
+            double change = (r.ns_per_op / base->second - 1) * 100;
+            bool regressed = change > threshold;
+            entry += fmt::format(", \"baseline_ns_per_op\": {:.3f}, \"change_percent\": {:.1f}, \"regression\": {}",
+                                 base->second, change, regressed);
+            if (regressed) {
+                fmt::print(stderr, "regression: {} {} {} {} {:.2f} ns/op -> {:.2f} ns/op ({:+.1f}%)\n",
+                           r.fpu, r.instruction, r.mix, r.chain, base->second, r.ns_per_op, change);
+                regressions++;
+            }
+        }
+        fmt::print(out, "    {}}}{}\n", entry, i + 1 < bench.results.size() ? "," : "");
+    }
+    fmt::print(out, "  ]\n}}\n");
+    if (out != stdout)
+        fclose(out);
+
+    if (baseline_path)
+        fmt::print(stderr, "{} regressions beyond {}%\n", regressions, threshold);
+    return regressions ? 2 : 0;
+}
@@ -0,0 +1,455 @@
+// Coverage guided search for operands that reach new branches of soft_x87.
+//
+// soft_x87.cpp is built for this tool with -fsanitize-coverage=trace-pc, which calls
+// __sanitizer_cov_trace_pc at every basic block. Consecutive blocks are hashed into an edge map with
+// hit counts bucketed like AFL does, so going around a loop a different number of times also counts
+// as new. Every input is a short program for one target instruction, it runs on both fpus and
+// mismatches are reported like x87fuzz does. Inputs that reach new edges or hit counts are kept in
+// the corpus, which is mutated at bit level to find more. The corpus can be saved and reloaded,
+// replaying it checks the same paths in a fraction of the time uniform random inputs take.
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fmt/format.h>
+
+#include "float_types.h"
+#include "fuzz.h"
+#include "mismatch_log.h"
+#include "ops.h"
+#include "real_x87.h"
+#include "sequence.h"
+#include "soft_x87.h"
+#include "trace.h"
+
+constexpr size_t map_size = 1 << 14;
+
+static uint8_t hits[map_size];     // hits of each edge in the current run
+static uint16_t touched[map_size]; // edges hit in the current run
+static size_t touched_count = 0;
+static uintptr_t previous_block = 0;
+static uint64_t blocks_seen = 0;
+
+extern "C" void __sanitizer_cov_trace_pc() {
+    uintptr_t pc = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
+    uintptr_t block = CounterRng::mix(pc) & (map_size - 1);
+    size_t edge = block ^ previous_block;
+    previous_block = block >> 1;
+    blocks_seen++;
+
+    if (hits[edge] == 0)
+        touched[touched_count++] = edge;
+    if (hits[edge] != 255)
+        hits[edge]++;
+}
+
+// Every edge and hit count bucket seen so far
+class CoverageMap {
+public:
+    // Forgets anything hit outside a run
+    void begin_run() {
+        for (size_t i = 0; i < touched_count; i++)
+            hits[touched[i]] = 0;
+        touched_count = 0;
+        previous_block = 0;
+    }
+
+    // Merges the last run into the map, returns true if it reached anything new
+    bool end_run() {
+        bool new_coverage = false;
+        for (size_t i = 0; i < touched_count; i++) {
+            uint16_t edge = touched[i];
+            uint8_t bucket = hit_bucket(hits[edge]);
+            if (!(seen[edge] & bucket)) {
+                if (!seen[edge])
+                    edges++;
+                seen[edge] |= bucket;
+                buckets++;
+                new_coverage = true;
+            }
+            hits[edge] = 0;
+        }
+        touched_count = 0;
+        return new_coverage;
+    }
+
+    size_t edge_count() const { return edges; }
+    size_t bucket_count() const { return buckets; }
+
+private:
+    static uint8_t hit_bucket(uint8_t count) {
+        if (count <= 3)
+            return 1 << (count - 1);
+        if (count < 8)   return 8;
+        if (count < 16)  return 16;
+        if (count < 32)  return 32;
+        if (count < 128) return 64;
+        return 128;
+    }
+
+    uint8_t seen[map_size] = {};
+    size_t edges = 0;
+    size_t buckets = 0;
+};
+
+// The instructions under test, each as a short program: load operand a, then optionally combine it
+// with operand b, then optionally run an instruction on the stack, then store the result. The register
+// forms load b with fld m80 and pop it into a, fsqrt runs on a alone.
+struct Target {
+    const char *name;
+    TraceOp load;
+    TypeCode a;
+    TraceOp combine; // TraceOp::count if there is no operand b
+    TypeCode b;
+    TraceOp then;    // TraceOp::count if there is nothing to run on the stack
+    TraceOp store;
+};
+
+const Target targets[] = {
+    { "fld m32",   TraceOp::fld_m32,  TypeCode::dword, TraceOp::count,     TypeCode::none,  TraceOp::count,     TraceOp::fstp_m80 },
+    { "fld m64",   TraceOp::fld_m64,  TypeCode::qword, TraceOp::count,     TypeCode::none,  TraceOp::count,     TraceOp::fstp_m80 },
+    { "fild m16",  TraceOp::fild_m16, TypeCode::int16, TraceOp::count,     TypeCode::none,  TraceOp::count,     TraceOp::fstp_m80 },
+    { "fild m32",  TraceOp::fild_m32, TypeCode::int32, TraceOp::count,     TypeCode::none,  TraceOp::count,     TraceOp::fstp_m80 },
+    { "fild m64",  TraceOp::fild_m64, TypeCode::int64, TraceOp::count,     TypeCode::none,  TraceOp::count,     TraceOp::fstp_m80 },
+    { "fstp m32",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::count,     TypeCode::none,  TraceOp::count,     TraceOp::fstp_m32 },
+    { "fstp m64",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::count,     TypeCode::none,  TraceOp::count,     TraceOp::fstp_m64 },
+    { "faddp st",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::fld_m80,   TypeCode::tword, TraceOp::faddp_st,  TraceOp::fstp_m80 },
+    { "fadd m32",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::fadd_m32,  TypeCode::dword, TraceOp::count,     TraceOp::fstp_m80 },
+    { "fadd m64",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::fadd_m64,  TypeCode::qword, TraceOp::count,     TraceOp::fstp_m80 },
+    // Appended, so the indexes in existing corpora keep their meaning
+    { "fsubp st",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::fld_m80,   TypeCode::tword, TraceOp::fsubp_st,  TraceOp::fstp_m80 },
+    { "fsub m32",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::fsub_m32,  TypeCode::dword, TraceOp::count,     TraceOp::fstp_m80 },
+    { "fsub m64",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::fsub_m64,  TypeCode::qword, TraceOp::count,     TraceOp::fstp_m80 },
+    { "fsubrp st", TraceOp::fld_m80,  TypeCode::tword, TraceOp::fld_m80,   TypeCode::tword, TraceOp::fsubrp_st, TraceOp::fstp_m80 },
+    { "fsubr m32", TraceOp::fld_m80,  TypeCode::tword, TraceOp::fsubr_m32, TypeCode::dword, TraceOp::count,     TraceOp::fstp_m80 },
+    { "fsubr m64", TraceOp::fld_m80,  TypeCode::tword, TraceOp::fsubr_m64, TypeCode::qword, TraceOp::count,     TraceOp::fstp_m80 },
+    { "fmulp st",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::fld_m80,   TypeCode::tword, TraceOp::fmulp_st,  TraceOp::fstp_m80 },
+    { "fmul m32",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::fmul_m32,  TypeCode::dword, TraceOp::count,     TraceOp::fstp_m80 },
+    { "fmul m64",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::fmul_m64,  TypeCode::qword, TraceOp::count,     TraceOp::fstp_m80 },
+    { "fdivp st",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::fld_m80,   TypeCode::tword, TraceOp::fdivp_st,  TraceOp::fstp_m80 },
+    { "fdiv m32",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::fdiv_m32,  TypeCode::dword, TraceOp::count,     TraceOp::fstp_m80 },
+    { "fdiv m64",  TraceOp::fld_m80,  TypeCode::tword, TraceOp::fdiv_m64,  TypeCode::qword, TraceOp::count,     TraceOp::fstp_m80 },
+    { "fdivrp st", TraceOp::fld_m80,  TypeCode::tword, TraceOp::fld_m80,   TypeCode::tword, TraceOp::fdivrp_st, TraceOp::fstp_m80 },
+    { "fdivr m32", TraceOp::fld_m80,  TypeCode::tword, TraceOp::fdivr_m32, TypeCode::dword, TraceOp::count,     TraceOp::fstp_m80 },
+    { "fdivr m64", TraceOp::fld_m80,  TypeCode::tword, TraceOp::fdivr_m64, TypeCode::qword, TraceOp::count,     TraceOp::fstp_m80 },
+    { "fsqrt",     TraceOp::fld_m80,  TypeCode::tword, TraceOp::count,     TypeCode::none,  TraceOp::fsqrt,     TraceOp::fstp_m80 },
+};
+
+constexpr size_t target_count = sizeof(targets) / sizeof(targets[0]);
+
+struct CorpusHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+
+    static constexpr char expected_magic[8] = { 'X', '8', '7', 'C', 'O', 'R', 'P', 'S' };
+    static constexpr uint32_t current_version = 1;
+};
+
+struct CorpusEntry {
+    uint8_t target;
+    uint8_t reserved;
+    uint8_t a[10]; // raw bits of each operand, zero padded
+    uint8_t b[10];
+    uint8_t padding[2];
+};
+
+static_assert(sizeof(CorpusEntry) == 24, "Corpus entries are written as raw bytes");
+
+Program entry_program(const CorpusEntry &entry) {
+    auto with_operand = [] (TraceOp op, const uint8_t *bits) {
+        TraceInstruction ins = TraceInstruction::make(op);
+        memcpy(ins.operand, bits, sizeof(ins.operand));
+        return ins;
+    };
+
+    const Target &target = targets[entry.target];
+    Program program = { with_operand(target.load, entry.a) };
+    if (target.combine != TraceOp::count)
+        program.push_back(with_operand(target.combine, entry.b));
+    if (target.then != TraceOp::count)
+        program.push_back(TraceInstruction::make(target.then, trace_uses_st(target.then) ? 1 : 0));
+    program.push_back(TraceInstruction::make(target.store));
+    return program;
+}
+
+// Calls f with a default constructed value of the operand type
+template<class F>
+void with_operand_type(TypeCode type, F f) {
+    with_type<int16_t, int32_t, int64_t, dword, qword, tword>(type, f);
+}
+
+// Bit level mutations of one operand. Besides flipping bits, fields are set to values that sit on
+// the edges of the conversions: exponents at and around the limits of every format, significands
+// with their low bits set to exact halves, and sums of a value and its own negation.
+struct Mutator {
+    CounterRng rng;
+    uint64_t run;
+    uint64_t lane = 0;
+
+    uint64_t next() { return rng(run, lane++); }
+
+    template<class T>
+    void mutate(uint8_t *bits, const uint8_t *other) {
+        T value = decode_value<T>(bits);
+        uint64_t r = next();
+
+        if constexpr (std::is_integral<T>::value) {
+            switch (r % 4) {
+            case 0: value ^= T(1) << (next() % (sizeof(T) * 8)); break;
+            case 1: value += T(int64_t(next() % 33) - 16); break;
+            case 2: value = -value; break;
+            default: value = T(int64_t(next()) >> (next() % 64)); break;
+            }
+        } else {
+            constexpr int exponents[] = { 0, 1, T::exponent_max - 1, T::exponent_max, T::exponent_bias,
+                                          // Where twords overflow, underflow and go denormal in a dword or qword
+                                          tword::exponent_bias + 127, tword::exponent_bias - 126,
+                                          tword::exponent_bias - 149, tword::exponent_bias + 1023,
+                                          tword::exponent_bias - 1022, tword::exponent_bias - 1074 };
+            constexpr size_t exponent_choices = std::is_same<T, tword>::value ? 11 : 5;
+            switch (r % 8) {
+            case 0:
+            case 1: {
+                int bit = next() % T::bits;
+                bits[bit / 8] ^= 1 << (bit % 8);
+                return;
+            }
+            case 2:
+                value.exponent = exponents[next() % exponent_choices] + int(next() % 5) - 2;
+                break;
+            case 3: {
+                // Low bits become an exact half, or all zeros or ones
+                int width = 1 + next() % T::significand_width;
+                uint64_t mask = width == 64 ? ~0ull : (1ull << width) - 1;
+                uint64_t low[] = { 1ull << (width - 1), 0, mask, (1ull << (width - 1)) | 1 };
+                value.significand = (value.significand & ~mask) | low[next() % 4];
+                break;
+            }
+            case 4:
+                value.sign ^= 1;
+                break;
+            case 5:
+                value.exponent = value.exponent + int(next() % 9) - 4;
+                break;
+            case 6:
+                if (T::interger_bit_mask)
+                    value.significand = value.significand ^ T::interger_bit_mask;
+                break;
+            default:
+                // The other operand or its negation, so additions cancel exactly
+                if (other) {
+                    memcpy(bits, other, sizeof(T));
+                    bits[sizeof(T) - 1] ^= (next() & 1) << 7;
+                    return;
+                }
+                break;
+            }
+        }
+        memcpy(bits, reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void mutate(CorpusEntry &entry) {
+        const Target &target = targets[entry.target];
+        int count = 1 + next() % 4;
+        for (int i = 0; i < count; i++) {
+            bool second = target.b != TypeCode::none && next() % 2;
+            TypeCode type = second ? target.b : target.a;
+            uint8_t *bits = second ? entry.b : entry.a;
+            const uint8_t *other = target.b == TypeCode::none ? nullptr : second ? entry.a : entry.b;
+            with_operand_type(type, [&] (auto value) {
+                mutate<decltype(value)>(bits, type == TypeCode::tword ? other : nullptr);
+            });
+        }
+    }
+};
+
+class Search {
+public:
+    explicit Search(uint64_t limit) : limit(limit) {}
+
+    // Runs entry with coverage on, keeps it if it reached anything new. Returns true if it was kept.
+    bool run(const CorpusEntry &entry) {
+        Program program = entry_program(entry);
+        coverage.begin_run();
+        bool agree = programs_agree(soft, hard, program);
+        bool kept = coverage.end_run();
+        if (kept) {
+            corpus.push_back(entry);
+            per_target[entry.target]++;
+        }
+        executions++;
+
+        if (!agree) {
+            mismatches++;
+            if (printed[entry.target]++ < limit) {
+                fmt::memory_buffer listing;
+                programs_agree(soft, hard, program, &listing);
+                fmt::print("{} mismatch:\n{}", targets[entry.target].name, fmt::to_string(listing));
+            }
+        }
+        return kept;
+    }
+
+    CoverageMap coverage;
+    std::vector<CorpusEntry> corpus;
+    size_t per_target[target_count] = {};
+    uint64_t executions = 0;
+    uint64_t mismatches = 0;
+
+private:
+    soft_x87 soft;
+    hard_x87 hard;
+    uint64_t limit;
+    uint64_t printed[target_count] = {};
+};
+
+// Returns false if path exists but isn't a corpus this build can read
+bool load_corpus(const char *path, std::vector<CorpusEntry> &entries) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return true;
+
+    CorpusHeader header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1
+           && memcmp(header.magic, CorpusHeader::expected_magic, sizeof(header.magic)) == 0
+           && header.version == CorpusHeader::current_version && header.record_size == sizeof(CorpusEntry);
+
+    CorpusEntry entry;
+    while (ok && fread(&entry, sizeof(entry), 1, f) == 1) {
+        if (entry.target < target_count)
+            entries.push_back(entry);
+    }
+    fclose(f);
+    return ok;
+}
+
+bool save_corpus(const char *path, const std::vector<CorpusEntry> &entries) {
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return false;
+
+    CorpusHeader header = {};
+    memcpy(header.magic, CorpusHeader::expected_magic, sizeof(header.magic));
+    header.version = CorpusHeader::current_version;
+    header.record_size = sizeof(CorpusEntry);
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+           && fwrite(entries.data(), sizeof(CorpusEntry), entries.size(), f) == entries.size();
+    return fclose(f) == 0 && ok;
+}
+
+// A corpus entry with every operand completely random
+CorpusEntry random_entry(const CounterRng &rng, uint64_t index) {
+    CorpusEntry entry = {};
+    entry.target = rng(index, 0) % target_count;
+    const Target &target = targets[entry.target];
+    with_operand_type(target.a, [&] (auto value) {
+        value = random_value<decltype(value)>(rng, index, 1);
+        memcpy(entry.a, reinterpret_cast<const char*>(&value), sizeof(value));
+    });
+    with_operand_type(target.b, [&] (auto value) {
+        value = random_value<decltype(value)>(rng, index, 3);
+        memcpy(entry.b, reinterpret_cast<const char*>(&value), sizeof(value));
+    });
+    return entry;
+}
+
+void usage(const char *name) {
+    fmt::print(stderr, "usage: {} [--corpus file] [--runs n] [--seed n] [--limit n] [--random]\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *corpus_path = nullptr;
+    uint64_t runs = 1'000'000;
+    uint64_t seed = 0;
+    uint64_t limit = 3; // mismatches printed per target
+    bool random = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_arg = i + 1 < argc;
+        if (strcmp(argv[i], "--corpus") == 0 && has_arg) {
+            corpus_path = argv[++i];
+        } else if (strcmp(argv[i], "--runs") == 0 && has_arg) {
+            runs = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--seed") == 0 && has_arg) {
+            seed = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--limit") == 0 && has_arg) {
+            limit = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--random") == 0) {
+            random = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // A corpus from an earlier run is replayed first, a missing one is started from scratch
+    std::vector<CorpusEntry> saved;
+    if (corpus_path && !load_corpus(corpus_path, saved)) {
+        fmt::print(stderr, "{} is not a corpus, or from an incompatible version\n", corpus_path);
+        return 1;
+    }
+
+    Search search(limit);
+    CounterRng rng(seed);
+    auto start = std::chrono::steady_clock::now();
+
+    for (const CorpusEntry &entry : saved)
+        search.run(entry);
+
+    // Every target starts from a few of the values x87fuzz uses, from indexes runs never reach
+    for (uint8_t target = 0; target < target_count; target++) {
+        for (uint64_t i = 0; i < 16; i++) {
+            uint64_t index = ~0ull - target * 16 - i;
+            CorpusEntry entry = {};
+            entry.target = target;
+            with_operand_type(targets[target].a, [&] (auto value) {
+                value = fuzz_operand<decltype(value)>(rng(index, 0), rng(index, 1));
+                memcpy(entry.a, reinterpret_cast<const char*>(&value), sizeof(value));
+            });
+            with_operand_type(targets[target].b, [&] (auto value) {
+                value = fuzz_operand<decltype(value)>(rng(index, 2), rng(index, 3));
+                memcpy(entry.b, reinterpret_cast<const char*>(&value), sizeof(value));
+            });
+            search.run(entry);
+        }
+    }
+
+    if (blocks_seen == 0) {
+        fmt::print(stderr, "soft_x87 isn't built with -fsanitize-coverage=trace-pc, there's no coverage to search\n");
+        return 1;
+    }
+
+    for (uint64_t run = 0; run < runs; run++) {
+        if (random) {
+            search.run(random_entry(rng, run));
+            continue;
+        }
+
+        Mutator mutator = { rng, run };
+        CorpusEntry entry = search.corpus[mutator.next() % search.corpus.size()];
+        mutator.mutate(entry);
+        search.run(entry);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fmt::print("{:<10} {:>8}\n", "target", "corpus");
+    for (size_t i = 0; i < target_count; i++)
+        fmt::print("{:<10} {:>8}\n", targets[i].name, search.per_target[i]);
+    fmt::print("{} runs ({} replayed), {} edges, {} edge hit counts, {} mismatches, {:.0f} runs/sec\n",
+               search.executions, saved.size(), search.coverage.edge_count(), search.coverage.bucket_count(),
+               search.mismatches, search.executions / elapsed.count());
+
+    if (corpus_path && !save_corpus(corpus_path, search.corpus)) {
+        fmt::print(stderr, "failed to write {}\n", corpus_path);
+        return 1;
+    }
+    return search.mismatches ? 2 : 0;
+}
@@ -0,0 +1,168 @@
+// Runs random short x87 programs on soft_x87 and hard_x87 and shrinks the ones that disagree
+// to minimal reproducers.
+//
+// Programs are fuzzed in jobs on the runner's worker pool, each worker shrinks the first few failures
+// of its job on its own fpus. Failures that shrink to a program of the same shape as an earlier one are
+// only counted, so each likely bug is printed once. With --save, each new reproducer is also written
+// as a trace that x87trace can replay.
+
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fmt/format.h>
+
+#include "fuzz.h"
+#include "real_x87.h"
+#include "runner.h"
+#include "sequence.h"
+#include "soft_x87.h"
+#include "trace.h"
+
+using FuzzRunner = Runner<soft_x87, hard_x87>;
+
+struct Options {
+    uint64_t seed = 0;
+    uint64_t first = 0;
+    uint64_t programs = 1 << 20;
+    size_t max_length = 24;
+    size_t shrinks_per_job = 4;
+    const char *save_prefix = nullptr;
+};
+
+struct Failure {
+    uint64_t index;
+    size_t original_length;
+    Program program;
+    std::string listing;
+};
+
+struct JobResult {
+    uint64_t failures = 0;
+    std::vector<Failure> shrunk;
+};
+
+constexpr uint64_t programs_per_job = 4096;
+
+void fuzz_job(FuzzRunner::Worker &w, const Options &options, uint64_t first, uint64_t last, JobResult &result) {
+    CounterRng rng(options.seed);
+    Program program;
+    std::set<std::string> shapes;
+    size_t shrinks = 0;
+
+    auto fails = [&w] (const Program &candidate) {
+        return !programs_agree(w.fpu_a, w.fpu_b, candidate);
+    };
+
+    for (uint64_t index = first; index < last; index++) {
+        random_program(rng, index, options.max_length, program);
+        if (!fails(program))
+            continue;
+
+        result.failures++;
+        if (shrinks++ >= options.shrinks_per_job)
+            continue;
+
+        Program shrunk = shrink_program(program, fails);
+        if (!shapes.insert(program_shape(shrunk)).second)
+            continue;
+
+        fmt::memory_buffer listing;
+        programs_agree(w.fpu_a, w.fpu_b, shrunk, &listing);
+        result.shrunk.push_back({ index, program.size(), std::move(shrunk), fmt::to_string(listing) });
+    }
+}
+
+bool save_trace(const std::string &path, const Program &program) {
+    TraceWriter writer(path);
+    for (const TraceInstruction &ins : program)
+        writer.append(ins);
+    return writer.flush();
+}
+
+void usage(const char *name) {
+    fmt::print(stderr, "usage: {} [-j threads] [--seed n] [--first index] [--programs n] [--length n]\n"
+                       "          [--shrinks-per-job n] [--save prefix]\n", name);
+}
+
+int main(int argc, char **argv) {
+    unsigned threads = 0; // one per core
+    Options options;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_arg = i + 1 < argc;
+        if (strcmp(argv[i], "-j") == 0 && has_arg) {
+            threads = atoi(argv[++i]);
+        } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2]) {
+            threads = atoi(argv[i] + 2);
+        } else if (strcmp(argv[i], "--seed") == 0 && has_arg) {
+            options.seed = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--first") == 0 && has_arg) {
+            options.first = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--programs") == 0 && has_arg) {
+            options.programs = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--length") == 0 && has_arg) {
+            options.max_length = std::max(1ull, strtoull(argv[++i], nullptr, 0));
+        } else if (strcmp(argv[i], "--shrinks-per-job") == 0 && has_arg) {
+            options.shrinks_per_job = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--save") == 0 && has_arg) {
+            options.save_prefix = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    FuzzRunner runner(threads, "soft", "hard");
+    auto start = std::chrono::steady_clock::now();
+
+    std::set<std::string> shapes;
+    uint64_t failures = 0;
+    uint64_t end = options.first + options.programs;
+
+    // Jobs are submitted in rounds, and their results reported in order once the round is done
+    const uint64_t round_size = programs_per_job * 4 * runner.size();
+    for (uint64_t round = options.first; round < end; round += round_size) {
+        uint64_t round_end = std::min(end, round + round_size);
+        std::vector<JobResult> results((round_end - round + programs_per_job - 1) / programs_per_job);
+
+        for (size_t job = 0; job < results.size(); job++) {
+            uint64_t first = round + job * programs_per_job;
+            uint64_t last = std::min(round_end, first + programs_per_job);
+            JobResult *result = &results[job];
+            runner.submit([&options, first, last, result] (FuzzRunner::Worker &w, FuzzRunner::Output &) {
+                fuzz_job(w, options, first, last, *result);
+            });
+        }
+        runner.drain();
+
+        for (JobResult &result : results) {
+            failures += result.failures;
+            for (Failure &failure : result.shrunk) {
+                if (!shapes.insert(program_shape(failure.program)).second)
+                    continue;
+
+                fmt::print("seed {} program {}: {} instructions, shrunk to {}\n{}", options.seed, failure.index,
+                           failure.original_length, failure.program.size(), failure.listing);
+
+                if (options.save_prefix) {
+                    std::string path = fmt::format("{}{}.trace", options.save_prefix, shapes.size());
+                    if (!save_trace(path, failure.program))
+                        fmt::print(stderr, "failed to write {}\n", path);
+                }
+            }
+        }
+        fflush(stdout);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fmt::print("{} programs, {} failed, {} distinct shrunk failures, {:.0f} programs/sec\n",
+               options.programs, failures, shapes.size(), options.programs / elapsed.count());
+    return failures ? 2 : 0;
+}
@@ -0,0 +1,188 @@
+// Reads a mismatch log written by x87test --log, prints or filters its records,
+// and can re-execute them on both fpus to reproduce a bug without rerunning the whole sweep.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include "classify.h"
+#include "float_types.h"
+#include "mismatch_log.h"
+#include "ops.h"
+#include "real_x87.h"
+#include "runner.h"
+#include "soft_x87.h"
+
+struct Filter {
+    const char *op = nullptr;
+    const char *in = nullptr;
+    const char *out = nullptr;
+    bool has_seed = false;
+    uint64_t seed = 0;
+    uint64_t first = 0;
+    uint64_t last = UINT64_MAX;
+
+    bool matches(const MismatchRecord &record) const {
+        return (!op || strcmp(op, op_name(record.op)) == 0)
+            && (!in || strcmp(in, type_name(record.in_type)) == 0)
+            && (!out || strcmp(out, type_name(record.out_type)) == 0)
+            && (!has_seed || seed == record.seed)
+            && record.index >= first && record.index <= last;
+    }
+};
+
+// Logs from before the control word was recorded have 0, they ran with the default
+uint16_t record_control_word(const MismatchRecord &record) {
+    return record.control_word ? record.control_word : default_control_word;
+}
+
+void print_record(size_t number, const MismatchRecord &record) {
+    fmt::print("#{} {} {}->{} cw {:#06x} seed {} index {}: {}\n", number, op_name(record.op),
+               type_name(record.in_type), type_name(record.out_type), record_control_word(record), record.seed,
+               record.index, describe(record));
+}
+
+// Runs the record's op on both fpus again, the same way the runner does, and prints the
+// new results. Returns 1 if they still differ, 0 if they now agree and -1 if the record
+// can't be replayed.
+int rerun(const MismatchRecord &record) {
+    int result = -1;
+    with_values(record, [&] (auto in, auto a, auto) {
+        using In = decltype(in);
+        using Out = decltype(a);
+
+        with_op<In, Out>(record.op, [&] (auto op) {
+            soft_x87 soft;
+            hard_x87 hard;
+            soft.fldcw(record_control_word(record));
+            hard.fldcw(record_control_word(record));
+            Out soft_result, hard_result;
+            execute(soft, op, &in, &soft_result, 1);
+            execute(hard, op, &in, &hard_result, 1);
+
+            fmt::print("    rerun: {} and {}\n", describe(soft_result), describe(hard_result));
+            result = soft_result != hard_result;
+        });
+    });
+    return result;
+}
+
+void usage(const char *name) {
+    fmt::print(stderr, "usage: {} log [--op name] [--in type] [--out type] [--seed n]\n"
+                       "          [--first index] [--last index] [--limit n] [--rerun | --summary]\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *path = nullptr;
+    Filter filter;
+    uint64_t limit = UINT64_MAX;
+    bool replay = false;
+    bool summary = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_arg = i + 1 < argc;
+        if (strcmp(argv[i], "--op") == 0 && has_arg) {
+            filter.op = argv[++i];
+        } else if (strcmp(argv[i], "--in") == 0 && has_arg) {
+            filter.in = argv[++i];
+        } else if (strcmp(argv[i], "--out") == 0 && has_arg) {
+            filter.out = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && has_arg) {
+            filter.has_seed = true;
+            filter.seed = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--first") == 0 && has_arg) {
+            filter.first = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--last") == 0 && has_arg) {
+            filter.last = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--limit") == 0 && has_arg) {
+            limit = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--rerun") == 0) {
+            replay = true;
+        } else if (strcmp(argv[i], "--summary") == 0) {
+            summary = true;
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!path) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fmt::print(stderr, "can't open {}: {}\n", path, strerror(errno));
+        return 1;
+    }
+
+    size_t size = st.st_size;
+    if (size < sizeof(MismatchLogHeader)) {
+        fmt::print(stderr, "{} is not a mismatch log\n", path);
+        return 1;
+    }
+
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fmt::print(stderr, "can't map {}: {}\n", path, strerror(errno));
+        return 1;
+    }
+
+    const auto *header = static_cast<const MismatchLogHeader*>(data);
+    if (memcmp(header->magic, MismatchLogHeader::expected_magic, sizeof(header->magic)) != 0
+            || header->version != MismatchLogHeader::current_version
+            || header->record_size != sizeof(MismatchRecord)) {
+        fmt::print(stderr, "{} is not a mismatch log, or from an incompatible version\n", path);
+        return 1;
+    }
+
+    // A partially written last record is ignored
+    const auto *records = reinterpret_cast<const MismatchRecord*>(header + 1);
+    size_t count = (size - sizeof(MismatchLogHeader)) / sizeof(MismatchRecord);
+
+    size_t matched = 0;
+    size_t still_differ = 0;
+    size_t not_replayable = 0;
+    MismatchBuckets buckets;
+    for (size_t i = 0; i < count && matched < limit; i++) {
+        if (!filter.matches(records[i]))
+            continue;
+        matched++;
+
+        if (summary) {
+            buckets.add(classify(records[i]), records[i]);
+            continue;
+        }
+
+        print_record(i, records[i]);
+        if (replay) {
+            int result = rerun(records[i]);
+            if (result > 0)
+                still_differ++;
+            else if (result < 0)
+                not_replayable++;
+        }
+    }
+
+    fmt::print("{} of {} records selected\n", matched, count);
+    buckets.summary(stdout);
+    if (replay)
+        fmt::print("{} still differ, {} now match, {} can't be replayed\n",
+                   still_differ, matched - still_differ - not_replayable, not_replayable);
+
+    munmap(data, size);
+    return 0;
+}
@@ -0,0 +1,170 @@
+// Replays an x87 instruction trace through soft_x87 and hard_x87 and reports where they diverge.
+//
+// Every store's result is compared, and the whole stack after every N instructions. After a mismatch
+// soft_x87's stack is reset to the hardware's, so one bug doesn't hide every later one. Instructions
+// that would overflow or underflow the stack are reported and skipped on both fpus, as the stack
+// comparisons assume a well formed stack.
+
+#include <algorithm>
+#include <chrono>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fmt/format.h>
+
+#include "float_types.h"
+#include "real_x87.h"
+#include "soft_x87.h"
+#include "trace.h"
+
+struct Options {
+    uint64_t every = 1;  // compare the stack after this many instructions
+    uint64_t limit = 10; // mismatches and faults printed
+    bool resync = true;
+};
+
+class Replay {
+public:
+    explicit Replay(const Options &options) : options(options) {}
+
+    void step(uint64_t index, const TraceInstruction &ins) {
+        if (int fault = trace_stack_fault(ins, depth)) {
+            if (faults++ < options.limit)
+                fmt::print("#{} {}: stack {} at depth {}, skipped\n", index, describe(ins),
+                           fault < 0 ? "underflow" : "overflow", depth);
+            return;
+        }
+
+        uint8_t stored_soft[10], stored_hard[10];
+        execute(soft, ins, stored_soft);
+        execute(hard, ins, stored_hard);
+        depth += trace_stack_effect(ins.op);
+
+        bool mismatch = false;
+        size_t result_size = trace_result_size(ins.op);
+        if (result_size && memcmp(stored_soft, stored_hard, result_size) != 0) {
+            mismatch = true;
+            if (mismatches < options.limit)
+                fmt::print("#{} {}: stored {} and {}\n", index, describe(ins),
+                           describe_stored(ins.op, stored_soft), describe_stored(ins.op, stored_hard));
+        }
+
+        if (++since_check == options.every) {
+            since_check = 0;
+            mismatch |= compare_stacks(index, ins);
+        }
+
+        if (mismatch) {
+            mismatches++;
+            if (options.resync)
+                resync();
+        }
+    }
+
+    uint64_t mismatch_count() const { return mismatches; }
+    uint64_t fault_count() const { return faults; }
+
+private:
+    bool compare_stacks(uint64_t index, const TraceInstruction &ins) {
+        std::array<tword, 8> soft_regs = soft.registers();
+        std::array<tword, 8> hard_regs = hard.registers();
+
+        bool differ = false;
+        for (int i = 0; i < depth; i++) {
+            if (soft_regs[i] == hard_regs[i])
+                continue;
+            if (mismatches < options.limit) {
+                if (!differ)
+                    fmt::print("#{} {}: stack differs\n", index, describe(ins));
+                fmt::print("    ST({}) {} and {}\n", i, describe(soft_regs[i]), describe(hard_regs[i]));
+            }
+            differ = true;
+        }
+        return differ;
+    }
+
+    // Replaces soft_x87's stack with the hardware's
+    void resync() {
+        std::array<tword, 8> regs = hard.registers();
+        for (int i = 0; i < depth; i++)
+            soft.fstp_t();
+        for (int i = depth - 1; i >= 0; i--)
+            soft.fld(regs[i]);
+    }
+
+    Options options;
+    soft_x87 soft;
+    hard_x87 hard;
+    int depth = 0;
+    uint64_t since_check = 0;
+    uint64_t mismatches = 0;
+    uint64_t faults = 0;
+};
+
+void usage(const char *name) {
+    fmt::print(stderr, "usage: {} trace [--every n] [--limit n] [--no-resync] [--decode-only]\n"
+                       "       trace can be - for stdin\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *path = nullptr;
+    Options options;
+    bool decode_only = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_arg = i + 1 < argc;
+        if (strcmp(argv[i], "--every") == 0 && has_arg) {
+            options.every = std::max(1ull, strtoull(argv[++i], nullptr, 0));
+        } else if (strcmp(argv[i], "--limit") == 0 && has_arg) {
+            options.limit = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--no-resync") == 0) {
+            options.resync = false;
+        } else if (strcmp(argv[i], "--decode-only") == 0) {
+            decode_only = true;
+        } else if ((argv[i][0] != '-' || strcmp(argv[i], "-") == 0) && !path) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!path) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    TraceReader reader(path);
+    if (!reader.failure().empty()) {
+        fmt::print(stderr, "{}\n", reader.failure());
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Replay replay(options);
+    TraceInstruction ins;
+    if (decode_only) {
+        // Just reads the trace, to check the decoder keeps up with the fpus
+        uint8_t sink = 0;
+        while (reader.next(ins))
+            sink ^= ins.operand[0];
+        asm volatile("" : : "r"(sink));
+    } else {
+        while (reader.next(ins))
+            replay.step(reader.count() - 1, ins);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (!reader.failure().empty())
+        fmt::print(stderr, "{}\n", reader.failure());
+
+    fmt::print("{} instructions, {} mismatches, {} stack faults, {:.1f}M instructions/sec\n",
+               reader.count(), replay.mismatch_count(), replay.fault_count(),
+               reader.count() / elapsed.count() / 1e6);
+
+    if (!reader.failure().empty())
+        return 1;
+    return replay.mismatch_count() ? 2 : 0;
+}